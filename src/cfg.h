@@ -0,0 +1,400 @@
+
+#ifndef QBN_CFG_H
+#define QBN_CFG_H
+
+#include <assert.h>
+#include "qbn.h"
+
+// Control flow graph analysis of a function: predecessors, reverse postorder, the dominator tree after
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm", and loop nesting. It is computed on the
+// first query and kept in the function until the blocks or jumps change. Everything is indexed by block id.
+
+#define QBN_CFG_NONE ((unsigned int) -1)
+
+struct QbnCfg {
+    unsigned int n_blocks;
+    unsigned int* first_pred;   // predecessors of block i are preds[first_pred[i]] up to first_pred[i+1]
+    unsigned int* preds;
+    unsigned int* order;        // reachable blocks in reverse postorder
+    unsigned int n_reachable;
+    unsigned int* rpo_index;    // position in order, QBN_CFG_NONE if unreachable
+    unsigned int* idom;         // immediate dominator, the first block is its own, QBN_CFG_NONE if unreachable
+    unsigned int* first_child;  // children in the dominator tree, like the predecessors
+    unsigned int* children;
+    unsigned int* dom_pre;      // preorder and postorder numbers in the dominator tree
+    unsigned int* dom_post;
+    unsigned int* loop_header;  // header of the innermost loop containing the block, QBN_CFG_NONE if none
+    unsigned int* loop_depth;
+};
+
+int qbn_block_successors(QbnBlock* block, QbnBlock** successors) {
+    if (block->jmp_type == QBN_JUMP_NONE || QBN_IS_RETURN(block->jmp_type)) {
+        return 0;
+    }
+    int n = 0;
+    successors[n++] = block->jmp.dest.True;
+    if (block->jmp_type != QBN_JUMP_UNCONDITIONAL && block->jmp.dest.False != block->jmp.dest.True) {
+        successors[n++] = block->jmp.dest.False;
+    }
+    return n;
+}
+
+unsigned int* qbn_cfg_alloc(size_t count) {
+    unsigned int* array = malloc(sizeof(unsigned int) * (count + 1));
+    if (!array) {
+        util_vector_no_memory();
+    }
+    return array;
+}
+
+void qbn_cfg_predecessors(QbnFn* fn, QbnCfg* cfg) {
+    size_t n_blocks = cfg->n_blocks;
+    unsigned int* first = calloc(n_blocks + 2, sizeof(unsigned int));
+    unsigned int* list = qbn_cfg_alloc(2 * n_blocks);
+    if (!first) {
+        util_vector_no_memory();
+    }
+    QbnBlock* successors[2];
+    for (int i=0; i<n_blocks; i++) {
+        int n_successors = qbn_block_successors(fn->blocks[i], successors);
+        for (int s=0; s<n_successors; s++) {
+            first[successors[s]->id + 2]++;
+        }
+    }
+    for (int i=2; i<=n_blocks; i++) {
+        first[i] += first[i-1];
+    }
+    // first[id+1] is the insertion point while filling and the end of the range afterwards
+    for (int i=0; i<n_blocks; i++) {
+        int n_successors = qbn_block_successors(fn->blocks[i], successors);
+        for (int s=0; s<n_successors; s++) {
+            list[first[successors[s]->id + 1]++] = i;
+        }
+    }
+    cfg->first_pred = first;
+    cfg->preds = list;
+}
+
+void qbn_cfg_reverse_postorder(QbnFn* fn, QbnCfg* cfg) {
+    size_t n_blocks = cfg->n_blocks;
+    unsigned int* stack = qbn_cfg_alloc(n_blocks);
+    unsigned char* next = calloc(n_blocks + 1, 1);  // successors visited so far
+    unsigned int* order = qbn_cfg_alloc(n_blocks);
+    unsigned int* rpo_index = qbn_cfg_alloc(n_blocks);
+    if (!next) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_blocks; i++) {
+        rpo_index[i] = QBN_CFG_NONE;
+    }
+    int n_stack = 0;
+    unsigned int n_done = 0;
+    if (n_blocks) {
+        stack[n_stack++] = 0;
+        rpo_index[0] = 0;
+    }
+    while (n_stack) {
+        QbnBlock* block = fn->blocks[stack[n_stack-1]];
+        QbnBlock* successors[2];
+        int n_successors = qbn_block_successors(block, successors);
+        if (next[block->id] < n_successors) {
+            QbnBlock* successor = successors[next[block->id]++];
+            if (rpo_index[successor->id] == QBN_CFG_NONE) {
+                rpo_index[successor->id] = 0;  // on the stack
+                stack[n_stack++] = successor->id;
+            }
+        } else {
+            // postorder from the back
+            n_stack--;
+            n_done++;
+            order[n_blocks - n_done] = block->id;
+        }
+    }
+    // move to the front if some blocks are unreachable
+    memmove(order, order + n_blocks - n_done, sizeof(unsigned int) * n_done);
+    for (int i=0; i<n_done; i++) {
+        rpo_index[order[i]] = i;
+    }
+    free(next);
+    free(stack);
+    cfg->order = order;
+    cfg->n_reachable = n_done;
+    cfg->rpo_index = rpo_index;
+}
+
+unsigned int qbn_cfg_intersect(QbnCfg* cfg, unsigned int a, unsigned int b) {
+    while (a != b) {
+        while (cfg->rpo_index[a] > cfg->rpo_index[b]) {
+            a = cfg->idom[a];
+        }
+        while (cfg->rpo_index[b] > cfg->rpo_index[a]) {
+            b = cfg->idom[b];
+        }
+    }
+    return a;
+}
+
+void qbn_cfg_dominators(QbnCfg* cfg) {
+    size_t n_blocks = cfg->n_blocks;
+    cfg->idom = qbn_cfg_alloc(n_blocks);
+    for (int i=0; i<n_blocks; i++) {
+        cfg->idom[i] = QBN_CFG_NONE;
+    }
+    if (cfg->n_reachable == 0) {
+        cfg->first_child = calloc(n_blocks + 1, sizeof(unsigned int));
+        cfg->children = qbn_cfg_alloc(0);
+        cfg->dom_pre = qbn_cfg_alloc(n_blocks);
+        cfg->dom_post = qbn_cfg_alloc(n_blocks);
+        return;
+    }
+    cfg->idom[cfg->order[0]] = cfg->order[0];
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i=1; i<cfg->n_reachable; i++) {
+            unsigned int id = cfg->order[i];
+            unsigned int new_idom = QBN_CFG_NONE;
+            for (unsigned int p=cfg->first_pred[id]; p<cfg->first_pred[id+1]; p++) {
+                unsigned int pred = cfg->preds[p];
+                if (cfg->idom[pred] == QBN_CFG_NONE) {
+                    // not processed yet or unreachable
+                    continue;
+                }
+                new_idom = new_idom == QBN_CFG_NONE ? pred : qbn_cfg_intersect(cfg, pred, new_idom);
+            }
+            if (cfg->idom[id] != new_idom) {
+                cfg->idom[id] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    // the tree as child lists, numbered for constant time dominance queries
+    unsigned int* first = calloc(n_blocks + 2, sizeof(unsigned int));
+    unsigned int* children = qbn_cfg_alloc(n_blocks);
+    if (!first) {
+        util_vector_no_memory();
+    }
+    for (int i=1; i<cfg->n_reachable; i++) {
+        first[cfg->idom[cfg->order[i]] + 2]++;
+    }
+    for (int i=2; i<=n_blocks; i++) {
+        first[i] += first[i-1];
+    }
+    for (int i=1; i<cfg->n_reachable; i++) {
+        children[first[cfg->idom[cfg->order[i]] + 1]++] = cfg->order[i];
+    }
+    cfg->first_child = first;
+    cfg->children = children;
+
+    cfg->dom_pre = qbn_cfg_alloc(n_blocks);
+    cfg->dom_post = qbn_cfg_alloc(n_blocks);
+    unsigned int* stack = qbn_cfg_alloc(n_blocks);
+    unsigned int* next = qbn_cfg_alloc(n_blocks);
+    unsigned int n_stack = 0;
+    unsigned int counter = 0;
+    stack[n_stack++] = cfg->order[0];
+    next[cfg->order[0]] = first[cfg->order[0]];
+    cfg->dom_pre[cfg->order[0]] = counter++;
+    while (n_stack) {
+        unsigned int id = stack[n_stack-1];
+        if (next[id] < first[id+1]) {
+            unsigned int child = children[next[id]++];
+            next[child] = first[child];
+            cfg->dom_pre[child] = counter++;
+            stack[n_stack++] = child;
+        } else {
+            cfg->dom_post[id] = counter++;
+            n_stack--;
+        }
+    }
+    free(next);
+    free(stack);
+}
+
+bool qbn_cfg_dominates(QbnCfg* cfg, unsigned int a, unsigned int b) {
+    // whether every path from the first block to b passes a, unreachable blocks dominate nothing
+    if (cfg->idom[a] == QBN_CFG_NONE || cfg->idom[b] == QBN_CFG_NONE) {
+        return false;
+    }
+    return cfg->dom_pre[a] <= cfg->dom_pre[b] && cfg->dom_post[b] <= cfg->dom_post[a];
+}
+
+void qbn_cfg_loops(QbnCfg* cfg) {
+    // natural loops of the back edges, a header that comes later in reverse postorder is nested deeper
+    size_t n_blocks = cfg->n_blocks;
+    cfg->loop_header = qbn_cfg_alloc(n_blocks);
+    cfg->loop_depth = calloc(n_blocks + 1, sizeof(unsigned int));
+    unsigned int* seen = qbn_cfg_alloc(n_blocks);  // header that last visited the block
+    unsigned int* work = qbn_cfg_alloc(n_blocks);
+    if (!cfg->loop_depth) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_blocks; i++) {
+        cfg->loop_header[i] = QBN_CFG_NONE;
+        seen[i] = QBN_CFG_NONE;
+    }
+    for (int i=0; i<cfg->n_reachable; i++) {
+        unsigned int header = cfg->order[i];
+        unsigned int n_work = 0;
+        for (unsigned int p=cfg->first_pred[header]; p<cfg->first_pred[header+1]; p++) {
+            unsigned int pred = cfg->preds[p];
+            if (qbn_cfg_dominates(cfg, header, pred) && seen[pred] != header) {
+                seen[pred] = header;
+                work[n_work++] = pred;
+            }
+        }
+        if (n_work == 0) {
+            continue;
+        }
+        seen[header] = header;
+        cfg->loop_header[header] = header;
+        cfg->loop_depth[header]++;
+        while (n_work) {
+            unsigned int id = work[--n_work];
+            if (id == header) {
+                continue;
+            }
+            cfg->loop_header[id] = header;
+            cfg->loop_depth[id]++;
+            for (unsigned int p=cfg->first_pred[id]; p<cfg->first_pred[id+1]; p++) {
+                unsigned int pred = cfg->preds[p];
+                if (seen[pred] != header && cfg->idom[pred] != QBN_CFG_NONE) {
+                    seen[pred] = header;
+                    work[n_work++] = pred;
+                }
+            }
+        }
+    }
+    free(work);
+    free(seen);
+}
+
+void qbn_fn_invalidate_cfg(QbnFn* fn) {
+    QbnCfg* cfg = fn->cfg;
+    if (cfg == NULL) {
+        return;
+    }
+    free(cfg->first_pred);
+    free(cfg->preds);
+    free(cfg->order);
+    free(cfg->rpo_index);
+    free(cfg->idom);
+    free(cfg->first_child);
+    free(cfg->children);
+    free(cfg->dom_pre);
+    free(cfg->dom_post);
+    free(cfg->loop_header);
+    free(cfg->loop_depth);
+    free(cfg);
+    fn->cfg = NULL;
+}
+
+QbnCfg* qbn_fn_cfg(QbnFn* fn) {
+    if (fn->cfg != NULL) {
+        return fn->cfg;
+    }
+    QbnCfg* cfg = malloc(sizeof(QbnCfg));
+    if (!cfg) {
+        util_vector_no_memory();
+    }
+    cfg->n_blocks = fn->vec_blocks->length;
+    qbn_cfg_predecessors(fn, cfg);
+    qbn_cfg_reverse_postorder(fn, cfg);
+    qbn_cfg_dominators(cfg);
+    qbn_cfg_loops(cfg);
+    fn->cfg = cfg;
+    return cfg;
+}
+
+void qbn_fn_split_entry(QbnFn* fn) {
+    // the first block is where the function starts, if a jump leads back to it an empty block is put in
+    // front that falls through to it: code that runs once on entry and phi operands for it go there
+    QbnCfg* cfg = qbn_fn_cfg(fn);
+    if (cfg->first_pred[0] == cfg->first_pred[1]) {
+        return;
+    }
+    if (fn->lowered.first == NULL) {
+        qbn_instr_arena_init(&fn->lowered, QBN_LIMIT_FN_INSTR_CHUNK);
+    }
+    QbnBlock* entry = util_arena_alloc(&fn->context->arena, sizeof(QbnBlock));
+    entry->instr = qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_BLOCK_END});
+    entry->phi = NULL;
+    entry->jmp_type = QBN_JUMP_UNCONDITIONAL;
+    entry->jmp.dest.True = fn->blocks[0];
+    entry->jmp.dest.False = NULL;
+    entry->jmp.dest.cond = QBN_REF0;
+    size_t n_blocks = fn->vec_blocks->length;
+    util_vector_grow(fn->vec_blocks, 1);
+    memmove(&fn->blocks[1], &fn->blocks[0], sizeof(QbnBlock*) * n_blocks);
+    fn->blocks[0] = entry;
+    for (int i=0; i<=n_blocks; i++) {
+        fn->blocks[i]->id = i;
+    }
+    qbn_fn_invalidate_cfg(fn);
+}
+
+QbnBlock* qbn_cfg_fallthrough(QbnCfg* cfg, QbnBlock* block, bool* placed) {
+    // the successor to lay out right after the block, NULL if none is left
+    QbnBlock* successors[2];
+    int n_successors = qbn_block_successors(block, successors);
+    QbnBlock* best = NULL;
+    for (int s=0; s<n_successors; s++) {
+        QbnBlock* successor = successors[s];
+        if (placed[successor->id]) {
+            continue;
+        }
+        // stay inside the loop, then prefer a block that can't be reached otherwise
+        if (best == NULL || cfg->loop_depth[successor->id] > cfg->loop_depth[best->id] ||
+            (cfg->loop_depth[successor->id] == cfg->loop_depth[best->id] &&
+             cfg->first_pred[successor->id] + 1 == cfg->first_pred[successor->id + 1] &&
+             cfg->first_pred[best->id] + 1 != cfg->first_pred[best->id + 1])) {
+            best = successor;
+        }
+    }
+    return best;
+}
+
+void qbn_fn_layout_blocks(QbnFn* fn) {
+    // orders the blocks so that as many jumps as possible fall through to the next block: chains of
+    // successors are laid out one after another, and a new chain starts at the first block left in
+    // reverse postorder. The first block stays first, unreachable ones go last. Ids are renumbered.
+    QbnCfg* cfg = qbn_fn_cfg(fn);
+    size_t n_blocks = cfg->n_blocks;
+    if (n_blocks < 3) {
+        return;
+    }
+    bool* placed = calloc(n_blocks, sizeof(bool));
+    QbnBlock** order = malloc(sizeof(QbnBlock*) * n_blocks);
+    if (!placed || !order) {
+        util_vector_no_memory();
+    }
+    unsigned int n_placed = 0;
+    unsigned int next_rpo = 0;
+    QbnBlock* block = fn->blocks[0];
+    while (block != NULL) {
+        placed[block->id] = true;
+        order[n_placed++] = block;
+        block = qbn_cfg_fallthrough(cfg, block, placed);
+        while (block == NULL && next_rpo < cfg->n_reachable) {
+            unsigned int id = cfg->order[next_rpo++];
+            if (!placed[id]) {
+                block = fn->blocks[id];
+            }
+        }
+    }
+    for (int i=0; i<n_blocks; i++) {
+        if (!placed[i]) {
+            order[n_placed++] = fn->blocks[i];
+        }
+    }
+    for (int i=0; i<n_blocks; i++) {
+        fn->blocks[i] = order[i];
+        fn->blocks[i]->id = i;
+    }
+    free(order);
+    free(placed);
+    qbn_fn_invalidate_cfg(fn);
+}
+
+#endif //QBN_CFG_H
@@ -0,0 +1,222 @@
+
+#ifndef QBN_DCE_H
+#define QBN_DCE_H
+
+#include "qbn.h"
+#include "cfg.h"
+#include "ssa.h"
+
+// Copy propagation and dead code elimination on ssa form. A copy between temps of the same type makes its
+// destination an alias: every read of it reads the source instead and the copy itself is left unused.
+// Dead code elimination then marks everything the side effects, returns and branches need, starting from
+// them and following the definitions of their arguments, and removes the other instructions and phis.
+
+bool qbn_op_is_pure(QbnOp op) {
+    // removable if its result is not used
+    return (op >= QBN_OP_ADD && op <= QBN_OP_CUOD) || (op >= QBN_OP_LOADSB && op <= QBN_OP_LOAD) ||
+           (op >= QBN_OP_EXTSB && op <= QBN_OP_ALLOC16) || op == QBN_OP_COPY || op == QBN_OP_ADDR;
+}
+
+typedef struct {
+    QbnCfg* cfg;
+    unsigned int* def_block;    // block of a temp's definition, QBN_CFG_NONE if not defined yet
+    bool* non_strict;           // read where its definition does not dominate the read
+} QbnCopyProp;
+
+void qbn_copy_prop_use(QbnCopyProp* prop, unsigned int block_id, QbnRef ref) {
+    if (QBN_REF_TYPE(ref) != QBN_REF_TEMP) {
+        return;
+    }
+    unsigned int def = prop->def_block[QBN_REF_INDEX(ref)];
+    if (def == QBN_CFG_NONE || !qbn_cfg_dominates(prop->cfg, def, block_id)) {
+        prop->non_strict[QBN_REF_INDEX(ref)] = true;
+    }
+}
+
+void qbn_propagate_copies(QbnFn* fn) {
+    // expects every temp to be defined once, see qbn_ssa_construct
+    size_t n_temps = fn->vec_temps->length;
+    size_t n_blocks = fn->vec_blocks->length;
+    QbnCopyProp prop = {.cfg = qbn_fn_cfg(fn)};
+    prop.def_block = qbn_cfg_alloc(n_temps);
+    prop.non_strict = calloc(n_temps + 1, sizeof(bool));
+    QbnRef* replace = calloc(n_temps + 1, sizeof(QbnRef));
+    if (!prop.non_strict || !replace) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_temps; i++) {
+        prop.def_block[i] = QBN_CFG_NONE;
+    }
+    for (int i=0; i<fn->vec_params->length; i++) {
+        prop.def_block[QBN_REF_INDEX(fn->params[i])] = 0;
+    }
+
+    // in reverse postorder a definition that dominates a read is visited before it,
+    // so a read of a temp without a definition yet is one that can see another value
+    for (int i=0; i<prop.cfg->n_reachable; i++) {
+        QbnBlock* block = fn->blocks[prop.cfg->order[i]];
+        for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+            prop.def_block[QBN_REF_INDEX(phi->to)] = block->id;
+        }
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op == QBN_OP0) {
+                continue;
+            }
+            qbn_copy_prop_use(&prop, block->id, instr->arg0);
+            qbn_copy_prop_use(&prop, block->id, instr->arg1);
+            if (QBN_REF_TYPE(instr->to) == QBN_REF_TEMP) {
+                prop.def_block[QBN_REF_INDEX(instr->to)] = block->id;
+            }
+        }
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            qbn_copy_prop_use(&prop, block->id, block->jmp.ret.value);
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            qbn_copy_prop_use(&prop, block->id, block->jmp.dest.cond);
+        }
+    }
+    for (int i=0; i<prop.cfg->n_reachable; i++) {
+        for (QbnPhi* phi = fn->blocks[prop.cfg->order[i]]->phi; phi; phi = phi->next) {
+            // read at the end of the predecessor
+            for (int a=0; a<phi->n_args; a++) {
+                qbn_copy_prop_use(&prop, phi->blocks[a]->id, phi->args[a]);
+            }
+        }
+    }
+
+    for (int i=0; i<prop.cfg->n_reachable; i++) {
+        QbnBlock* block = fn->blocks[prop.cfg->order[i]];
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP_COPY || QBN_REF_TYPE(instr->to) != QBN_REF_TEMP ||
+                QBN_REF_TYPE(instr->arg0) != QBN_REF_TEMP) {
+                continue;
+            }
+            unsigned int to = QBN_REF_INDEX(instr->to);
+            unsigned int from = QBN_REF_INDEX(instr->arg0);
+            if (fn->temps[to].type != fn->temps[from].type || (QbnExtType) instr->type != fn->temps[to].type ||
+                prop.non_strict[to] || prop.non_strict[from]) {
+                continue;
+            }
+            replace[to] = instr->arg0;
+        }
+    }
+
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            instr->arg0 = qbn_ssa_resolve(replace, instr->arg0);
+            instr->arg1 = qbn_ssa_resolve(replace, instr->arg1);
+        }
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            block->jmp.ret.value = qbn_ssa_resolve(replace, block->jmp.ret.value);
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            block->jmp.dest.cond = qbn_ssa_resolve(replace, block->jmp.dest.cond);
+        }
+        for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+            for (int a=0; a<phi->n_args; a++) {
+                phi->args[a] = qbn_ssa_resolve(replace, phi->args[a]);
+            }
+        }
+    }
+    free(replace);
+    free(prop.non_strict);
+    free(prop.def_block);
+}
+
+typedef struct {
+    QbnInstr** def_instr;       // definition of a temp, either an instruction or a phi
+    QbnPhi** def_phi;
+    bool* live;
+    unsigned int* worklist;
+    size_t n_work;
+} QbnDce;
+
+void qbn_dce_mark(QbnDce* dce, QbnRef ref) {
+    if (QBN_REF_TYPE(ref) != QBN_REF_TEMP || dce->live[QBN_REF_INDEX(ref)]) {
+        return;
+    }
+    dce->live[QBN_REF_INDEX(ref)] = true;
+    dce->worklist[dce->n_work++] = QBN_REF_INDEX(ref);
+}
+
+void qbn_dce_mark_uses(QbnFn* fn, QbnDce* dce, QbnInstr* instr) {
+    QbnRef uses[QBN_INSTR_MAX_USES];
+    int n_uses = qbn_instr_uses(fn, instr, uses);
+    for (int u=0; u<n_uses; u++) {
+        qbn_dce_mark(dce, uses[u]);
+    }
+}
+
+void qbn_eliminate_dead_code(QbnFn* fn) {
+    size_t n_temps = fn->vec_temps->length;
+    size_t n_blocks = fn->vec_blocks->length;
+    QbnDce dce = {0};
+    dce.def_instr = calloc(n_temps + 1, sizeof(QbnInstr*));
+    dce.def_phi = calloc(n_temps + 1, sizeof(QbnPhi*));
+    dce.live = calloc(n_temps + 1, sizeof(bool));
+    dce.worklist = malloc(sizeof(unsigned int) * (n_temps + 1));  // a temp is added once
+    if (!dce.def_instr || !dce.def_phi || !dce.live || !dce.worklist) {
+        util_vector_no_memory();
+    }
+
+    // mark
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+            dce.def_phi[QBN_REF_INDEX(phi->to)] = phi;
+        }
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op == QBN_OP0) {
+                continue;
+            }
+            if (qbn_op_is_pure(instr->op) && QBN_REF_TYPE(instr->to) == QBN_REF_TEMP) {
+                dce.def_instr[QBN_REF_INDEX(instr->to)] = instr;
+            } else {
+                qbn_dce_mark_uses(fn, &dce, instr);
+            }
+        }
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            qbn_dce_mark(&dce, block->jmp.ret.value);
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            qbn_dce_mark(&dce, block->jmp.dest.cond);
+        }
+    }
+    while (dce.n_work) {
+        unsigned int temp = dce.worklist[--dce.n_work];
+        if (dce.def_instr[temp]) {
+            qbn_dce_mark_uses(fn, &dce, dce.def_instr[temp]);
+        } else if (dce.def_phi[temp]) {
+            for (int a=0; a<dce.def_phi[temp]->n_args; a++) {
+                qbn_dce_mark(&dce, dce.def_phi[temp]->args[a]);
+            }
+        }
+    }
+
+    // sweep
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        QbnPhi** link = &block->phi;
+        while (*link) {
+            QbnPhi* phi = *link;
+            if (dce.live[QBN_REF_INDEX(phi->to)]) {
+                link = &phi->next;
+                continue;
+            }
+            *link = phi->next;
+            free(phi->args);
+            free(phi->blocks);
+            free(phi);
+        }
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP0 && qbn_op_is_pure(instr->op) && QBN_REF_TYPE(instr->to) == QBN_REF_TEMP &&
+                !dce.live[QBN_REF_INDEX(instr->to)]) {
+                instr->op = QBN_OP0;
+            }
+        }
+    }
+    free(dce.worklist);
+    free(dce.live);
+    free(dce.def_phi);
+    free(dce.def_instr);
+}
+
+#endif //QBN_DCE_H
@@ -0,0 +1,387 @@
+#ifndef QBN_ENCODE_H
+#define QBN_ENCODE_H
+
+#include <string.h>
+#include "qbn.h"
+#include "processing.h"
+
+// x86-64 machine code encoder for QbnAmd64Insn, driven by a table of encodings per mnemonic.
+// The first candidate whose form matches the operands is used, so cheaper forms come first.
+
+#define QBN_AMD64_MAX_INSN_SIZE 15
+
+const unsigned char QBN_AMD64_REG2HW[] = {
+        [QBN_RAX] = 0, [QBN_RCX] = 1, [QBN_RDX] = 2,  [QBN_RBX] = 3,
+        [QBN_RSP] = 4, [QBN_RBP] = 5, [QBN_RSI] = 6,  [QBN_RDI] = 7,
+        [QBN_R8]  = 8, [QBN_R9]  = 9, [QBN_R10] = 10, [QBN_R11] = 11,
+        [QBN_R12] = 12, [QBN_R13] = 13, [QBN_R14] = 14, [QBN_R15] = 15,
+        [QBN_XMM0] = 0, [QBN_XMM1] = 1, [QBN_XMM2] = 2, [QBN_XMM3] = 3,
+        [QBN_XMM4] = 4, [QBN_XMM5] = 5, [QBN_XMM6] = 6, [QBN_XMM7] = 7,
+        [QBN_XMM8] = 8, [QBN_XMM9] = 9, [QBN_XMM10] = 10, [QBN_XMM11] = 11,
+        [QBN_XMM12] = 12, [QBN_XMM13] = 13, [QBN_XMM14] = 14, [QBN_XMM15] = 15,
+};
+
+typedef enum {
+    QBN_ENC_NONE,  // end of candidate list
+    QBN_ENC_RM,    // reg = dst, r/m = src
+    QBN_ENC_MR,    // r/m = dst, reg = src
+    QBN_ENC_MI,    // r/m = dst, reg = digit, immediate src
+    QBN_ENC_M,     // r/m = dst, reg = digit
+    QBN_ENC_O,     // register in the low opcode bits
+    QBN_ENC_OI,    // register in the low opcode bits, immediate src
+    QBN_ENC_RMI,   // reg = r/m = dst, immediate src
+    QBN_ENC_D,     // rel32 to a symbol or a label
+    QBN_ENC_REL8,  // rel8 to a label
+    QBN_ENC_ZO,    // no operands
+} QbnAmd64EncodingForm;
+
+typedef enum {
+    QBN_ENC_BYTE_OP = 1 << 0,  // 8 bit variant has the last opcode byte decremented (by 8 for OI)
+    QBN_ENC_NO_W    = 1 << 1,  // size does not select REX.W or the 66 prefix
+    QBN_ENC_IMM8    = 1 << 2,  // sign extended 8 bit immediate
+    QBN_ENC_NO_BYTE = 1 << 3,  // no 8 bit variant
+    QBN_ENC_COND    = 1 << 4,  // condition code is added to the last opcode byte
+    QBN_ENC_IMM_ONE = 1 << 5,  // only matches an immediate of 1, which is implied by the opcode
+} QbnAmd64EncodingFlags;
+
+typedef struct {
+    QbnAmd64EncodingForm form;
+    unsigned char prefix;  // mandatory prefix, 0 if none
+    unsigned char opcode_length;
+    unsigned char opcode[3];
+    unsigned char digit;   // /digit in the modrm reg field
+    unsigned char flags;
+} QbnAmd64Encoding;
+
+typedef struct {
+    int offset;       // offset of the 32 bit field to relocate, -1 if none
+    long addend;      // relative to the field
+    QbnSymbol sym;
+} QbnAmd64Fixup;
+
+#define QBN_AMD64_MAX_ENCODINGS 4
+
+#define QBN_ENC_ALU(base, digit) { \
+        {QBN_ENC_MR, 0, 1, {(base)}, 0, QBN_ENC_BYTE_OP}, \
+        {QBN_ENC_RM, 0, 1, {(base) + 2}, 0, QBN_ENC_BYTE_OP}, \
+        {QBN_ENC_MI, 0, 1, {0x83}, (digit), QBN_ENC_IMM8 | QBN_ENC_NO_BYTE}, \
+        {QBN_ENC_MI, 0, 1, {0x81}, (digit), QBN_ENC_BYTE_OP}, \
+}
+#define QBN_ENC_SHIFT(digit) { \
+        {QBN_ENC_MI, 0, 1, {0xD1}, (digit), QBN_ENC_IMM_ONE | QBN_ENC_BYTE_OP}, \
+        {QBN_ENC_MI, 0, 1, {0xC1}, (digit), QBN_ENC_IMM8 | QBN_ENC_BYTE_OP}, \
+}
+#define QBN_ENC_SSE(prefix, opcode) { \
+        {QBN_ENC_RM, (prefix), 2, {0x0F, (opcode)}, 0, QBN_ENC_NO_W}, \
+}
+
+const QbnAmd64Encoding QBN_AMD64_ENCODINGS[][QBN_AMD64_MAX_ENCODINGS] = {
+        [QBN_AMD64_MOV] = {
+                {QBN_ENC_MR, 0, 1, {0x89}, 0, QBN_ENC_BYTE_OP},
+                {QBN_ENC_RM, 0, 1, {0x8B}, 0, QBN_ENC_BYTE_OP},
+                {QBN_ENC_OI, 0, 1, {0xB8}, 0, QBN_ENC_BYTE_OP},
+                {QBN_ENC_MI, 0, 1, {0xC7}, 0, QBN_ENC_BYTE_OP},
+        },
+        [QBN_AMD64_LEA]   = {{QBN_ENC_RM, 0, 1, {0x8D}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_ADD]   = QBN_ENC_ALU(0x01, 0),
+        [QBN_AMD64_OR]    = QBN_ENC_ALU(0x09, 1),
+        [QBN_AMD64_AND]   = QBN_ENC_ALU(0x21, 4),
+        [QBN_AMD64_SUB]   = QBN_ENC_ALU(0x29, 5),
+        [QBN_AMD64_XOR]   = QBN_ENC_ALU(0x31, 6),
+        [QBN_AMD64_CMP]   = QBN_ENC_ALU(0x39, 7),
+        [QBN_AMD64_TEST]  = {
+                {QBN_ENC_MR, 0, 1, {0x85}, 0, QBN_ENC_BYTE_OP},
+                {QBN_ENC_MI, 0, 1, {0xF7}, 0, QBN_ENC_BYTE_OP},
+        },
+        [QBN_AMD64_IMUL]  = {
+                {QBN_ENC_RM, 0, 2, {0x0F, 0xAF}, 0, QBN_ENC_NO_BYTE},
+                {QBN_ENC_RMI, 0, 1, {0x6B}, 0, QBN_ENC_IMM8 | QBN_ENC_NO_BYTE},
+                {QBN_ENC_RMI, 0, 1, {0x69}, 0, QBN_ENC_NO_BYTE},
+        },
+        [QBN_AMD64_SHL]   = QBN_ENC_SHIFT(4),
+        [QBN_AMD64_SHR]   = QBN_ENC_SHIFT(5),
+        [QBN_AMD64_SAR]   = QBN_ENC_SHIFT(7),
+        [QBN_AMD64_NEG]   = {{QBN_ENC_M, 0, 1, {0xF7}, 3, QBN_ENC_BYTE_OP}},
+        [QBN_AMD64_PUSH]  = {{QBN_ENC_O, 0, 1, {0x50}, 0, QBN_ENC_NO_W | QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_POP]   = {{QBN_ENC_O, 0, 1, {0x58}, 0, QBN_ENC_NO_W | QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_CALL]  = {
+                {QBN_ENC_D, 0, 1, {0xE8}, 0, QBN_ENC_NO_W},
+                {QBN_ENC_M, 0, 1, {0xFF}, 2, QBN_ENC_NO_W},
+        },
+        [QBN_AMD64_JMP]   = {
+                {QBN_ENC_REL8, 0, 1, {0xEB}, 0, QBN_ENC_NO_W},
+                {QBN_ENC_D, 0, 1, {0xE9}, 0, QBN_ENC_NO_W},
+                {QBN_ENC_M, 0, 1, {0xFF}, 4, QBN_ENC_NO_W},
+        },
+        [QBN_AMD64_JCC]   = {
+                {QBN_ENC_REL8, 0, 1, {0x70}, 0, QBN_ENC_NO_W | QBN_ENC_COND},
+                {QBN_ENC_D, 0, 2, {0x0F, 0x80}, 0, QBN_ENC_NO_W | QBN_ENC_COND},
+        },
+        [QBN_AMD64_SETCC] = {{QBN_ENC_M, 0, 2, {0x0F, 0x90}, 0, QBN_ENC_NO_W | QBN_ENC_COND}},
+        [QBN_AMD64_MOVZXB] = {{QBN_ENC_RM, 0, 2, {0x0F, 0xB6}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_MOVZXW] = {{QBN_ENC_RM, 0, 2, {0x0F, 0xB7}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_MOVSXB] = {{QBN_ENC_RM, 0, 2, {0x0F, 0xBE}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_MOVSXW] = {{QBN_ENC_RM, 0, 2, {0x0F, 0xBF}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_MOVSXD] = {{QBN_ENC_RM, 0, 1, {0x63}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_LEAVE] = {{QBN_ENC_ZO, 0, 1, {0xC9}, 0, QBN_ENC_NO_W}},
+        [QBN_AMD64_RET]   = {{QBN_ENC_ZO, 0, 1, {0xC3}, 0, QBN_ENC_NO_W}},
+        [QBN_AMD64_MOVSS] = {
+                {QBN_ENC_RM, 0xF3, 2, {0x0F, 0x10}, 0, QBN_ENC_NO_W},
+                {QBN_ENC_MR, 0xF3, 2, {0x0F, 0x11}, 0, QBN_ENC_NO_W},
+        },
+        [QBN_AMD64_MOVSD] = {
+                {QBN_ENC_RM, 0xF2, 2, {0x0F, 0x10}, 0, QBN_ENC_NO_W},
+                {QBN_ENC_MR, 0xF2, 2, {0x0F, 0x11}, 0, QBN_ENC_NO_W},
+        },
+        [QBN_AMD64_ADDSS]     = QBN_ENC_SSE(0xF3, 0x58),
+        [QBN_AMD64_ADDSD]     = QBN_ENC_SSE(0xF2, 0x58),
+        [QBN_AMD64_SUBSS]     = QBN_ENC_SSE(0xF3, 0x5C),
+        [QBN_AMD64_SUBSD]     = QBN_ENC_SSE(0xF2, 0x5C),
+        [QBN_AMD64_MULSS]     = QBN_ENC_SSE(0xF3, 0x59),
+        [QBN_AMD64_MULSD]     = QBN_ENC_SSE(0xF2, 0x59),
+        [QBN_AMD64_DIVSS]     = QBN_ENC_SSE(0xF3, 0x5E),
+        [QBN_AMD64_DIVSD]     = QBN_ENC_SSE(0xF2, 0x5E),
+        [QBN_AMD64_UCOMISS]   = QBN_ENC_SSE(0, 0x2E),
+        [QBN_AMD64_UCOMISD]   = QBN_ENC_SSE(0x66, 0x2E),
+        [QBN_AMD64_CVTSS2SD]  = QBN_ENC_SSE(0xF3, 0x5A),
+        [QBN_AMD64_CVTSD2SS]  = QBN_ENC_SSE(0xF2, 0x5A),
+        // sized by the integer operand
+        [QBN_AMD64_CVTSI2SS]  = {{QBN_ENC_RM, 0xF3, 2, {0x0F, 0x2A}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_CVTSI2SD]  = {{QBN_ENC_RM, 0xF2, 2, {0x0F, 0x2A}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_CVTTSS2SI] = {{QBN_ENC_RM, 0xF3, 2, {0x0F, 0x2C}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_CVTTSD2SI] = {{QBN_ENC_RM, 0xF2, 2, {0x0F, 0x2C}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_MOVD_TO_XMM]   = {{QBN_ENC_RM, 0x66, 2, {0x0F, 0x6E}, 0, QBN_ENC_NO_BYTE}},
+        [QBN_AMD64_MOVD_FROM_XMM] = {{QBN_ENC_MR, 0x66, 2, {0x0F, 0x7E}, 0, QBN_ENC_NO_BYTE}},
+};
+
+bool qbn_amd64_is_mem(QbnAmd64Operand* operand) {
+    return operand->kind == QBN_AMD64_OPD_MEM || operand->kind == QBN_AMD64_OPD_SYM;
+}
+
+bool qbn_amd64_is_rm(QbnAmd64Operand* operand) {
+    return operand->kind == QBN_AMD64_OPD_REG || qbn_amd64_is_mem(operand);
+}
+
+unsigned char qbn_amd64_imm_size(const QbnAmd64Encoding* enc, unsigned char size) {
+    if (enc->flags & QBN_ENC_IMM8 || size == 1) {
+        return 1;
+    }
+    if (enc->form == QBN_ENC_OI) {
+        return size;
+    }
+    return MIN(size, 4);
+}
+
+bool qbn_amd64_imm_fits(const QbnAmd64Encoding* enc, unsigned char size, long imm) {
+    if (enc->flags & QBN_ENC_IMM_ONE) {
+        return imm == 1;
+    }
+    unsigned char imm_size = qbn_amd64_imm_size(enc, size);
+    if (enc->form == QBN_ENC_OI && size == 8) {
+        // only worth it if the sign extended imm32 form does not fit
+        return imm != (int) imm;
+    }
+    if (imm_size == 8) {
+        return true;
+    }
+    long min = -(1L << (imm_size * 8 - 1));
+    long max = (1L << (imm_size * 8 - 1)) - 1;
+    if (imm_size == size && size < 8) {
+        // the full operand width, unsigned values wrap
+        max = (1L << (imm_size * 8)) - 1;
+    }
+    return imm >= min && imm <= max;
+}
+
+bool qbn_amd64_match(const QbnAmd64Encoding* enc, QbnAmd64Insn* insn) {
+    if (insn->size == 1 && enc->flags & QBN_ENC_NO_BYTE) {
+        return false;
+    }
+    QbnAmd64Operand* dst = &insn->dst;
+    QbnAmd64Operand* src = &insn->src;
+    switch (enc->form) {
+        case QBN_ENC_NONE:
+            return false;
+        case QBN_ENC_RM:
+            return dst->kind == QBN_AMD64_OPD_REG && qbn_amd64_is_rm(src);
+        case QBN_ENC_MR:
+            return qbn_amd64_is_rm(dst) && src->kind == QBN_AMD64_OPD_REG;
+        case QBN_ENC_MI:
+            return qbn_amd64_is_rm(dst) && src->kind == QBN_AMD64_OPD_IMM &&
+                   qbn_amd64_imm_fits(enc, insn->size, src->imm);
+        case QBN_ENC_M:
+            return qbn_amd64_is_rm(dst) && src->kind == QBN_AMD64_OPD_NONE;
+        case QBN_ENC_O:
+            return dst->kind == QBN_AMD64_OPD_REG && src->kind == QBN_AMD64_OPD_NONE;
+        case QBN_ENC_OI:
+        case QBN_ENC_RMI:
+            return dst->kind == QBN_AMD64_OPD_REG && src->kind == QBN_AMD64_OPD_IMM &&
+                   qbn_amd64_imm_fits(enc, insn->size, src->imm);
+        case QBN_ENC_D:
+            return (dst->kind == QBN_AMD64_OPD_SYM || (dst->kind == QBN_AMD64_OPD_LABEL && dst->size == 4)) &&
+                   src->kind == QBN_AMD64_OPD_NONE;
+        case QBN_ENC_REL8:
+            return dst->kind == QBN_AMD64_OPD_LABEL && dst->size == 1;
+        case QBN_ENC_ZO:
+            return dst->kind == QBN_AMD64_OPD_NONE && src->kind == QBN_AMD64_OPD_NONE;
+    }
+    return false;
+}
+
+bool qbn_amd64_needs_rex(QbnAmd64Operand* operand) {
+    // spl, bpl, sil and dil are only reachable with a rex prefix
+    if (operand->kind != QBN_AMD64_OPD_REG || operand->size != 1 || operand->reg >= QBN_XMM0) {
+        return false;
+    }
+    unsigned char hw = QBN_AMD64_REG2HW[operand->reg];
+    return hw >= 4 && hw <= 7;
+}
+
+void qbn_amd64_put_int(unsigned char* buf, size_t* length, long value, unsigned char size) {
+    for (int i=0; i<size; i++) {
+        buf[(*length)++] = (unsigned char) (value >> (i * 8));
+    }
+}
+
+size_t qbn_amd64_encode(QbnAmd64Insn* insn, unsigned char* buf, QbnAmd64Fixup* fixup) {
+    // writes at most QBN_AMD64_MAX_INSN_SIZE bytes to buf and returns the length
+    // fixup receives the symbol reference the instruction contains, if any
+    // a label operand holds the displacement from the end of the instruction instead of the block
+    const QbnAmd64Encoding* enc = NULL;
+    for (int i=0; i<QBN_AMD64_MAX_ENCODINGS; i++) {
+        if (qbn_amd64_match(&QBN_AMD64_ENCODINGS[insn->mnem][i], insn)) {
+            enc = &QBN_AMD64_ENCODINGS[insn->mnem][i];
+            break;
+        }
+    }
+    if (enc == NULL) {
+        qbn_error("No encoding for the given operands");
+    }
+    fixup->offset = -1;
+    fixup->addend = 0;
+    fixup->sym = 0;
+    bool dst_is_label = insn->dst.kind == QBN_AMD64_OPD_LABEL;
+
+    // operands by modrm field
+    QbnAmd64Operand* reg = NULL;
+    QbnAmd64Operand* rm = NULL;
+    QbnAmd64Operand* imm = NULL;
+    switch (enc->form) {
+        case QBN_ENC_RM:
+            reg = &insn->dst;
+            rm = &insn->src;
+            break;
+        case QBN_ENC_MR:
+            reg = &insn->src;
+            rm = &insn->dst;
+            break;
+        case QBN_ENC_MI:
+            rm = &insn->dst;
+            imm = &insn->src;
+            break;
+        case QBN_ENC_M:
+        case QBN_ENC_O:
+            rm = &insn->dst;
+            break;
+        case QBN_ENC_OI:
+            rm = &insn->dst;
+            imm = &insn->src;
+            break;
+        case QBN_ENC_RMI:
+            reg = &insn->dst;
+            rm = &insn->dst;
+            imm = &insn->src;
+            break;
+        default:;
+    }
+    unsigned char reg_hw = reg ? QBN_AMD64_REG2HW[reg->reg] : enc->digit;
+    unsigned char base_hw = 0;
+    unsigned char index_hw = 0;
+    if (rm != NULL && rm->kind != QBN_AMD64_OPD_SYM) {
+        base_hw = QBN_AMD64_REG2HW[rm->reg];
+        if (rm->kind == QBN_AMD64_OPD_MEM && rm->index) {
+            index_hw = QBN_AMD64_REG2HW[rm->index];
+        }
+    }
+
+    size_t length = 0;
+    if (insn->size == 2 && !(enc->flags & QBN_ENC_NO_W)) {
+        buf[length++] = 0x66;
+    }
+    if (enc->prefix) {
+        buf[length++] = enc->prefix;
+    }
+    unsigned char rex = 0x40 | (insn->size == 8 && !(enc->flags & QBN_ENC_NO_W)) << 3 |
+                        (reg_hw >= 8) << 2 | (index_hw >= 8) << 1 | (base_hw >= 8);
+    if (rex != 0x40 || qbn_amd64_needs_rex(&insn->dst) || qbn_amd64_needs_rex(&insn->src)) {
+        buf[length++] = rex;
+    }
+    for (int i=0; i<enc->opcode_length; i++) {
+        unsigned char opcode = enc->opcode[i];
+        if (i == enc->opcode_length - 1) {
+            if (enc->flags & QBN_ENC_BYTE_OP && insn->size == 1) {
+                opcode -= enc->form == QBN_ENC_OI ? 8 : 1;
+            }
+            if (enc->flags & QBN_ENC_COND) {
+                opcode += insn->cond;
+            }
+            if (enc->form == QBN_ENC_O || enc->form == QBN_ENC_OI) {
+                opcode += base_hw & 7;
+            }
+        }
+        buf[length++] = opcode;
+    }
+
+    if (rm != NULL && enc->form != QBN_ENC_O && enc->form != QBN_ENC_OI) {
+        unsigned char modrm = (reg_hw & 7) << 3;
+        if (rm->kind == QBN_AMD64_OPD_REG) {
+            buf[length++] = 0xC0 | modrm | (base_hw & 7);
+        } else if (rm->kind == QBN_AMD64_OPD_SYM) {
+            // sym(%rip)
+            buf[length++] = modrm | 5;
+            fixup->offset = (int) length;
+            fixup->addend = rm->imm;
+            fixup->sym = rm->sym;
+            qbn_amd64_put_int(buf, &length, 0, 4);
+        } else {
+            // disp(base, index, scale)
+            bool need_sib = rm->index || (base_hw & 7) == 4;
+            unsigned char mod;
+            if (rm->imm == 0 && (base_hw & 7) != 5) {
+                mod = 0;
+            } else if (rm->imm >= -128 && rm->imm <= 127) {
+                mod = 1;
+            } else {
+                mod = 2;
+            }
+            buf[length++] = mod << 6 | modrm | (need_sib ? 4 : (base_hw & 7));
+            if (need_sib) {
+                unsigned char scale = rm->index ? (rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0) : 0;
+                buf[length++] = scale << 6 | (rm->index ? (index_hw & 7) : 4) << 3 | (base_hw & 7);
+            }
+            if (mod) {
+                qbn_amd64_put_int(buf, &length, rm->imm, mod == 1 ? 1 : 4);
+            }
+        }
+    }
+    if (dst_is_label) {
+        // the displacement is known already, see qbn_object_add_fn
+        qbn_amd64_put_int(buf, &length, insn->dst.imm, insn->dst.size);
+    } else if (enc->form == QBN_ENC_D) {
+        fixup->offset = (int) length;
+        fixup->addend = insn->dst.imm;
+        fixup->sym = insn->dst.sym;
+        qbn_amd64_put_int(buf, &length, 0, 4);
+    }
+    if (imm != NULL && !(enc->flags & QBN_ENC_IMM_ONE)) {
+        qbn_amd64_put_int(buf, &length, imm->imm, qbn_amd64_imm_size(enc, insn->size));
+    }
+    if (fixup->offset >= 0) {
+        // rip relative displacements count from the end of the instruction
+        fixup->addend -= (long) (length - fixup->offset);
+    }
+    assert(length <= QBN_AMD64_MAX_INSN_SIZE);
+    return length;
+}
+
+#endif //QBN_ENCODE_H
@@ -0,0 +1,163 @@
+
+#ifndef QBN_FOLD_H
+#define QBN_FOLD_H
+
+#include "qbn.h"
+#include "cfg.h"
+
+// Constant folding on ssa form. An instruction qbn_op_info marks as foldable whose integer arguments are all
+// constants is evaluated here and becomes a copy of the interned result. Blocks are visited in reverse
+// postorder, so a temp's folded value is known before its uses (phis aside) and whole chains of constant
+// expressions fold in one pass. Float operations and anything that would trap at runtime are left alone.
+
+bool qbn_fold_number(QbnFn* fn, QbnRef ref, long* value) {
+    if (QBN_REF_TYPE(ref) != QBN_REF_CONST) {
+        return false;
+    }
+    QbnConst* con = QBN_CONST(fn->context, QBN_REF_INDEX(ref));
+    if (con->type != QBN_CONST_NUMBER) {
+        return false;
+    }
+    *value = con->value.number;
+    return true;
+}
+
+bool qbn_fold_eval(QbnOp op, QbnType type, long a, long b, long* result) {
+    // arguments are read as type, returns false if the result has to be left to runtime
+    bool is_word = type == QBN_TYPE_I32;
+    unsigned long ua = is_word ? (unsigned int) a : (unsigned long) a;
+    unsigned long ub = is_word ? (unsigned int) b : (unsigned long) b;
+    long sa = is_word ? (int) a : a;
+    long sb = is_word ? (int) b : b;
+    unsigned int shift = (unsigned int) b & (is_word ? 31 : 63);
+    unsigned long min = is_word ? 0xFFFFFFFF80000000UL : 1UL << 63;
+    unsigned long r;
+    switch (op) {
+        case QBN_OP_ADD: r = ua + ub; break;
+        case QBN_OP_SUB: r = ua - ub; break;
+        case QBN_OP_MUL: r = ua * ub; break;
+        case QBN_OP_DIV:
+        case QBN_OP_REM:
+            // both trap
+            if (sb == 0 || (sb == -1 && (unsigned long) sa == min)) {
+                return false;
+            }
+            r = op == QBN_OP_DIV ? sa / sb : sa % sb;
+            break;
+        case QBN_OP_UDIV:
+        case QBN_OP_UREM:
+            if (ub == 0) {
+                return false;
+            }
+            r = op == QBN_OP_UDIV ? ua / ub : ua % ub;
+            break;
+        case QBN_OP_AND: r = ua & ub; break;
+        case QBN_OP_OR:  r = ua | ub; break;
+        case QBN_OP_XOR: r = ua ^ ub; break;
+        case QBN_OP_SAR: r = sa >> shift; break;
+        case QBN_OP_SHR: r = ua >> shift; break;
+        case QBN_OP_SHL: r = ua << shift; break;
+        case QBN_OP_CEQW:  case QBN_OP_CEQL:  r = ua == ub; break;
+        case QBN_OP_CNEW:  case QBN_OP_CNEL:  r = ua != ub; break;
+        case QBN_OP_CSGEW: case QBN_OP_CSGEL: r = sa >= sb; break;
+        case QBN_OP_CSGTW: case QBN_OP_CSGTL: r = sa > sb; break;
+        case QBN_OP_CSLEW: case QBN_OP_CSLEL: r = sa <= sb; break;
+        case QBN_OP_CSLTW: case QBN_OP_CSLTL: r = sa < sb; break;
+        case QBN_OP_CUGEW: case QBN_OP_CUGEL: r = ua >= ub; break;
+        case QBN_OP_CUGTW: case QBN_OP_CUGTL: r = ua > ub; break;
+        case QBN_OP_CULEW: case QBN_OP_CULEL: r = ua <= ub; break;
+        case QBN_OP_CULTW: case QBN_OP_CULTL: r = ua < ub; break;
+        case QBN_OP_EXTSB: r = (signed char) a; break;
+        case QBN_OP_EXTUB: r = (unsigned char) a; break;
+        case QBN_OP_EXTSH: r = (short) a; break;
+        case QBN_OP_EXTUH: r = (unsigned short) a; break;
+        case QBN_OP_EXTSW: r = (int) a; break;
+        case QBN_OP_EXTUW: r = (unsigned int) a; break;
+        default:
+            return false;
+    }
+    *result = (long) r;
+    return true;
+}
+
+QbnRef qbn_fold_known(QbnRef* known, QbnRef ref) {
+    if (QBN_REF_TYPE(ref) == QBN_REF_TEMP && known[QBN_REF_INDEX(ref)] != QBN_REF0) {
+        return known[QBN_REF_INDEX(ref)];
+    }
+    return ref;
+}
+
+void qbn_fold_instr(QbnFn* fn, QbnInstr* instr, QbnRef* known) {
+    if (instr->op == QBN_OP_COPY) {
+        instr->arg0 = qbn_fold_known(known, instr->arg0);
+    } else if (instr->op < QBN_OP_COUNT && qbn_op_info[instr->op].can_fold) {
+        QbnType type = qbn_op_info[instr->op].arg_type_conversion[0][instr->type];
+        if (type != QBN_TYPE_I32 && type != QBN_TYPE_I64) {
+            return;
+        }
+        bool is_unary = instr->op >= QBN_OP_EXTSB && instr->op <= QBN_OP_EXTUW;
+        long a;
+        long b = 0;
+        long result;
+        if (!qbn_fold_number(fn, qbn_fold_known(known, instr->arg0), &a) ||
+            (!is_unary && !qbn_fold_number(fn, qbn_fold_known(known, instr->arg1), &b)) ||
+            !qbn_fold_eval(instr->op, type, a, b, &result)) {
+            return;
+        }
+        if (instr->type == QBN_BTYPE_I32) {
+            result = (int) result;
+        }
+        instr->op = QBN_OP_COPY;
+        instr->arg0 = qbn_context_new_const_number(fn->context, result);
+        instr->arg1 = QBN_REF0;
+    } else {
+        return;
+    }
+    // float temps keep their copies, float immediates are not supported
+    long value;
+    if (QBN_REF_TYPE(instr->to) == QBN_REF_TEMP && qbn_fold_number(fn, instr->arg0, &value) &&
+        QBN_TYPE_INFO[fn->temps[QBN_REF_INDEX(instr->to)].type].is_int) {
+        known[QBN_REF_INDEX(instr->to)] = instr->arg0;
+    }
+}
+
+void qbn_fold_block(QbnFn* fn, QbnBlock* block, QbnRef* known) {
+    for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+        if (instr->op != QBN_OP0) {
+            qbn_fold_instr(fn, instr, known);
+        }
+    }
+    if (block->jmp_type == QBN_JUMP_RET_BASE) {
+        block->jmp.ret.value = qbn_fold_known(known, block->jmp.ret.value);
+    } else if (block->jmp_type == QBN_JUMP_NZ) {
+        block->jmp.dest.cond = qbn_fold_known(known, block->jmp.dest.cond);
+    }
+}
+
+void qbn_fold_constants(QbnFn* fn) {
+    // expects every temp to be defined once, see qbn_ssa_construct
+    size_t n_blocks = fn->vec_blocks->length;
+    QbnRef* known = calloc(fn->vec_temps->length + 1, sizeof(QbnRef));  // constant value of a temp or QBN_REF0
+    if (!known) {
+        util_vector_no_memory();
+    }
+    QbnCfg* cfg = qbn_fn_cfg(fn);
+    for (int i=0; i<cfg->n_reachable; i++) {
+        qbn_fold_block(fn, fn->blocks[cfg->order[i]], known);
+    }
+    for (int i=0; i<n_blocks; i++) {
+        if (cfg->rpo_index[i] == QBN_CFG_NONE) {
+            qbn_fold_block(fn, fn->blocks[i], known);
+        }
+    }
+    for (int i=0; i<n_blocks; i++) {
+        for (QbnPhi* phi = fn->blocks[i]->phi; phi; phi = phi->next) {
+            for (int a=0; a<phi->n_args; a++) {
+                phi->args[a] = qbn_fold_known(known, phi->args[a]);
+            }
+        }
+    }
+    free(known);
+}
+
+#endif //QBN_FOLD_H
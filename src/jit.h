@@ -0,0 +1,240 @@
+#ifndef QBN_JIT_H
+#define QBN_JIT_H
+
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "qbn.h"
+#include "processing.h"
+#include "object.h"
+
+// In-process compilation: the object image is laid out in one mapping and relocated in place.
+// Code and read only data are never writable and executable at the same time (W^X).
+
+#ifndef RTLD_DEFAULT
+#define RTLD_DEFAULT ((void*) 0)
+#endif
+
+// jmp *0(%rip) followed by the absolute target, reaches external functions from anywhere
+#define QBN_JIT_STUB_SIZE 16
+
+typedef struct {
+    const char* name;
+    void* address;
+} QbnJitSymbol;
+
+struct QbnJit {
+    UtilVector* vec_symbols;  // user symbol table, searched before dlsym
+    QbnJitSymbol* symbols;
+    QbnObject* obj;           // layout of the current image, NULL if nothing is compiled
+    unsigned char* memory;
+    size_t size;
+    unsigned char* base[QBN_SEC_COUNT];
+    unsigned char** stubs;    // per object symbol, the address of its stub or NULL
+};
+
+QbnJit* qbn_jit_get(QbnContext* context) {
+    if (context->jit == NULL) {
+        QbnJit* jit = malloc(sizeof(QbnJit));
+        jit->vec_symbols = util_vector_new(sizeof(QbnJitSymbol), 0, (void**) &jit->symbols);
+        jit->obj = NULL;
+        jit->memory = NULL;
+        jit->size = 0;
+        jit->stubs = NULL;
+        context->jit = jit;
+    }
+    return context->jit;
+}
+
+void qbn_jit_add_symbol(QbnContext* context, const char* name, void* address) {
+    // makes an external symbol available to compiled code, overrides symbols of the process
+    QbnJit* jit = qbn_jit_get(context);
+    for (int i=0; i<jit->vec_symbols->length; i++) {
+        if (strcmp(jit->symbols[i].name, name) == 0) {
+            jit->symbols[i].address = address;
+            return;
+        }
+    }
+    util_vector_grow(jit->vec_symbols, 1);
+    jit->symbols[jit->vec_symbols->length-1] = (QbnJitSymbol) {name, address};
+}
+
+void* qbn_jit_resolve_external(QbnJit* jit, const char* name) {
+    for (int i=0; i<jit->vec_symbols->length; i++) {
+        if (strcmp(jit->symbols[i].name, name) == 0) {
+            return jit->symbols[i].address;
+        }
+    }
+    void* address = dlsym(RTLD_DEFAULT, name);
+    if (address == NULL) {
+        fprintf(stderr, "Undefined symbol %s\n", name);
+        qbn_error("Could not resolve symbol");
+    }
+    return address;
+}
+
+void qbn_jit_release(QbnJit* jit) {
+    // unmaps the current image, function pointers into it become invalid
+    if (jit->memory != NULL) {
+        munmap(jit->memory, jit->size);
+        jit->memory = NULL;
+        jit->size = 0;
+    }
+    if (jit->obj != NULL) {
+        qbn_object_free(jit->obj);
+        jit->obj = NULL;
+    }
+    free(jit->stubs);
+    jit->stubs = NULL;
+}
+
+void qbn_jit_free(QbnContext* context) {
+    if (context->jit == NULL) {
+        return;
+    }
+    qbn_jit_release(context->jit);
+    util_vector_free(context->jit->vec_symbols);
+    free(context->jit);
+    context->jit = NULL;
+}
+
+size_t qbn_jit_page_align(size_t size, size_t page_size) {
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+unsigned char* qbn_jit_symbol_address(QbnJit* jit, unsigned int index, bool is_call) {
+    QbnObjSymbol* symbol = &jit->obj->symbols[index];
+    if (symbol->section != QBN_SEC_NONE) {
+        return jit->base[symbol->section] + symbol->offset;
+    }
+    if (is_call) {
+        // calls go through a stub in range of the rel32
+        assert(jit->stubs[index] != NULL);
+        return jit->stubs[index];
+    }
+    return qbn_jit_resolve_external(jit, symbol->name);
+}
+
+void qbn_jit_relocate(QbnJit* jit) {
+    QbnObject* obj = jit->obj;
+    for (int i=0; i<obj->vec_relocs->length; i++) {
+        QbnObjReloc* reloc = &obj->relocs[i];
+        unsigned char* place = jit->base[reloc->section] + reloc->offset;
+        unsigned char* target = qbn_jit_symbol_address(jit, reloc->symbol, reloc->type == R_X86_64_PLT32);
+        long value;
+        switch (reloc->type) {
+            case R_X86_64_PLT32:
+            case R_X86_64_PC32:
+                value = (long) (target - place) + reloc->addend;
+                if (value != (int) value) {
+                    fprintf(stderr, "Symbol %s out of range\n", obj->symbols[reloc->symbol].name);
+                    qbn_error("Relocation overflow");
+                }
+                memcpy(place, &(int) {(int) value}, 4);
+                break;
+            case R_X86_64_32:
+                value = (long) target + reloc->addend;
+                if (value != (unsigned int) value) {
+                    fprintf(stderr, "Symbol %s out of range\n", obj->symbols[reloc->symbol].name);
+                    qbn_error("Relocation overflow");
+                }
+                memcpy(place, &(unsigned int) {(unsigned int) value}, 4);
+                break;
+            case R_X86_64_64:
+                value = (long) target + reloc->addend;
+                memcpy(place, &value, 8);
+                break;
+            default:
+                QBN_UNREACHABLE
+        }
+    }
+}
+
+void qbn_jit_compile(QbnContext* context) {
+    // runs qbn_process and maps the code and data into this process, a previous image is unmapped
+    QbnJit* jit = qbn_jit_get(context);
+    qbn_jit_release(jit);
+    qbn_process(context);
+    QbnObject* obj = qbn_object_build(context);
+    jit->obj = obj;
+
+    // every called external symbol gets a stub
+    bool* needs_stub = calloc(obj->vec_symbols->length, sizeof(bool));
+    int n_stubs = 0;
+    for (int i=0; i<obj->vec_relocs->length; i++) {
+        unsigned int symbol = obj->relocs[i].symbol;
+        if (obj->relocs[i].type == R_X86_64_PLT32 && obj->symbols[symbol].section == QBN_SEC_NONE &&
+            !needs_stub[symbol]) {
+            needs_stub[symbol] = true;
+            n_stubs++;
+        }
+    }
+
+    // text and stubs | rodata | data and bss, each starting on a page
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t text_size = qbn_object_offset(obj, QBN_SEC_TEXT);
+    text_size = (text_size + QBN_JIT_STUB_SIZE - 1) / QBN_JIT_STUB_SIZE * QBN_JIT_STUB_SIZE;
+    size_t rodata_offset = qbn_jit_page_align(text_size + n_stubs * QBN_JIT_STUB_SIZE, page_size);
+    size_t data_offset = rodata_offset + qbn_jit_page_align(qbn_object_offset(obj, QBN_SEC_RODATA), page_size);
+    size_t bss_offset = data_offset + (qbn_object_offset(obj, QBN_SEC_DATA) + 15) / 16 * 16;
+    jit->size = qbn_jit_page_align(MAX(bss_offset + obj->bss_size, 1), page_size);
+    jit->memory = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->memory == MAP_FAILED) {
+        jit->memory = NULL;
+        qbn_error("Could not map memory");
+    }
+    jit->base[QBN_SEC_NONE] = NULL;
+    jit->base[QBN_SEC_TEXT] = jit->memory;
+    jit->base[QBN_SEC_RODATA] = jit->memory + rodata_offset;
+    jit->base[QBN_SEC_DATA] = jit->memory + data_offset;
+    jit->base[QBN_SEC_BSS] = jit->memory + bss_offset;
+    for (int i=0; i<QBN_SEC_COUNT; i++) {
+        if (obj->vec_bytes[i] != NULL) {
+            memcpy(jit->base[i], obj->bytes[i], obj->vec_bytes[i]->length);
+        }
+    }
+    memset(jit->base[QBN_SEC_TEXT] + qbn_object_offset(obj, QBN_SEC_TEXT), 0xCC,
+           text_size - qbn_object_offset(obj, QBN_SEC_TEXT));
+
+    jit->stubs = calloc(obj->vec_symbols->length, sizeof(unsigned char*));
+    unsigned char* stub = jit->memory + text_size;
+    for (unsigned int i=0; i<obj->vec_symbols->length; i++) {
+        if (!needs_stub[i]) {
+            continue;
+        }
+        void* target = qbn_jit_resolve_external(jit, obj->symbols[i].name);
+        const unsigned char jmp[] = {0xFF, 0x25, 0, 0, 0, 0};
+        memcpy(stub, jmp, sizeof(jmp));
+        memcpy(stub + sizeof(jmp), &target, 8);
+        memset(stub + sizeof(jmp) + 8, 0xCC, QBN_JIT_STUB_SIZE - sizeof(jmp) - 8);
+        jit->stubs[i] = stub;
+        stub += QBN_JIT_STUB_SIZE;
+    }
+    free(needs_stub);
+    qbn_jit_relocate(jit);
+
+    if (mprotect(jit->memory, rodata_offset, PROT_READ | PROT_EXEC) != 0 ||
+        (data_offset > rodata_offset && mprotect(jit->base[QBN_SEC_RODATA], data_offset - rodata_offset, PROT_READ) != 0)) {
+        qbn_error("Could not protect memory");
+    }
+}
+
+void* qbn_jit_lookup(QbnContext* context, const char* name) {
+    // address of a function or data item of the compiled image, NULL if there is none
+    QbnJit* jit = context->jit;
+    if (jit == NULL || jit->obj == NULL) {
+        return NULL;
+    }
+    QbnSymbol id;
+    if (!qbn_context_find_symbol(context, name, &id) || id >= jit->obj->vec_symbol_map->length ||
+        jit->obj->symbol_map[id] == 0) {
+        return NULL;
+    }
+    QbnObjSymbol* symbol = &jit->obj->symbols[jit->obj->symbol_map[id] - 1];
+    if (symbol->section == QBN_SEC_NONE) {
+        return NULL;
+    }
+    return jit->base[symbol->section] + symbol->offset;
+}
+
+#endif //QBN_JIT_H
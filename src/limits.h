@@ -2,7 +2,14 @@
 #ifndef QBN_LIMITS_H
 #define QBN_LIMITS_H
 
-#define QBN_LIMIT_INSTR_CACHE 65536
-#define QBN_LIMIT_DATA_BLOCK 32
+#define QBN_LIMIT_INSTR_CHUNK 2048
+#define QBN_LIMIT_FN_INSTR_CHUNK 128
+#define QBN_LIMIT_CONST_CHUNK 4096
+#define QBN_LIMIT_CONST_CHUNKS 4096
+#define QBN_LIMIT_CONST_TABLE 1024  // initial size, power of 2
+#define QBN_LIMIT_NAME_CHUNK 4096
+#define QBN_LIMIT_SYMBOL_TABLE 256  // initial size, power of 2
+#define QBN_LIMIT_OUT_BUFFER 65536  // bytes collected before a write to the output file
+#define QBN_LIMIT_FRAME_SIZE (1UL << 30)  // bytes below rbp, offsets are 32 bit
 
 #endif //QBN_LIMITS_H
@@ -0,0 +1,122 @@
+
+#ifndef QBN_LIVENESS_H
+#define QBN_LIVENESS_H
+
+#include <assert.h>
+#include "qbn.h"
+#include "util/bitset.h"
+#include "cfg.h"
+
+// Live temporaries at the borders of every block, one bit per temp. Blocks are visited backwards
+// in reverse postorder (so mostly successors first) until no set changes anymore.
+
+typedef struct {
+    size_t n_blocks;
+    size_t n_words;       // per set
+    UtilBitsetWord* use;  // read before written in the block
+    UtilBitsetWord* def;  // written in the block
+    UtilBitsetWord* in;
+    UtilBitsetWord* out;
+} QbnLiveness;
+
+#define QBN_LIVE_SET(live, sets, block_id) ((live)->sets + (size_t) (block_id) * (live)->n_words)
+
+void qbn_liveness_use(QbnLiveness* live, unsigned int block_id, QbnRef ref) {
+    if (QBN_REF_TYPE(ref) == QBN_REF_TEMP && !util_bitset_test(QBN_LIVE_SET(live, def, block_id), QBN_REF_INDEX(ref))) {
+        util_bitset_set(QBN_LIVE_SET(live, use, block_id), QBN_REF_INDEX(ref));
+    }
+}
+
+void qbn_liveness_def(QbnLiveness* live, unsigned int block_id, QbnRef ref) {
+    if (QBN_REF_TYPE(ref) == QBN_REF_TEMP) {
+        util_bitset_set(QBN_LIVE_SET(live, def, block_id), QBN_REF_INDEX(ref));
+    }
+}
+
+void qbn_liveness_compute(QbnFn* fn, QbnLiveness* live) {
+    // for the instructions as the blocks point to them, before or after lowering
+    size_t n_blocks = fn->vec_blocks->length;
+    live->n_blocks = n_blocks;
+    live->n_words = UTIL_BITSET_WORDS(fn->vec_temps->length);
+    size_t n_words = live->n_words * n_blocks;
+    live->use = util_bitset_new(n_words);
+    live->def = util_bitset_new(n_words);
+    live->in = util_bitset_new(n_words);
+    live->out = util_bitset_new(n_words);
+    QbnCfg* cfg = qbn_fn_cfg(fn);
+
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP0) {
+                QbnRef uses[QBN_INSTR_MAX_USES];
+                int n_uses = qbn_instr_uses(fn, instr, uses);
+                for (int u=0; u<n_uses; u++) {
+                    qbn_liveness_use(live, i, uses[u]);
+                }
+                qbn_liveness_def(live, i, instr->to);
+            }
+        }
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            qbn_liveness_use(live, i, block->jmp.ret.value);
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            qbn_liveness_use(live, i, block->jmp.dest.cond);
+        }
+    }
+
+    // out = union of the successors' in, in = use | (out & ~def)
+    // only blocks with a changed successor are visited again
+    bool* dirty = malloc(sizeof(bool) * (n_blocks + 1));
+    if (!dirty) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_blocks; i++) {
+        dirty[i] = true;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i=(int) cfg->n_reachable-1; i>=0; i--) {
+            unsigned int id = cfg->order[i];
+            if (!dirty[id]) {
+                continue;
+            }
+            dirty[id] = false;
+            UtilBitsetWord* out = QBN_LIVE_SET(live, out, id);
+            QbnBlock* successors[2];
+            int n_successors = qbn_block_successors(fn->blocks[id], successors);
+            for (int s=0; s<n_successors; s++) {
+                util_bitset_or(out, QBN_LIVE_SET(live, in, successors[s]->id), live->n_words);
+            }
+            if (util_bitset_or_andnot(QBN_LIVE_SET(live, in, id), QBN_LIVE_SET(live, use, id), out,
+                                      QBN_LIVE_SET(live, def, id), live->n_words)) {
+                for (unsigned int p=cfg->first_pred[id]; p<cfg->first_pred[id+1]; p++) {
+                    dirty[cfg->preds[p]] = true;
+                }
+                changed = true;
+            }
+        }
+    }
+    free(dirty);
+}
+
+bool qbn_liveness_live_in(QbnLiveness* live, QbnBlock* block, QbnRef temp) {
+    assert(QBN_REF_TYPE(temp) == QBN_REF_TEMP);
+    return util_bitset_test(QBN_LIVE_SET(live, in, block->id), QBN_REF_INDEX(temp));
+}
+
+bool qbn_liveness_live_out(QbnLiveness* live, QbnBlock* block, QbnRef temp) {
+    assert(QBN_REF_TYPE(temp) == QBN_REF_TEMP);
+    return util_bitset_test(QBN_LIVE_SET(live, out, block->id), QBN_REF_INDEX(temp));
+}
+
+void qbn_liveness_free(QbnLiveness* live) {
+    free(live->use);
+    free(live->def);
+    free(live->in);
+    free(live->out);
+    live->use = live->def = live->in = live->out = NULL;
+}
+
+#endif //QBN_LIVENESS_H
@@ -0,0 +1,688 @@
+#ifndef QBN_OBJECT_H
+#define QBN_OBJECT_H
+
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include "qbn.h"
+#include "processing.h"
+#include "encode.h"
+
+// ELF64 relocatable object output, written directly from the lowered instruction stream and data items.
+// Everything is collected in a QbnObject first so the same image can be serialized or linked in memory.
+
+typedef struct {
+    QbnSymbol symbol;
+    const char* name;
+    QbnSection section;  // QBN_SEC_NONE for undefined (external) symbols
+    unsigned long offset;
+    unsigned long size;
+    bool global;
+    bool function;
+} QbnObjSymbol;
+
+typedef struct {
+    QbnSection section;
+    unsigned long offset;
+    unsigned int symbol;
+    unsigned int type;
+    long addend;
+} QbnObjReloc;
+
+struct QbnObject {
+    QbnContext* context;
+    UtilVector* vec_bytes[QBN_SEC_COUNT];
+    unsigned char* bytes[QBN_SEC_COUNT];
+    unsigned long bss_size;
+    UtilVector* vec_symbols;
+    QbnObjSymbol* symbols;
+    UtilVector* vec_relocs;
+    QbnObjReloc* relocs;
+    UtilVector* vec_symbol_map;  // object symbol index+1 per context symbol, or 0
+    unsigned int* symbol_map;
+};
+
+QbnObject* qbn_object_new(QbnContext* context) {
+    QbnObject* obj = malloc(sizeof(QbnObject));
+    obj->context = context;
+    for (int i=0; i<QBN_SEC_COUNT; i++) {
+        obj->vec_bytes[i] = NULL;
+        obj->bytes[i] = NULL;
+    }
+    obj->vec_bytes[QBN_SEC_TEXT] = util_vector_new(1, 4096, (void**) &obj->bytes[QBN_SEC_TEXT]);
+    obj->vec_bytes[QBN_SEC_DATA] = util_vector_new(1, 1024, (void**) &obj->bytes[QBN_SEC_DATA]);
+    obj->vec_bytes[QBN_SEC_RODATA] = util_vector_new(1, 1024, (void**) &obj->bytes[QBN_SEC_RODATA]);
+    obj->bss_size = 0;
+    obj->vec_symbols = util_vector_new(sizeof(QbnObjSymbol), 0, (void**) &obj->symbols);
+    obj->vec_relocs = util_vector_new(sizeof(QbnObjReloc), 0, (void**) &obj->relocs);
+    obj->vec_symbol_map = util_vector_new(sizeof(unsigned int), 0, (void**) &obj->symbol_map);
+    return obj;
+}
+
+QbnObject* qbn_object_new_fragment(QbnContext* context) {
+    // code of a single function, see qbn_object_append
+    QbnObject* obj = malloc(sizeof(QbnObject));
+    obj->context = context;
+    for (int i=0; i<QBN_SEC_COUNT; i++) {
+        obj->vec_bytes[i] = NULL;
+        obj->bytes[i] = NULL;
+    }
+    obj->vec_bytes[QBN_SEC_TEXT] = util_vector_new(1, 256, (void**) &obj->bytes[QBN_SEC_TEXT]);
+    obj->bss_size = 0;
+    obj->vec_symbols = util_vector_new(sizeof(QbnObjSymbol), 4, (void**) &obj->symbols);
+    obj->vec_relocs = util_vector_new(sizeof(QbnObjReloc), 4, (void**) &obj->relocs);
+    obj->vec_symbol_map = util_vector_new(sizeof(unsigned int), 4, (void**) &obj->symbol_map);
+    return obj;
+}
+
+void qbn_object_free(QbnObject* obj) {
+    for (int i=0; i<QBN_SEC_COUNT; i++) {
+        if (obj->vec_bytes[i]) {
+            util_vector_free(obj->vec_bytes[i]);
+        }
+    }
+    util_vector_free(obj->vec_symbols);
+    util_vector_free(obj->vec_relocs);
+    util_vector_free(obj->vec_symbol_map);
+    free(obj);
+}
+
+unsigned long qbn_object_offset(QbnObject* obj, QbnSection section) {
+    if (section == QBN_SEC_BSS) {
+        return obj->bss_size;
+    }
+    return obj->vec_bytes[section]->length;
+}
+
+void qbn_object_put(QbnObject* obj, QbnSection section, const void* bytes, size_t count) {
+    size_t pos = obj->vec_bytes[section]->length;
+    util_vector_grow(obj->vec_bytes[section], count);
+    memcpy(obj->bytes[section] + pos, bytes, count);
+}
+
+void qbn_object_put_byte(QbnObject* obj, QbnSection section, unsigned char byte) {
+    qbn_object_put(obj, section, &byte, 1);
+}
+
+void qbn_object_put_int(QbnObject* obj, QbnSection section, long value, unsigned char size) {
+    // little endian
+    unsigned char bytes[8];
+    for (int i=0; i<size; i++) {
+        bytes[i] = (unsigned char) (value >> (8 * i));
+    }
+    qbn_object_put(obj, section, bytes, size);
+}
+
+void qbn_object_put_zero(QbnObject* obj, QbnSection section, unsigned long count) {
+    if (section == QBN_SEC_BSS) {
+        obj->bss_size += count;
+        return;
+    }
+    size_t pos = obj->vec_bytes[section]->length;
+    util_vector_grow(obj->vec_bytes[section], count);
+    memset(obj->bytes[section] + pos, 0, count);
+}
+
+void qbn_object_align(QbnObject* obj, QbnSection section, unsigned long alignment) {
+    unsigned long offset = qbn_object_offset(obj, section);
+    unsigned long padding = (alignment - offset % alignment) % alignment;
+    if (section == QBN_SEC_TEXT) {
+        // pad code with nops
+        for (unsigned long i=0; i<padding; i++) {
+            qbn_object_put_byte(obj, section, 0x90);
+        }
+    } else {
+        qbn_object_put_zero(obj, section, padding);
+    }
+}
+
+unsigned int qbn_object_symbol(QbnObject* obj, QbnSymbol symbol) {
+    // returns the symbol's index, an undefined one is created if the symbol is unknown
+    size_t map_length = obj->vec_symbol_map->length;
+    if (symbol >= map_length) {
+        util_vector_grow(obj->vec_symbol_map, symbol + 1 - map_length);
+        memset(obj->symbol_map + map_length, 0, (symbol + 1 - map_length) * sizeof(unsigned int));
+    }
+    if (obj->symbol_map[symbol] != 0) {
+        return obj->symbol_map[symbol] - 1;
+    }
+    unsigned int index = obj->vec_symbols->length;
+    util_vector_grow(obj->vec_symbols, 1);
+    obj->symbol_map[symbol] = index + 1;
+    obj->symbols[index] = (QbnObjSymbol) {
+            .symbol = symbol,
+            .name = qbn_symbol_name(obj->context, symbol),
+            .section = QBN_SEC_NONE,
+            .offset = 0,
+            .size = 0,
+            .global = true,
+            .function = false
+    };
+    return index;
+}
+
+unsigned int qbn_object_define_at(QbnObject* obj, QbnSymbol name, QbnSection section, unsigned long offset,
+                                  bool global, bool function) {
+    unsigned int index = qbn_object_symbol(obj, name);
+    QbnObjSymbol* symbol = &obj->symbols[index];
+    if (symbol->section != QBN_SEC_NONE) {
+        fprintf(stderr, "Symbol %s defined twice\n", symbol->name);
+        qbn_error("Invalid object");
+    }
+    symbol->section = section;
+    symbol->offset = offset;
+    symbol->global = global;
+    symbol->function = function;
+    return index;
+}
+
+unsigned int qbn_object_define(QbnObject* obj, QbnSymbol name, QbnSection section, bool global, bool function) {
+    return qbn_object_define_at(obj, name, section, qbn_object_offset(obj, section), global, function);
+}
+
+void qbn_object_reloc(QbnObject* obj, QbnSection section, unsigned long offset, QbnSymbol name, unsigned int type, long addend) {
+    util_vector_grow(obj->vec_relocs, 1);
+    obj->relocs[obj->vec_relocs->length-1] = (QbnObjReloc) {
+            .section = section,
+            .offset = offset,
+            .symbol = qbn_object_symbol(obj, name),
+            .type = type,
+            .addend = addend
+    };
+}
+
+void qbn_object_put_ascii(QbnObject* obj, QbnSection section, const char* s) {
+    // data strings use gas escape sequences, see qbn_emit_data
+    while (*s) {
+        unsigned char c = *s++;
+        if (c != '\\') {
+            qbn_object_put_byte(obj, section, c);
+            continue;
+        }
+        c = *s++;
+        switch (c) {
+            case 'n': qbn_object_put_byte(obj, section, '\n'); break;
+            case 't': qbn_object_put_byte(obj, section, '\t'); break;
+            case 'r': qbn_object_put_byte(obj, section, '\r'); break;
+            case 'b': qbn_object_put_byte(obj, section, '\b'); break;
+            case 'f': qbn_object_put_byte(obj, section, '\f'); break;
+            case 'x': {
+                unsigned char value = 0;
+                while ((*s >= '0' && *s <= '9') || (*s >= 'a' && *s <= 'f') || (*s >= 'A' && *s <= 'F')) {
+                    value = value * 16 + (*s <= '9' ? *s - '0' : (*s | 0x20) - 'a' + 10);
+                    s++;
+                }
+                qbn_object_put_byte(obj, section, value);
+                break;
+            }
+            case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+                unsigned char value = c - '0';
+                for (int i=0; i<2 && *s >= '0' && *s <= '7'; i++, s++) {
+                    value = value * 8 + (*s - '0');
+                }
+                qbn_object_put_byte(obj, section, value);
+                break;
+            }
+            case 0:
+                return;
+            default:
+                // \\, \" and unknown escapes stand for the character itself
+                qbn_object_put_byte(obj, section, c);
+        }
+    }
+}
+
+void qbn_object_add_data(QbnObject* obj, QbnContext* context, QbnDataDef* def, bool* is_aligned) {
+    // mirrors qbn_emit_data, is_aligned is reset for every section
+    QbnSection section = def->section;
+    if (!*is_aligned) {
+        qbn_object_align(obj, section, 8);
+        *is_aligned = true;
+    }
+    unsigned int symbol = qbn_object_define(obj, def->name, section, def->export, false);
+
+    for (unsigned int i=0; i<def->n_items; i++) {
+        QbnDataItem* data = &context->data_items[def->first + i];
+        switch (data->type) {
+            case QBN_DATA_ALIGN:
+                qbn_object_align(obj, section, data->value.align_length);
+                *is_aligned = true;
+                break;
+            case QBN_DATA_ZERO:
+                qbn_object_put_zero(obj, section, data->value.zero_length);
+                break;
+            case QBN_DATA_REF_DATA:
+                qbn_object_reloc(obj, section, qbn_object_offset(obj, section), data->value.global_ref.name,
+                                 QBN_TYPE_INFO[data->value.global_ref.ext_type].bytes == 8 ? R_X86_64_64 : R_X86_64_32,
+                                 data->value.global_ref.offset);
+                qbn_object_put_zero(obj, section, QBN_TYPE_INFO[data->value.global_ref.ext_type].bytes);
+                break;
+            case QBN_DATA_REF_FUNC:
+                // TODO: change according to target pointer size
+                qbn_object_reloc(obj, section, qbn_object_offset(obj, section), data->value.global_ref.name,
+                                 R_X86_64_64, 0);
+                qbn_object_put_zero(obj, section, 8);
+                break;
+            case QBN_DATA_STRING:
+                qbn_object_put_ascii(obj, section, data->value.string);
+                break;
+            case QBN_DATA_CONSTANT:
+                qbn_object_put_int(obj, section, data->value.number.value.i,
+                                   QBN_TYPE_INFO[data->value.number.ext_type].bytes);
+                break;
+            default:
+                QBN_UNREACHABLE
+        }
+    }
+    obj->symbols[symbol].size = qbn_object_offset(obj, section) - obj->symbols[symbol].offset;
+}
+
+void qbn_object_add_insn(QbnObject* obj, QbnAmd64Insn* insn) {
+    unsigned char buf[QBN_AMD64_MAX_INSN_SIZE];
+    QbnAmd64Fixup fixup;
+    size_t length = qbn_amd64_encode(insn, buf, &fixup);
+    unsigned long offset = qbn_object_offset(obj, QBN_SEC_TEXT);
+    qbn_object_put(obj, QBN_SEC_TEXT, buf, length);
+    if (fixup.offset >= 0) {
+        bool is_branch = insn->mnem == QBN_AMD64_CALL || insn->mnem == QBN_AMD64_JMP ||
+                         insn->mnem == QBN_AMD64_JCC;
+        qbn_object_reloc(obj, QBN_SEC_TEXT, offset + fixup.offset, fixup.sym,
+                         is_branch ? R_X86_64_PLT32 : R_X86_64_PC32, fixup.addend);
+    }
+}
+
+void qbn_object_add_block(QbnObject* obj, QbnFn* fn, QbnBlock* block) {
+    // mirrors qbn_emit_block
+    QbnAmd64Insn insn;
+    for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+        if (qbn_amd64_select(fn, instr, &insn)) {
+            qbn_object_add_insn(obj, &insn);
+        }
+    }
+}
+
+typedef struct {
+    unsigned long body;        // offset of the instructions before the jumps are placed
+    unsigned long body_end;
+    unsigned long start;       // offset once the jumps are in
+    unsigned int first_reloc;
+    int n_jumps;
+    QbnAmd64Insn jumps[QBN_AMD64_MAX_JUMPS];
+} QbnObjBlock;
+
+size_t qbn_object_jump_length(QbnAmd64Insn* jump) {
+    unsigned char buf[QBN_AMD64_MAX_INSN_SIZE];
+    QbnAmd64Fixup fixup;
+    QbnAmd64Insn insn = *jump;
+    insn.dst.imm = 0;
+    return qbn_amd64_encode(&insn, buf, &fixup);
+}
+
+void qbn_object_relax_jumps(QbnObjBlock* blocks, size_t n_blocks) {
+    // every jump starts short and is made long while its target is out of reach, jumps only grow
+    // so this ends, usually after one or two rounds
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        unsigned long shift = 0;
+        for (int i=0; i<n_blocks; i++) {
+            blocks[i].start = blocks[i].body + shift;
+            for (int j=0; j<blocks[i].n_jumps; j++) {
+                shift += qbn_object_jump_length(&blocks[i].jumps[j]);
+            }
+        }
+        for (int i=0; i<n_blocks; i++) {
+            unsigned long pos = blocks[i].start + blocks[i].body_end - blocks[i].body;
+            for (int j=0; j<blocks[i].n_jumps; j++) {
+                QbnAmd64Operand* label = &blocks[i].jumps[j].dst;
+                pos += qbn_object_jump_length(&blocks[i].jumps[j]);
+                long displacement = (long) blocks[label->imm].start - (long) pos;
+                if (label->size == 1 && (displacement < -128 || displacement > 127)) {
+                    label->size = 4;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void qbn_object_add_fn(QbnObject* obj, QbnFn* fn) {
+    // mirrors qbn_emit_fn_body, the blocks are written without their jumps first and moved apart
+    // once the size of every jump is known
+    unsigned int symbol = qbn_object_define(obj, fn->name, QBN_SEC_TEXT, fn->export, true);
+    QbnAmd64Insn insns[MAX(QBN_AMD64_MAX_PROLOGUE, QBN_AMD64_MAX_EPILOGUE)];
+    int count = qbn_amd64_prologue(fn, insns);
+    for (int i=0; i<count; i++) {
+        qbn_object_add_insn(obj, &insns[i]);
+    }
+
+    QbnCfg* cfg = qbn_fn_cfg(fn);
+    size_t n_blocks = fn->vec_blocks->length;
+    QbnObjBlock* blocks = malloc(sizeof(QbnObjBlock) * n_blocks);
+    if (!blocks) {
+        util_vector_no_memory();
+    }
+    bool has_jumps = false;
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        blocks[i].body = qbn_object_offset(obj, QBN_SEC_TEXT);
+        blocks[i].first_reloc = obj->vec_relocs->length;
+        blocks[i].n_jumps = 0;
+        if (cfg->rpo_index[i] == QBN_CFG_NONE) {
+            blocks[i].body_end = blocks[i].body;
+            continue;
+        }
+        qbn_object_add_block(obj, fn, block);
+        assert(block->jmp_type != QBN_JUMP_NONE);
+        if (QBN_IS_RETURN(block->jmp_type)) {
+            count = qbn_amd64_epilogue(fn, block, insns);
+            for (int j=0; j<count; j++) {
+                qbn_object_add_insn(obj, &insns[j]);
+            }
+        } else {
+            blocks[i].n_jumps = qbn_amd64_jumps(fn, block, i + 1 < n_blocks ? fn->blocks[i+1] : NULL, blocks[i].jumps);
+            for (int j=0; j<blocks[i].n_jumps; j++) {
+                blocks[i].jumps[j].dst.size = 1;
+                has_jumps = true;
+            }
+        }
+        blocks[i].body_end = qbn_object_offset(obj, QBN_SEC_TEXT);
+    }
+
+    if (has_jumps) {
+        qbn_object_relax_jumps(blocks, n_blocks);
+        QbnObjBlock* last = &blocks[n_blocks-1];
+        unsigned long end = last->start + last->body_end - last->body;
+        for (int j=0; j<last->n_jumps; j++) {
+            end += qbn_object_jump_length(&last->jumps[j]);
+        }
+        util_vector_grow(obj->vec_bytes[QBN_SEC_TEXT], end - last->body_end);
+
+        // back to front, a block only moves towards the end
+        unsigned char* text = obj->bytes[QBN_SEC_TEXT];
+        unsigned int reloc_end = obj->vec_relocs->length;
+        for (int i=(int) n_blocks-1; i>=0; i--) {
+            QbnObjBlock* block = &blocks[i];
+            unsigned long delta = block->start - block->body;
+            memmove(text + block->start, text + block->body, block->body_end - block->body);
+            for (unsigned int r=block->first_reloc; r<reloc_end; r++) {
+                obj->relocs[r].offset += delta;
+            }
+            reloc_end = block->first_reloc;
+
+            size_t pos = block->start + block->body_end - block->body;
+            for (int j=0; j<block->n_jumps; j++) {
+                QbnAmd64Insn jump = block->jumps[j];
+                size_t length = qbn_object_jump_length(&jump);
+                jump.dst.imm = (long) blocks[jump.dst.imm].start - (long) (pos + length);
+                QbnAmd64Fixup fixup;
+                qbn_amd64_encode(&jump, text + pos, &fixup);
+                pos += length;
+            }
+        }
+    }
+    free(blocks);
+    obj->symbols[symbol].size = qbn_object_offset(obj, QBN_SEC_TEXT) - obj->symbols[symbol].offset;
+}
+
+void qbn_object_append(QbnObject* obj, QbnObject* fragment) {
+    // appends the code of a function fragment, symbols and relocations are moved to its new offset
+    unsigned long base = qbn_object_offset(obj, QBN_SEC_TEXT);
+    qbn_object_put(obj, QBN_SEC_TEXT, fragment->bytes[QBN_SEC_TEXT], fragment->vec_bytes[QBN_SEC_TEXT]->length);
+    for (int i=0; i<fragment->vec_symbols->length; i++) {
+        QbnObjSymbol* symbol = &fragment->symbols[i];
+        if (symbol->section == QBN_SEC_NONE) {
+            qbn_object_symbol(obj, symbol->symbol);
+        } else {
+            assert(symbol->section == QBN_SEC_TEXT);
+            unsigned int index = qbn_object_define_at(obj, symbol->symbol, QBN_SEC_TEXT, base + symbol->offset,
+                                                      symbol->global, symbol->function);
+            obj->symbols[index].size = symbol->size;
+        }
+    }
+    for (int i=0; i<fragment->vec_relocs->length; i++) {
+        QbnObjReloc* reloc = &fragment->relocs[i];
+        qbn_object_reloc(obj, QBN_SEC_TEXT, base + reloc->offset, fragment->symbols[reloc->symbol].symbol,
+                         reloc->type, reloc->addend);
+    }
+}
+
+QbnObject* qbn_object_build(QbnContext* context) {
+    // the context has to be processed already
+    QbnObject* obj = qbn_object_new(context);
+    for (int s=0; s<QBN_N_DATA_SECTIONS; s++) {
+        bool is_aligned = false;
+        for (int i=0; i<context->vec_data_defs->length; i++) {
+            if (context->data_defs[i].section == QBN_DATA_SECTIONS[s]) {
+                qbn_object_add_data(obj, context, &context->data_defs[i], &is_aligned);
+            }
+        }
+    }
+    // fragments are copied together, reserve for all of them at once
+    size_t n_text = 0, n_symbols = 0, n_relocs = 0;
+    for (int i=0; i<context->vec_functions->length; i++) {
+        QbnObject* code = context->functions[i]->code;
+        if (code != NULL) {
+            n_text += code->vec_bytes[QBN_SEC_TEXT]->length;
+            n_symbols += code->vec_symbols->length;
+            n_relocs += code->vec_relocs->length;
+        }
+    }
+    util_vector_reserve(obj->vec_bytes[QBN_SEC_TEXT], n_text);
+    util_vector_reserve(obj->vec_symbols, n_symbols);
+    util_vector_reserve(obj->vec_relocs, n_relocs);
+    for (int i=0; i<context->vec_functions->length; i++) {
+        QbnFn* fn = context->functions[i];
+        if (fn->code != NULL) {
+            // encoded by qbn_process_parallel
+            qbn_object_append(obj, fn->code);
+        } else {
+            qbn_object_add_fn(obj, fn);
+        }
+    }
+    return obj;
+}
+
+typedef struct {
+    const char* name;
+    Elf64_Word type;
+    Elf64_Xword flags;
+    Elf64_Xword alignment;
+    Elf64_Xword entry_size;
+    Elf64_Word link;
+    Elf64_Word info;
+    const void* content;
+    Elf64_Xword size;
+    Elf64_Off offset;
+    Elf64_Word name_offset;
+} QbnElfSection;
+
+void qbn_object_elf_string(UtilVector* vec_strings, char** strings, const char* s, Elf64_Word* offset) {
+    *offset = vec_strings->length;
+    size_t len = strlen(s) + 1;
+    util_vector_grow(vec_strings, len);
+    memcpy(*strings + *offset, s, len);
+}
+
+void qbn_object_write_elf(QbnObject* obj, QbnOutBuf* out) {
+    // section header indices, the order of the sections is fixed
+    enum {
+        SH_NULL, SH_TEXT, SH_DATA, SH_RODATA, SH_BSS,
+        SH_RELA_TEXT, SH_RELA_DATA, SH_RELA_RODATA,
+        SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_NOTE_STACK, SH_COUNT
+    };
+    const QbnSection progbits[] = {QBN_SEC_TEXT, QBN_SEC_DATA, QBN_SEC_RODATA};
+
+    // symbol table: null symbol, locals, globals
+    size_t n_symbols = obj->vec_symbols->length;
+    Elf64_Sym* elf_symbols = calloc(n_symbols + 1, sizeof(Elf64_Sym));
+    unsigned int* symbol_map = malloc(sizeof(unsigned int) * (n_symbols + 1));
+    char* strings;
+    UtilVector* vec_strings = util_vector_new(1, 1024, (void**) &strings);
+    util_vector_grow(vec_strings, 1);
+    strings[0] = 0;
+    unsigned int n_elf_symbols = 1;
+    unsigned int first_global = 0;
+    for (int pass=0; pass<2; pass++) {
+        if (pass == 1) {
+            first_global = n_elf_symbols;
+        }
+        for (unsigned int i=0; i<n_symbols; i++) {
+            QbnObjSymbol* symbol = &obj->symbols[i];
+            if (symbol->global != (pass == 1)) {
+                continue;
+            }
+            Elf64_Sym* elf_symbol = &elf_symbols[n_elf_symbols];
+            qbn_object_elf_string(vec_strings, &strings, symbol->name, &elf_symbol->st_name);
+            unsigned char type = symbol->section == QBN_SEC_NONE ? STT_NOTYPE : (symbol->function ? STT_FUNC : STT_OBJECT);
+            elf_symbol->st_info = ELF64_ST_INFO(symbol->global ? STB_GLOBAL : STB_LOCAL, type);
+            elf_symbol->st_other = STV_DEFAULT;
+            switch (symbol->section) {
+                case QBN_SEC_TEXT: elf_symbol->st_shndx = SH_TEXT; break;
+                case QBN_SEC_DATA: elf_symbol->st_shndx = SH_DATA; break;
+                case QBN_SEC_RODATA: elf_symbol->st_shndx = SH_RODATA; break;
+                case QBN_SEC_BSS: elf_symbol->st_shndx = SH_BSS; break;
+                default: elf_symbol->st_shndx = SHN_UNDEF;
+            }
+            elf_symbol->st_value = symbol->offset;
+            elf_symbol->st_size = symbol->size;
+            symbol_map[i] = n_elf_symbols;
+            n_elf_symbols++;
+        }
+    }
+
+    // relocations, grouped by section
+    size_t n_relocs = obj->vec_relocs->length;
+    Elf64_Rela* elf_relocs = malloc(sizeof(Elf64_Rela) * (n_relocs + 1));
+    Elf64_Rela* rela_start[QBN_SEC_COUNT];
+    size_t rela_count[QBN_SEC_COUNT];
+    size_t n_elf_relocs = 0;
+    for (int s=0; s<3; s++) {
+        rela_start[progbits[s]] = elf_relocs + n_elf_relocs;
+        for (size_t i=0; i<n_relocs; i++) {
+            QbnObjReloc* reloc = &obj->relocs[i];
+            if (reloc->section == progbits[s]) {
+                elf_relocs[n_elf_relocs] = (Elf64_Rela) {
+                        .r_offset = reloc->offset,
+                        .r_info = ELF64_R_INFO(symbol_map[reloc->symbol], reloc->type),
+                        .r_addend = reloc->addend
+                };
+                n_elf_relocs++;
+            }
+        }
+        rela_count[progbits[s]] = elf_relocs + n_elf_relocs - rela_start[progbits[s]];
+    }
+
+    QbnElfSection sections[SH_COUNT] = {
+            [SH_NULL] = {""},
+            [SH_TEXT] = {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, 0, 0, 0,
+                         obj->bytes[QBN_SEC_TEXT], obj->vec_bytes[QBN_SEC_TEXT]->length},
+            [SH_DATA] = {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8, 0, 0, 0,
+                         obj->bytes[QBN_SEC_DATA], obj->vec_bytes[QBN_SEC_DATA]->length},
+            [SH_RODATA] = {".rodata", SHT_PROGBITS, SHF_ALLOC, 8, 0, 0, 0,
+                           obj->bytes[QBN_SEC_RODATA], obj->vec_bytes[QBN_SEC_RODATA]->length},
+            [SH_BSS] = {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 8, 0, 0, 0, NULL, obj->bss_size},
+            [SH_RELA_TEXT] = {".rela.text", SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela), SH_SYMTAB, SH_TEXT,
+                              rela_start[QBN_SEC_TEXT], rela_count[QBN_SEC_TEXT] * sizeof(Elf64_Rela)},
+            [SH_RELA_DATA] = {".rela.data", SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela), SH_SYMTAB, SH_DATA,
+                              rela_start[QBN_SEC_DATA], rela_count[QBN_SEC_DATA] * sizeof(Elf64_Rela)},
+            [SH_RELA_RODATA] = {".rela.rodata", SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela), SH_SYMTAB, SH_RODATA,
+                                rela_start[QBN_SEC_RODATA], rela_count[QBN_SEC_RODATA] * sizeof(Elf64_Rela)},
+            [SH_SYMTAB] = {".symtab", SHT_SYMTAB, 0, 8, sizeof(Elf64_Sym), SH_STRTAB, first_global,
+                           elf_symbols, n_elf_symbols * sizeof(Elf64_Sym)},
+            [SH_STRTAB] = {".strtab", SHT_STRTAB, 0, 1, 0, 0, 0, NULL, 0},
+            [SH_SHSTRTAB] = {".shstrtab", SHT_STRTAB, 0, 1, 0, 0, 0, NULL, 0},
+            [SH_NOTE_STACK] = {".note.GNU-stack", SHT_PROGBITS, 0, 1, 0, 0, 0, NULL, 0},
+    };
+    sections[SH_STRTAB].content = strings;
+    sections[SH_STRTAB].size = vec_strings->length;
+
+    char* section_names;
+    UtilVector* vec_section_names = util_vector_new(1, 256, (void**) &section_names);
+    for (int i=0; i<SH_COUNT; i++) {
+        qbn_object_elf_string(vec_section_names, &section_names, sections[i].name, &sections[i].name_offset);
+    }
+    sections[SH_SHSTRTAB].content = section_names;
+    sections[SH_SHSTRTAB].size = vec_section_names->length;
+
+    // file layout: header, section contents, section header table
+    Elf64_Off offset = sizeof(Elf64_Ehdr);
+    for (int i=1; i<SH_COUNT; i++) {
+        offset = (offset + sections[i].alignment - 1) / sections[i].alignment * sections[i].alignment;
+        sections[i].offset = offset;
+        if (sections[i].type != SHT_NOBITS) {
+            offset += sections[i].size;
+        }
+    }
+    Elf64_Off sh_offset = (offset + 7) / 8 * 8;
+
+    Elf64_Ehdr header = {
+            .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+            .e_type = ET_REL,
+            .e_machine = EM_X86_64,
+            .e_version = EV_CURRENT,
+            .e_entry = 0,
+            .e_phoff = 0,
+            .e_shoff = sh_offset,
+            .e_flags = 0,
+            .e_ehsize = sizeof(Elf64_Ehdr),
+            .e_phentsize = 0,
+            .e_phnum = 0,
+            .e_shentsize = sizeof(Elf64_Shdr),
+            .e_shnum = SH_COUNT,
+            .e_shstrndx = SH_SHSTRTAB,
+    };
+    qbn_outbuf_write(out, &header, sizeof(header));
+    Elf64_Off position = sizeof(Elf64_Ehdr);
+    for (int i=1; i<SH_COUNT; i++) {
+        if (sections[i].type == SHT_NOBITS) {
+            continue;
+        }
+        qbn_outbuf_zero(out, sections[i].offset - position);
+        if (sections[i].size) {
+            qbn_outbuf_write(out, sections[i].content, sections[i].size);
+        }
+        position = sections[i].offset + sections[i].size;
+    }
+    qbn_outbuf_zero(out, sh_offset - position);
+    for (int i=0; i<SH_COUNT; i++) {
+        Elf64_Shdr section_header = {0};
+        if (i != SH_NULL) {
+            section_header = (Elf64_Shdr) {
+                    .sh_name = sections[i].name_offset,
+                    .sh_type = sections[i].type,
+                    .sh_flags = sections[i].flags,
+                    .sh_addr = 0,
+                    .sh_offset = sections[i].offset,
+                    .sh_size = sections[i].size,
+                    .sh_link = sections[i].link,
+                    .sh_info = sections[i].info,
+                    .sh_addralign = sections[i].alignment,
+                    .sh_entsize = sections[i].entry_size,
+            };
+        }
+        qbn_outbuf_write(out, &section_header, sizeof(section_header));
+    }
+
+    util_vector_free(vec_section_names);
+    util_vector_free(vec_strings);
+    free(elf_relocs);
+    free(symbol_map);
+    free(elf_symbols);
+}
+
+void qbn_emit_object_buffer(QbnContext* context, QbnOutBuf* out) {
+    // appends an ELF64 relocatable object to out, the context has to be processed already
+    QbnObject* obj = qbn_object_build(context);
+    qbn_object_write_elf(obj, out);
+    qbn_object_free(obj);
+}
+
+void qbn_emit_object(QbnContext* context, FILE* file) {
+    QbnOutBuf out;
+    qbn_outbuf_init(&out, file);
+    qbn_emit_object_buffer(context, &out);
+    qbn_outbuf_free(&out);
+}
+
+#endif //QBN_OBJECT_H
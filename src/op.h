@@ -55,6 +55,7 @@ const QbnTypeInfo QBN_TYPE_INFO[] = {
 enum QbnOp {
     QBN_OP0,
     QBN_OP_BLOCK_END,
+    QBN_OP_NEXT_CHUNK,  // last slot of an instruction chunk, continues in the next one
 
     /* PUBLIC OPERATIONS */
     /* Arithmetic and Bits */
@@ -165,6 +166,7 @@ enum QbnOp {
     QBN_OP_ADDR,
     QBN_OP_SWAP,
     QBN_OP_SIGN,
+    QBN_OP_NEG,
     QBN_OP_SALLOC,
     QBN_OP_XIDIV,
     QBN_OP_XDIV,
@@ -311,6 +313,7 @@ const QbnOpInfo qbn_op_info[] = {
         [QBN_OP_ADDR]     = {{{[QBN_TYPE_I32]=QBN_TYPE_MEM, [QBN_TYPE_I64]=QBN_TYPE_MEM, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR}, {[QBN_TYPE_I32]=QBN_TYPE_XXX, [QBN_TYPE_I64]=QBN_TYPE_XXX, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR} }, 0},
         [QBN_OP_SWAP]     = {{{[QBN_TYPE_I32]=QBN_TYPE_I32, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_F32, [QBN_TYPE_F64]=QBN_TYPE_F64}, {[QBN_TYPE_I32]=QBN_TYPE_I32, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_F32, [QBN_TYPE_F64]=QBN_TYPE_F64} }, 0},
         [QBN_OP_SIGN]     = {{{[QBN_TYPE_I32]=QBN_TYPE_I32, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR}, {[QBN_TYPE_I32]=QBN_TYPE_XXX, [QBN_TYPE_I64]=QBN_TYPE_XXX, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR} }, 0},
+        [QBN_OP_NEG]      = {{{[QBN_TYPE_I32]=QBN_TYPE_I32, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR}, {[QBN_TYPE_I32]=QBN_TYPE_XXX, [QBN_TYPE_I64]=QBN_TYPE_XXX, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR} }, 0},
         [QBN_OP_SALLOC]   = {{{[QBN_TYPE_I32]=QBN_TYPE_ERR, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR}, {[QBN_TYPE_I32]=QBN_TYPE_ERR, [QBN_TYPE_I64]=QBN_TYPE_XXX, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR} }, 0},
         [QBN_OP_XIDIV]    = {{{[QBN_TYPE_I32]=QBN_TYPE_I32, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR}, {[QBN_TYPE_I32]=QBN_TYPE_XXX, [QBN_TYPE_I64]=QBN_TYPE_XXX, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR} }, 0},
         [QBN_OP_XDIV]     = {{{[QBN_TYPE_I32]=QBN_TYPE_I32, [QBN_TYPE_I64]=QBN_TYPE_I64, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR}, {[QBN_TYPE_I32]=QBN_TYPE_XXX, [QBN_TYPE_I64]=QBN_TYPE_XXX, [QBN_TYPE_F32]=QBN_TYPE_ERR, [QBN_TYPE_F64]=QBN_TYPE_ERR} }, 0},
@@ -352,6 +355,7 @@ const QbnOpInfo qbn_op_info[] = {
 const char* qbn_op2str[] = {
         [QBN_OP0]          = "000",
         [QBN_OP_BLOCK_END] = "block_end",
+        [QBN_OP_NEXT_CHUNK] = "next_chunk",
         [QBN_OP_ADD]       = "add",
         [QBN_OP_SUB]       = "sub",
         [QBN_OP_DIV]       = "div",
@@ -439,6 +443,7 @@ const char* qbn_op2str[] = {
         [QBN_OP_ADDR]      = "addr",
         [QBN_OP_SWAP]      = "swap",
         [QBN_OP_SIGN]      = "sign",
+        [QBN_OP_NEG]       = "neg",
         [QBN_OP_SALLOC]    = "salloc",
         [QBN_OP_XIDIV]     = "xidiv",
         [QBN_OP_XDIV]      = "xdiv",
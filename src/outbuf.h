@@ -0,0 +1,139 @@
+#ifndef QBN_OUTBUF_H
+#define QBN_OUTBUF_H
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "limits.h"
+#include "util/std.h"
+#include "util/vector.h"
+
+// Output buffer of the assembly emitter. Text is appended with plain copies instead of going through printf,
+// and written to the file in chunks of QBN_LIMIT_OUT_BUFFER bytes. Without a file the buffer grows instead
+// and keeps all the text in memory, where the caller can take it over with qbn_outbuf_take. A zeroed
+// QbnOutBuf is an empty growing buffer.
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    FILE* file;     // flushed to when full, NULL to grow
+} QbnOutBuf;
+
+void qbn_outbuf_init(QbnOutBuf* buf, FILE* file) {
+    // a growing buffer starts small, it often holds a single function
+    buf->capacity = file != NULL ? QBN_LIMIT_OUT_BUFFER : QBN_LIMIT_OUT_BUFFER / 16;
+    buf->data = malloc(buf->capacity);
+    if (!buf->data) {
+        util_vector_no_memory();
+    }
+    buf->length = 0;
+    buf->file = file;
+}
+
+void qbn_outbuf_flush(QbnOutBuf* buf) {
+    if (buf->file != NULL && buf->length) {
+        fwrite(buf->data, 1, buf->length, buf->file);
+        buf->length = 0;
+    }
+}
+
+void qbn_outbuf_make_room(QbnOutBuf* buf, size_t count) {
+    if (buf->file != NULL) {
+        qbn_outbuf_flush(buf);
+        if (count <= buf->capacity) {
+            return;
+        }
+    }
+    size_t new_capacity = MAX(buf->capacity * 2, QBN_LIMIT_OUT_BUFFER / 16);
+    while (buf->length + count > new_capacity) {
+        new_capacity *= 2;
+    }
+    char* new_data = realloc(buf->data, new_capacity);
+    if (!new_data) {
+        util_vector_no_memory();
+    }
+    buf->data = new_data;
+    buf->capacity = new_capacity;
+}
+
+char* qbn_outbuf_reserve(QbnOutBuf* buf, size_t count) {
+    // returns room for count bytes at the end, the caller advances length
+    if (buf->length + count > buf->capacity) {
+        qbn_outbuf_make_room(buf, count);
+    }
+    return buf->data + buf->length;
+}
+
+void qbn_outbuf_write(QbnOutBuf* buf, const void* str, size_t length) {
+    if (buf->file != NULL && length > buf->capacity) {
+        // too large to collect, written through
+        qbn_outbuf_flush(buf);
+        fwrite(str, 1, length, buf->file);
+        return;
+    }
+    memcpy(qbn_outbuf_reserve(buf, length), str, length);
+    buf->length += length;
+}
+
+void qbn_outbuf_str(QbnOutBuf* buf, const char* str) {
+    qbn_outbuf_write(buf, str, strlen(str));
+}
+
+void qbn_outbuf_char(QbnOutBuf* buf, char c) {
+    *qbn_outbuf_reserve(buf, 1) = c;
+    buf->length++;
+}
+
+void qbn_outbuf_long(QbnOutBuf* buf, long value) {
+    // decimal, written backwards into a scratch buffer
+    char digits[20];
+    int count = 0;
+    unsigned long abs = value < 0 ? -(unsigned long) value : (unsigned long) value;
+    do {
+        digits[count++] = (char) ('0' + abs % 10);
+        abs /= 10;
+    } while (abs);
+    char* out = qbn_outbuf_reserve(buf, count + 1);
+    if (value < 0) {
+        *out++ = '-';
+    }
+    for (int i=0; i<count; i++) {
+        out[i] = digits[count - 1 - i];
+    }
+    buf->length += count + (value < 0);
+}
+
+void qbn_outbuf_signed(QbnOutBuf* buf, long value) {
+    // like printf's %+ld
+    if (value >= 0) {
+        qbn_outbuf_char(buf, '+');
+    }
+    qbn_outbuf_long(buf, value);
+}
+
+void qbn_outbuf_zero(QbnOutBuf* buf, size_t count) {
+    memset(qbn_outbuf_reserve(buf, count), 0, count);
+    buf->length += count;
+}
+
+char* qbn_outbuf_take(QbnOutBuf* buf, size_t* length) {
+    // hands the collected bytes to the caller, who frees them, and leaves the buffer empty
+    assert(buf->file == NULL);
+    char* data = buf->data;
+    *length = buf->length;
+    buf->data = NULL;
+    buf->length = 0;
+    buf->capacity = 0;
+    return data;
+}
+
+void qbn_outbuf_free(QbnOutBuf* buf) {
+    qbn_outbuf_flush(buf);
+    free(buf->data);
+    buf->data = NULL;
+    buf->length = 0;
+    buf->capacity = 0;
+}
+
+#endif //QBN_OUTBUF_H
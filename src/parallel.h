@@ -0,0 +1,53 @@
+#ifndef QBN_PARALLEL_H
+#define QBN_PARALLEL_H
+
+#include <stdio.h>
+#include "qbn.h"
+#include "util/pool.h"
+#include "processing.h"
+#include "object.h"
+
+// Functions are independent after ir generation: each one is lowered into its own instruction storage and
+// can be rendered to assembly and machine code on its own. qbn_emit and qbn_object_build pick the rendered
+// output up in function order and render what is missing themselves, so the result does not depend on the
+// number of threads or on what was rendered in parallel.
+
+typedef enum {
+    QBN_RENDER_NONE = 0,
+    QBN_RENDER_GAS = 1,     // assembly for qbn_emit
+    QBN_RENDER_OBJECT = 2,  // machine code for qbn_object_build, qbn_emit_object and qbn_jit_compile
+} QbnRenderFlags;
+
+typedef struct {
+    QbnContext* context;
+    int render;
+} QbnParallelTask;
+
+void qbn_process_fn_task(void* arg, int index) {
+    QbnParallelTask* task = arg;
+    QbnFn* fn = task->context->functions[index];
+    qbn_process_fn(fn);
+
+    if (task->render & QBN_RENDER_GAS) {
+        QbnOutBuf out = {0};
+        qbn_emit_fn_body(fn, &out);
+        fn->gas = qbn_outbuf_take(&out, &fn->gas_length);
+    }
+    if (task->render & QBN_RENDER_OBJECT) {
+        fn->code = qbn_object_new_fragment(fn->context);
+        qbn_object_add_fn(fn->code, fn);
+    }
+}
+
+void qbn_process_parallel(QbnContext* context, int n_threads, int render) {
+    // like qbn_process, n_threads <= 1 processes on the calling thread. render is a set of QbnRenderFlags,
+    // the outputs the caller is going to ask for
+    if (context->is_processed) {
+        return;
+    }
+    QbnParallelTask task = {context, render};
+    util_pool_run((int) context->vec_functions->length, n_threads, qbn_process_fn_task, &task);
+    context->is_processed = true;
+}
+
+#endif //QBN_PARALLEL_H
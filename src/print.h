@@ -10,15 +10,12 @@
 const char* QBN_IDENT = "    ";
 
 const char* QBN_DATA_ITEM_TYPE_TO_STR[] = {
-        [QBN_DATA_START] = "QBN_DATA_START",
         [QBN_DATA_ALIGN] = "QBN_DATA_ALIGN",
         [QBN_DATA_ZERO] = "QBN_DATA_ZERO",
         [QBN_DATA_REF_DATA] = "QBN_DATA_REF_DATA",
         [QBN_DATA_REF_FUNC] = "QBN_DATA_REF_FUNC",
         [QBN_DATA_STRING] = "QBN_DATA_STRING",
         [QBN_DATA_CONSTANT] = "QBN_DATA_CONSTANT",
-        [QBN_DATA_END] = "QBN_DATA_END",
-        [QBN_DATA_NEXT_VEC_BLOCK] = "QBN_DATA_NEXT_VEC_BLOCK",
 };
 
 void qbn_print_ref(QbnContext* context, QbnRef ref, unsigned char size, FILE* file) {
@@ -30,12 +27,18 @@ void qbn_print_ref(QbnContext* context, QbnRef ref, unsigned char size, FILE* fi
         case QBN_REF_TEMP:
             fprintf(file, "%%%d", QBN_REF_INDEX(ref));
             break;
+        case QBN_REF_SLOT:
+            fprintf(file, "slot%d", QBN_REF_INDEX(ref));
+            break;
+        case QBN_REF_MEM:
+            fprintf(file, "mem%d", QBN_REF_INDEX(ref));
+            break;
         case QBN_REF_CONST:
-            con = &context->consts[QBN_REF_INDEX(ref)];
+            con = QBN_CONST(context, QBN_REF_INDEX(ref));
             switch (con->type) {
                 case QBN_CONST_NAME:
                 case QBN_CONST_GLOBAL_ADDR:
-                    fprintf(file, "$%s", con->value.label);
+                    fprintf(file, "$%s", qbn_symbol_name(context, con->value.label));
                     break;
                 case QBN_CONST_NUMBER:
                     fprintf(file, "%ld", con->value.number);
@@ -54,6 +57,7 @@ void qbn_print_ref(QbnContext* context, QbnRef ref, unsigned char size, FILE* fi
 void qbn_print_ref_fn(QbnFn* fn, QbnRef ref, unsigned char size, FILE* file) {
     QbnConst* con;
     QbnTemp* temp;
+    QbnMem* mem;
     switch (QBN_REF_TYPE(ref)) {
         case QBN_REF_REG:
             fprintf(file, "%%%s", QBN_AMD64_REG2GAS(QBN_REF_INDEX(ref), size));
@@ -66,12 +70,29 @@ void qbn_print_ref_fn(QbnFn* fn, QbnRef ref, unsigned char size, FILE* file) {
                 qbn_print_ref_fn(fn, temp->slot, size, file);
             }
             break;
+        case QBN_REF_SLOT:
+            fprintf(file, "slot%d", QBN_REF_INDEX(ref));
+            break;
+        case QBN_REF_MEM:
+            mem = &fn->mems[QBN_REF_INDEX(ref)];
+            fprintf(file, "[");
+            qbn_print_ref_fn(fn, mem->base, 8, file);
+            if (mem->index != QBN_REF0) {
+                fprintf(file, " + ");
+                qbn_print_ref_fn(fn, mem->index, 8, file);
+                fprintf(file, "*%d", mem->scale);
+            }
+            if (mem->disp) {
+                fprintf(file, " %+d", mem->disp);
+            }
+            fprintf(file, "]");
+            break;
         case QBN_REF_CONST:
-            con = &fn->context->consts[QBN_REF_INDEX(ref)];
+            con = QBN_CONST(fn->context, QBN_REF_INDEX(ref));
             switch (con->type) {
                 case QBN_CONST_NAME:
                 case QBN_CONST_GLOBAL_ADDR:
-                    fprintf(file, "$%s", con->value.label);
+                    fprintf(file, "$%s", qbn_symbol_name(fn->context, con->value.label));
                     break;
                 case QBN_CONST_NUMBER:
                     fprintf(file, "%ld", con->value.number);
@@ -134,10 +155,20 @@ void qbn_print_instr_fn(QbnFn* fn, QbnInstr* instr, FILE* file) {
 }
 
 void qbn_print_fn(QbnFn* fn, FILE* file) {
-    fprintf(file, "%s():\n", fn->name);
+    fprintf(file, "%s():\n", qbn_symbol_name(fn->context, fn->name));
     for (int i=0; i<fn->vec_blocks->length; i++) {
         fprintf(file, "b%d:\n", i);
-        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr++) {
+        for (QbnPhi* phi = fn->blocks[i]->phi; phi; phi = phi->next) {
+            fprintf(file, QBN_IDENT);
+            qbn_print_ref_fn(fn, phi->to, QBN_TYPE_INFO[phi->type].bytes, file);
+            fprintf(file, " = %s phi", qbn_type2s[phi->type]);
+            for (int a=0; a<phi->n_args; a++) {
+                fprintf(file, a ? ", b%d " : " b%d ", phi->blocks[a]->id);
+                qbn_print_ref_fn(fn, phi->args[a], QBN_TYPE_INFO[phi->type].bytes, file);
+            }
+            fprintf(file, "\n");
+        }
+        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
             qbn_print_instr_fn(fn, instr, file);
         }
         // TODO: print jumps/returns
@@ -152,9 +183,9 @@ void qbn_print_fns(QbnContext* context, FILE* file) {
 }
 
 void qbn_print_instr_cache(QbnContext* context, FILE* file) {
-    QbnInstr* ip = context->instr_cache;
+    QbnInstr* ip = context->instrs.first->instr;
     fprintf(file, "instr:\n");
-    for (int i=0; i < 64; i++, ip++) {
+    for (int i=0; i < 64 && ip != context->instrs.current; i++, ip = qbn_instr_next(ip)) {
         if (ip->op != QBN_OP0) {
             qbn_print_instr(context, ip, file);
         }
@@ -163,20 +194,11 @@ void qbn_print_instr_cache(QbnContext* context, FILE* file) {
 }
 
 void qbn_print_data(QbnContext* context, FILE* file) {
-    assert(context->data->type == QBN_DATA_START);
-    QbnDataItem* data = context->data;
-    while (1) {
-        fprintf(file, "%s\n", QBN_DATA_ITEM_TYPE_TO_STR[data->type]);
-        switch (data->type) {
-            case QBN_DATA_NEXT_VEC_BLOCK:
-                data = data->value.next;
-                if (data == NULL) {
-                    return;
-                } else {
-                    break;
-                }
-            default:
-                data++;
+    for (int i=0; i<context->vec_data_defs->length; i++) {
+        QbnDataDef* def = &context->data_defs[i];
+        fprintf(file, "%s:\n", qbn_symbol_name(context, def->name));
+        for (unsigned int j=0; j<def->n_items; j++) {
+            fprintf(file, "%s%s\n", QBN_IDENT, QBN_DATA_ITEM_TYPE_TO_STR[context->data_items[def->first + j].type]);
         }
     }
 }
@@ -4,9 +4,13 @@
 
 #include <stdio.h>
 #include <assert.h>
-#include <stdarg.h>
 #include "qbn.h"
 #include "util/std.h"
+#include "liveness.h"
+#include "ssa.h"
+#include "fold.h"
+#include "dce.h"
+#include "outbuf.h"
 
 typedef enum {
     QBN_RAX = 1, /* caller-saved */
@@ -76,6 +80,25 @@ const QbnAmd64Register QBN_REG_FLOAT[] = {
 const int QBN_REG_FLOAT_COUNT = 16;
 const int QBN_REG_ARG_FLOAT_COUNT = 8;
 
+// allocation order: caller saved first, argument registers last so call setup clobbers less
+const QbnAmd64Register QBN_REG_ALLOC_INT[] = {
+        QBN_RAX, QBN_R10, QBN_R9, QBN_R8, QBN_RCX, QBN_RDX, QBN_RSI, QBN_RDI,
+        QBN_RBX, QBN_R12, QBN_R13, QBN_R14, QBN_R15
+};
+const int QBN_REG_ALLOC_INT_COUNT = 13;
+const int QBN_REG_ALLOC_INT_CALLEE_SAVED = 8;  // temps live across a call start here
+const QbnAmd64Register QBN_REG_ALLOC_FLOAT[] = {
+        QBN_XMM8, QBN_XMM9, QBN_XMM10, QBN_XMM11, QBN_XMM12, QBN_XMM13, QBN_XMM14,
+        QBN_XMM7, QBN_XMM6, QBN_XMM5, QBN_XMM4, QBN_XMM3, QBN_XMM2, QBN_XMM1, QBN_XMM0
+};
+const int QBN_REG_ALLOC_FLOAT_COUNT = 15;
+
+// never allocated, free for instructions that can't take a stack slot as operand
+#define QBN_REG_SCRATCH_INT QBN_R11
+#define QBN_REG_SCRATCH_FLOAT QBN_XMM15
+
+#define QBN_REG_BIT(reg) (1UL << (reg))
+
 typedef struct {
     char nmem;
     bool zflag;
@@ -87,243 +110,2073 @@ void qbn_add_stack(QbnFn* fn, unsigned char count) {
     fn->stack_alignment %= 16;
 }
 
+bool qbn_amd64_is_slot(QbnFn* fn, QbnRef ref) {
+    return QBN_REF_TYPE(ref) == QBN_REF_TEMP && QBN_REF_TYPE(fn->temps[QBN_REF_INDEX(ref)].slot) == QBN_REF_SLOT;
+}
+
+bool qbn_amd64_is_wide_const(QbnFn* fn, QbnRef ref) {
+    // only mov takes a 64 bit immediate, and only into a register
+    if (QBN_REF_TYPE(ref) != QBN_REF_CONST) {
+        return false;
+    }
+    QbnConst* con = QBN_CONST(fn->context, QBN_REF_INDEX(ref));
+    return con->type == QBN_CONST_NUMBER && con->value.number != (int) con->value.number;
+}
+
+QbnRef qbn_amd64_scratch(QbnFn* fn, QbnRef ref, QbnBaseType* type) {
+    // scratch register of the temp's class
+    QbnTemp* temp = &fn->temps[QBN_REF_INDEX(ref)];
+    *type = (QbnBaseType) temp->type;
+    if (temp->type == QBN_ETYPE_F32 || temp->type == QBN_ETYPE_F64) {
+        return QBN_REG_REF(QBN_REG_SCRATCH_FLOAT);
+    }
+    return QBN_REG_REF(QBN_REG_SCRATCH_INT);
+}
+
+bool qbn_amd64_is_global_addr(QbnContext* context, QbnRef ref) {
+    return QBN_REF_TYPE(ref) == QBN_REF_CONST && QBN_CONST(context, QBN_REF_INDEX(ref))->type == QBN_CONST_GLOBAL_ADDR;
+}
+
+bool qbn_amd64_is_memory(QbnFn* fn, QbnRef ref) {
+    return qbn_amd64_is_slot(fn, ref) || QBN_REF_TYPE(ref) == QBN_REF_MEM;
+}
+
+bool qbn_amd64_mem_needs_scratch(QbnFn* fn, QbnRef ref) {
+    // a spilled base or index and a constant address have to be loaded into the scratch register
+    if (QBN_REF_TYPE(ref) != QBN_REF_MEM) {
+        return false;
+    }
+    QbnMem* mem = &fn->mems[QBN_REF_INDEX(ref)];
+    return qbn_amd64_is_slot(fn, mem->base) || qbn_amd64_is_slot(fn, mem->index) ||
+           (QBN_REF_TYPE(mem->base) == QBN_REF_CONST && !qbn_amd64_is_global_addr(fn->context, mem->base));
+}
+
+QbnRef qbn_amd64_legal_mem(QbnFn* fn, QbnRef ref) {
+    // memory operand with registers only, base or index go through the scratch register
+    if (!qbn_amd64_mem_needs_scratch(fn, ref)) {
+        return ref;
+    }
+    QbnMem mem = fn->mems[QBN_REF_INDEX(ref)];
+    QbnRef scratch = QBN_REG_REF(QBN_REG_SCRATCH_INT);
+    if (qbn_amd64_is_slot(fn, mem.index) && QBN_REF_TYPE(mem.base) != QBN_REF_REG &&
+        (QBN_REF_TYPE(mem.base) != QBN_REF_TEMP || qbn_amd64_is_slot(fn, mem.base))) {
+        // scratch = index << log2(scale) + base
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = QBN_BTYPE_I64, .arg0 = mem.index,
+                                                       .to = scratch});
+        if (mem.scale > 1) {
+            QbnRef shift = qbn_context_new_const_number(fn->context, __builtin_ctz(mem.scale));
+            qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_SHL, .type = QBN_BTYPE_I64, .arg0 = shift,
+                                                           .to = scratch});
+        }
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_ADD, .type = QBN_BTYPE_I64, .arg0 = mem.base,
+                                                       .to = scratch});
+        mem = (QbnMem) {.base = scratch, .index = QBN_REF0, .scale = 1, .disp = mem.disp};
+    } else if (qbn_amd64_is_slot(fn, mem.index)) {
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = QBN_BTYPE_I64, .arg0 = mem.index,
+                                                       .to = scratch});
+        mem.index = scratch;
+    } else {
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = QBN_BTYPE_I64, .arg0 = mem.base,
+                                                       .to = scratch});
+        mem.base = scratch;
+    }
+    return qbn_fn_new_mem(fn, mem);
+}
+
+bool qbn_amd64_slot_dst_ok(QbnInstr* instr) {
+    // whether the machine instruction can write its result to memory
+    bool is_float = !QBN_TYPE_INFO[instr->type].is_int;
+    switch (instr->op) {
+        case QBN_OP_COPY:
+        case QBN_OP_AND:
+        case QBN_OP_OR:
+        case QBN_OP_XOR:
+        case QBN_OP_SAR:
+        case QBN_OP_SHR:
+        case QBN_OP_SHL:
+        case QBN_OP_NEG:
+        case QBN_OP_XTEST:
+            return true;
+        case QBN_OP_ADD:
+        case QBN_OP_SUB:
+        case QBN_OP_XCMP:
+            return !is_float;
+        default:
+            return instr->op >= QBN_OP_FLAGIEQ && instr->op <= QBN_OP_FLAGFUO;
+    }
+}
+
+bool qbn_amd64_reads_dst(QbnInstr* instr) {
+    switch (instr->op) {
+        case QBN_OP_ADD:
+        case QBN_OP_SUB:
+        case QBN_OP_MUL:
+        case QBN_OP_DIV:
+        case QBN_OP_AND:
+        case QBN_OP_OR:
+        case QBN_OP_XOR:
+        case QBN_OP_SAR:
+        case QBN_OP_SHR:
+        case QBN_OP_SHL:
+        case QBN_OP_NEG:
+        case QBN_OP_XCMP:
+        case QBN_OP_XTEST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool qbn_amd64_reads_reg(QbnFn* fn, QbnRef ref, QbnAmd64Register reg) {
+    // whether the ref reads the register after register allocation
+    if (QBN_REF_TYPE(ref) == QBN_REF_TEMP) {
+        ref = fn->temps[QBN_REF_INDEX(ref)].slot;
+    }
+    if (QBN_REF_TYPE(ref) == QBN_REF_MEM) {
+        QbnMem* mem = &fn->mems[QBN_REF_INDEX(ref)];
+        return qbn_amd64_reads_reg(fn, mem->base, reg) || qbn_amd64_reads_reg(fn, mem->index, reg);
+    }
+    return ref == QBN_REG_REF(reg);
+}
+
+QbnRef qbn_amd64_borrow_reg(QbnFn* fn, QbnInstr* instr) {
+    // a register that no operand of the instruction reads or writes, the caller saves it around the instruction
+    const QbnAmd64Register candidates[] = {QBN_RAX, QBN_RCX, QBN_RDX, QBN_RSI, QBN_RDI};
+    for (int i=0; i<5; i++) {
+        if (!qbn_amd64_reads_reg(fn, instr->arg0, candidates[i]) && !qbn_amd64_reads_reg(fn, instr->arg1, candidates[i]) &&
+            !qbn_amd64_reads_reg(fn, instr->to, candidates[i])) {
+            return QBN_REG_REF(candidates[i]);
+        }
+    }
+    QBN_UNREACHABLE
+}
+
+QbnRef qbn_amd64_borrow_push(QbnFn* fn, QbnInstr* instr) {
+    // the push is undone right after the instruction, nothing is called in between
+    QbnRef reg = qbn_amd64_borrow_reg(fn, instr);
+    qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_PUSH, .type = QBN_BTYPE_I64, .arg0 = reg});
+    return reg;
+}
+
+void qbn_amd64_add_legal(QbnFn* fn, QbnInstr instr) {
+    // lowered instructions belong to the function, functions can be lowered in parallel
+    // spilled temps and memory operands: at most one per instruction, and not every destination
+    // can be one, the scratch registers make up for it
+    if (instr.op == QBN_OP_PUSH || instr.op == QBN_OP_POP || instr.op == QBN_OP_CALL) {
+        qbn_instr_arena_add(&fn->lowered, instr);
+        return;
+    }
+    bool mem_in_scratch = qbn_amd64_mem_needs_scratch(fn, instr.arg0) || qbn_amd64_mem_needs_scratch(fn, instr.arg1)
+                          || qbn_amd64_mem_needs_scratch(fn, instr.to);
+    instr.arg0 = qbn_amd64_legal_mem(fn, instr.arg0);
+    instr.arg1 = qbn_amd64_legal_mem(fn, instr.arg1);
+    instr.to = qbn_amd64_legal_mem(fn, instr.to);
+    bool is_compare = instr.op == QBN_OP_XCMP || instr.op == QBN_OP_XTEST;
+    QbnRef* dst = is_compare ? &instr.arg0 : &instr.to;
+    QbnRef* src = is_compare ? &instr.arg1 : &instr.arg0;
+    QbnBaseType type;
+    // a symbol operand addresses the data, its address is taken with lea
+    bool is_global = qbn_amd64_is_global_addr(fn->context, *src) && instr.op != QBN_OP_ADDR;
+    if (is_global && instr.op == QBN_OP_COPY) {
+        instr.op = QBN_OP_ADDR;
+        is_global = false;
+    }
+    bool dst_to_scratch = qbn_amd64_is_slot(fn, *dst) && !qbn_amd64_slot_dst_ok(&instr);
+
+    // a second scratch register is borrowed when the first one holds an address or the destination
+    QbnRef borrowed = QBN_REF0;
+
+    if (is_global ||
+        (qbn_amd64_is_wide_const(fn, *src) && (instr.op != QBN_OP_COPY || qbn_amd64_is_memory(fn, *dst)))) {
+        QbnRef reg = QBN_REG_REF(QBN_REG_SCRATCH_INT);
+        if (dst_to_scratch || mem_in_scratch) {
+            reg = borrowed = qbn_amd64_borrow_push(fn, &instr);
+        }
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = is_global ? QBN_OP_ADDR : QBN_OP_COPY,
+                                                       .type = QBN_BTYPE_I64, .arg0 = *src, .to = reg});
+        *src = reg;
+    } else if (!dst_to_scratch && qbn_amd64_is_memory(fn, *src) && qbn_amd64_is_memory(fn, *dst)) {
+        // a memory operand is loaded into the scratch register by itself, a slot has the class of its temp
+        QbnRef scratch = qbn_amd64_scratch(fn, QBN_REF_TYPE(*src) == QBN_REF_MEM ? *dst : *src, &type);
+        if (QBN_REF_TYPE(*src) == QBN_REF_MEM) {
+            type = instr.type;
+        } else if (mem_in_scratch && QBN_REF_INDEX(scratch) == QBN_REG_SCRATCH_INT) {
+            scratch = borrowed = qbn_amd64_borrow_push(fn, &instr);
+        }
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = type, .arg0 = *src, .to = scratch});
+        *src = scratch;
+    }
+
+    QbnRef slot = QBN_REF0;
+    if (dst_to_scratch) {
+        slot = *dst;
+        QbnRef scratch = qbn_amd64_scratch(fn, slot, &type);
+        if (qbn_amd64_reads_dst(&instr)) {
+            if (mem_in_scratch && QBN_REF_INDEX(scratch) == QBN_REG_SCRATCH_INT) {
+                assert(borrowed == QBN_REF0);
+                scratch = borrowed = qbn_amd64_borrow_push(fn, &instr);
+            }
+            qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = type, .arg0 = slot, .to = scratch});
+        }
+        *dst = scratch;
+    }
+    qbn_instr_arena_add(&fn->lowered, instr);
+    if (slot != QBN_REF0 && !is_compare) {
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = type, .arg0 = *dst, .to = slot});
+    }
+    if (borrowed != QBN_REF0) {
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_POP, .type = QBN_BTYPE_I64, .to = borrowed});
+    }
+}
+
+void qbn_amd64_add_instr(QbnFn* fn, QbnOp op, QbnRef arg0, QbnRef arg1, QbnRef to, QbnBaseType type) {
+    qbn_amd64_add_legal(fn, (QbnInstr) {
+            .to = to,
+            .type = type,
+            .op = op,
+            .arg0 = arg0,
+            .arg1 = arg1
+    });
+}
+
+void qbn_amd64_copy_instr(QbnFn* fn, QbnInstr instr) {
+    qbn_amd64_add_legal(fn, instr);
+}
+
+void qbn_amd64_block_end(QbnFn* fn) {
+    qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_BLOCK_END});
+}
+
 void qbn_add_push(QbnFn* fn, QbnRef reg, QbnType type) {
-    qbn_context_add_instr(fn->context, QBN_OP_PUSH, reg, QBN_REF0, QBN_REF0, type);
+    qbn_amd64_add_instr(fn, QBN_OP_PUSH, reg, QBN_REF0, QBN_REF0, type);
     qbn_add_stack(fn, QBN_TYPE_INFO[type].bytes);
 }
 
 void qbn_add_pop(QbnFn* fn, QbnRef reg, QbnType type) {
-    qbn_context_add_instr(fn->context, QBN_OP_POP, QBN_REF0, QBN_REF0, reg, type);
+    qbn_amd64_add_instr(fn, QBN_OP_POP, QBN_REF0, QBN_REF0, reg, type);
     qbn_add_stack(fn, -QBN_TYPE_INFO[type].bytes);
 }
 
-void qbn_amd64_sysv_save_caller_regs_move(QbnFn* fn) {
-    int end = MIN(QBN_REG_CALLER_SAVED_END, fn->rega_n_int_regs_used);
-    for (int i=QBN_REG_CALLER_SAVED_START; i<end; i++) {
-        qbn_add_push(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+int qbn_amd64_sse_saved_count(unsigned long saved) {
+    return __builtin_popcountl(saved & (QBN_REG_BIT(QBN_XMM15 + 1) - QBN_REG_BIT(QBN_XMM0)));
+}
+
+QbnRef qbn_amd64_stack_mem(QbnFn* fn, int disp) {
+    return qbn_fn_new_mem(fn, (QbnMem) {.base = QBN_REG_REF(QBN_RSP), .scale = 1, .disp = disp});
+}
+
+void qbn_amd64_sysv_save_caller_regs_move(QbnFn* fn, unsigned long saved) {
+    // saved: registers live across the call, see qbn_amd64_linear_scan
+    for (int i=QBN_REG_CALLER_SAVED_START; i<QBN_REG_CALLER_SAVED_END; i++) {
+        if (saved & QBN_REG_BIT(QBN_REG_INT[i])) {
+            qbn_add_push(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+        }
+    }
+    // there is no push for sse registers, they get stored below the pushed ones
+    int n_sse = qbn_amd64_sse_saved_count(saved);
+    if (n_sse) {
+        qbn_amd64_add_instr(fn, QBN_OP_SUB, qbn_context_new_const_number(fn->context, 8 * n_sse), QBN_REF0,
+                            QBN_REG_REF(QBN_RSP), fn->context->size_type);
+        qbn_add_stack(fn, 8 * n_sse);
+    }
+    int k = 0;
+    for (int i=0; i<QBN_REG_FLOAT_COUNT; i++) {
+        if (saved & QBN_REG_BIT(QBN_REG_FLOAT[i])) {
+            qbn_amd64_add_instr(fn, QBN_OP_COPY, QBN_REG_REF(QBN_REG_FLOAT[i]), QBN_REF0,
+                                qbn_amd64_stack_mem(fn, 8 * k++), QBN_BTYPE_F64);
+        }
     }
 }
 
-void qbn_amd64_sysv_restore_caller_regs_move(QbnFn* fn) {
-    int end = MIN(QBN_REG_CALLER_SAVED_END, fn->rega_n_int_regs_used);
-    for (int i=end-1; i>=QBN_REG_CALLER_SAVED_START; i--) {
-        qbn_add_pop(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+void qbn_amd64_sysv_restore_caller_regs_move(QbnFn* fn, unsigned long saved) {
+    int n_sse = qbn_amd64_sse_saved_count(saved);
+    int k = 0;
+    for (int i=0; i<QBN_REG_FLOAT_COUNT; i++) {
+        if (saved & QBN_REG_BIT(QBN_REG_FLOAT[i])) {
+            qbn_amd64_add_instr(fn, QBN_OP_COPY, qbn_amd64_stack_mem(fn, 8 * k++), QBN_REF0,
+                                QBN_REG_REF(QBN_REG_FLOAT[i]), QBN_BTYPE_F64);
+        }
+    }
+    if (n_sse) {
+        qbn_amd64_add_instr(fn, QBN_OP_ADD, qbn_context_new_const_number(fn->context, 8 * n_sse), QBN_REF0,
+                            QBN_REG_REF(QBN_RSP), fn->context->size_type);
+        qbn_add_stack(fn, -8 * n_sse);
+    }
+    for (int i=QBN_REG_CALLER_SAVED_END-1; i>=QBN_REG_CALLER_SAVED_START; i--) {
+        if (saved & QBN_REG_BIT(QBN_REG_INT[i])) {
+            qbn_add_pop(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+        }
     }
 }
 
 void qbn_amd64_sysv_save_callee_regs_move(QbnFn* fn) {
-    for (int i=QBN_REG_CALLEE_SAVED_START; i<fn->rega_n_int_regs_used; i++) {
-        qbn_add_push(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+    for (int i=QBN_REG_CALLEE_SAVED_START; i<QBN_REG_CALLEE_SAVED_END; i++) {
+        if (fn->rega_used & QBN_REG_BIT(QBN_REG_INT[i])) {
+            qbn_add_push(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+        }
     }
 }
 
 void qbn_amd64_sysv_restore_callee_regs_move(QbnFn* fn) {
-    for (int i=fn->rega_n_int_regs_used-1; i>=QBN_REG_CALLEE_SAVED_START; i--) {
-        qbn_add_pop(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+    if (fn->rega_dynamic_alloc) {
+        // rsp is where the last dynamic allocation left it, the registers were pushed right below the frame
+        int n_saved = 0;
+        for (int i=QBN_REG_CALLEE_SAVED_START; i<QBN_REG_CALLEE_SAVED_END; i++) {
+            n_saved += (fn->rega_used & QBN_REG_BIT(QBN_REG_INT[i])) != 0;
+        }
+        if (n_saved) {
+            QbnMem mem = {.base = QBN_REG_REF(QBN_RBP), .scale = 1, .disp = -(int) (fn->frame_size + 8 * n_saved)};
+            qbn_amd64_add_instr(fn, QBN_OP_ADDR, qbn_fn_new_mem(fn, mem), QBN_REF0, QBN_REG_REF(QBN_RSP),
+                                fn->context->size_type);
+        }
+    }
+    for (int i=QBN_REG_CALLEE_SAVED_END-1; i>=QBN_REG_CALLEE_SAVED_START; i--) {
+        if (fn->rega_used & QBN_REG_BIT(QBN_REG_INT[i])) {
+            qbn_add_pop(fn, QBN_REG_REF(QBN_REG_INT[i]), fn->context->size_type);
+        }
     }
 }
 
-void qbn_amd64_sysv_copy(QbnContext* context, QbnBlock* block, QbnInstr* copy) {
-    QbnConst* con;
-    switch (QBN_REF_TYPE(copy->arg0)) {
-        case QBN_REF_CONST:
-            con = &context->consts[QBN_REF_INDEX(copy->arg0)];
-            if (con->type == QBN_CONST_GLOBAL_ADDR) {
-                copy->op = QBN_OP_ADDR;
+QbnOp qbn_amd64_sysv_copy_op(QbnContext* context, QbnRef src) {
+    // addresses of data are taken with lea
+    if (qbn_amd64_is_global_addr(context, src)) {
+        return QBN_OP_ADDR;
+    }
+    return QBN_OP_COPY;
+}
+
+typedef struct {
+    QbnRef from;
+    QbnAmd64Register to;
+    QbnBaseType type;
+} QbnAmd64Move;
+
+void qbn_amd64_parallel_move(QbnFn* fn, QbnAmd64Move* moves, int n_moves) {
+    // the registers are written as if all moves happened at once: a move waits while another one still reads
+    // its destination, if every move waits they form cycles and one destination goes to the scratch register
+    while (n_moves) {
+        int ready = -1;
+        for (int i=0; i<n_moves && ready < 0; i++) {
+            ready = i;
+            for (int j=0; j<n_moves; j++) {
+                if (j != i && qbn_amd64_reads_reg(fn, moves[j].from, moves[i].to)) {
+                    ready = -1;
+                    break;
+                }
             }
-            break;
-        default:;
+        }
+        if (ready >= 0) {
+            QbnAmd64Move move = moves[ready];
+            moves[ready] = moves[--n_moves];
+            if (!qbn_amd64_reads_reg(fn, move.from, move.to)) {
+                qbn_amd64_add_instr(fn, qbn_amd64_sysv_copy_op(fn->context, move.from), move.from, QBN_REF0,
+                                    QBN_REG_REF(move.to), move.type);
+            }
+            continue;
+        }
+        // only registers are read in a cycle
+        QbnAmd64Register reg = moves[0].to;
+        bool is_float = reg >= QBN_XMM0;
+        QbnRef scratch = QBN_REG_REF(is_float ? QBN_REG_SCRATCH_FLOAT : QBN_REG_SCRATCH_INT);
+        qbn_amd64_add_instr(fn, QBN_OP_COPY, QBN_REG_REF(reg), QBN_REF0, scratch,
+                            is_float ? QBN_BTYPE_F64 : QBN_BTYPE_I64);
+        for (int j=0; j<n_moves; j++) {
+            if (qbn_amd64_reads_reg(fn, moves[j].from, reg)) {
+                moves[j].from = scratch;
+            }
+        }
     }
 }
 
-void qbn_amd64_sysv_call_move(QbnFn* fn, QbnBlock* block, QbnInstr* instr) {
-    qbn_amd64_sysv_save_caller_regs_move(fn);
+void qbn_amd64_sysv_call_move(QbnFn* fn, QbnInstr* instr, unsigned long saved) {
+    qbn_amd64_sysv_save_caller_regs_move(fn, saved);
 
+    // arguments may already be in argument registers, in any order
+    QbnAmd64Move moves[QBN_REG_ARG_FLOAT_COUNT + QBN_REG_ARG_INT_END - QBN_REG_ARG_INT_START];
+    int n_moves = 0;
     int n_int_args = 0;
     int n_float_args = 0;
-    QbnInstr* new_instr;
     while (instr->op == QBN_OP_ARG) {
         switch (instr->type) {
             case QBN_TYPE_F32:
             case QBN_TYPE_F64:
                 // TODO: support stack args
                 assert(n_float_args < QBN_REG_ARG_FLOAT_COUNT);
-                new_instr = fn->context->current_instr;
-                qbn_context_add_instr(fn->context, QBN_OP_COPY, instr->arg0, QBN_REF0, QBN_REG_REF(QBN_REG_FLOAT[n_float_args]), instr->type);
+                moves[n_moves++] = (QbnAmd64Move) {instr->arg0, QBN_REG_FLOAT[n_float_args], instr->type};
                 n_float_args++;
                 break;
             default:// TODO: support stack args
                 assert(n_int_args < QBN_REG_ARG_INT_END - QBN_REG_ARG_INT_START);
-                new_instr = fn->context->current_instr;
-                qbn_context_add_instr(fn->context, QBN_OP_COPY, instr->arg0, QBN_REF0, QBN_REG_REF(QBN_REG_INT[QBN_REG_ARG_INT_START + n_int_args]), instr->type);
+                moves[n_moves++] = (QbnAmd64Move) {instr->arg0, QBN_REG_INT[QBN_REG_ARG_INT_START + n_int_args],
+                                                   instr->type};
                 n_int_args++;
         }
-        qbn_amd64_sysv_copy(fn->context, block, new_instr);
-        instr++;
+        instr = qbn_instr_next(instr);
         if (instr->op != QBN_OP_ARG) {
             break;
         }
     }
+    qbn_amd64_parallel_move(fn, moves, n_moves);
     assert(instr->op == QBN_OP_CALL);
+    QbnInstr call = *instr;
+    call.to = QBN_REF0;
     if (fn->stack_alignment) {
         QbnRef stack_adjustment = qbn_context_new_const_number(fn->context, 16 - fn->stack_alignment);
-        qbn_context_add_instr(fn->context, QBN_OP_SUB, stack_adjustment, QBN_REF0, QBN_REG_REF(QBN_RSP), fn->context->size_type);
-        qbn_context_copy_instr(fn->context, *instr);
-        qbn_context_add_instr(fn->context, QBN_OP_ADD, stack_adjustment, QBN_REF0, QBN_REG_REF(QBN_RSP), fn->context->size_type);
+        qbn_amd64_add_instr(fn, QBN_OP_SUB, stack_adjustment, QBN_REF0, QBN_REG_REF(QBN_RSP), fn->context->size_type);
+        qbn_amd64_copy_instr(fn, call);
+        qbn_amd64_add_instr(fn, QBN_OP_ADD, stack_adjustment, QBN_REF0, QBN_REG_REF(QBN_RSP), fn->context->size_type);
+    } else {
+        qbn_amd64_copy_instr(fn, call);
+    }
+    if (instr->to != QBN_REF0) {
+        // the result is not live across the call, so no saved register holds it
+        QbnAmd64Register reg = QBN_TYPE_INFO[instr->type].is_int ? QBN_RAX : QBN_XMM0;
+        qbn_amd64_add_instr(fn, QBN_OP_COPY, QBN_REG_REF(reg), QBN_REF0, instr->to, instr->type);
+    }
+
+    qbn_amd64_sysv_restore_caller_regs_move(fn, saved);
+}
+
+void qbn_amd64_sysv_return_move(QbnFn* fn, QbnBlock* block) {
+    // the value may live in a callee saved register, it is copied before they are restored
+    QbnRef value = block->jmp.ret.value;
+    QbnAmd64Register reg;
+    switch (block->jmp_type) {
+        case QBN_JUMP_RET_BASE:
+            if (QBN_REF_TYPE(value) != QBN_REF_CONST && QBN_REF_TYPE(value) != QBN_REF_TEMP) {
+                QBN_NOT_IMPLEMENTED
+            }
+            reg = QBN_TYPE_INFO[block->jmp.ret.type].is_int ? QBN_RAX : QBN_XMM0;
+            qbn_amd64_add_instr(fn, qbn_amd64_sysv_copy_op(fn->context, value), value, QBN_REF0, QBN_REG_REF(reg),
+                                block->jmp.ret.type);
+            break;
+        case QBN_JUMP_RET_NONE:
+            break;
+        default:
+            QBN_NOT_IMPLEMENTED
+    }
+    qbn_amd64_sysv_restore_callee_regs_move(fn);
+}
+
+typedef struct {
+    QbnOp flag;
+    QbnType type;  // type of the compared values
+} QbnAmd64Comparison;
+
+const QbnAmd64Comparison QBN_AMD64_CMP2FLAG[] = {
+        [QBN_OP_CEQW]  = {QBN_OP_FLAGIEQ, QBN_TYPE_I32},
+        [QBN_OP_CNEW]  = {QBN_OP_FLAGINE, QBN_TYPE_I32},
+        [QBN_OP_CSGEW] = {QBN_OP_FLAGISGE, QBN_TYPE_I32},
+        [QBN_OP_CSGTW] = {QBN_OP_FLAGISGT, QBN_TYPE_I32},
+        [QBN_OP_CSLEW] = {QBN_OP_FLAGISLE, QBN_TYPE_I32},
+        [QBN_OP_CSLTW] = {QBN_OP_FLAGISLT, QBN_TYPE_I32},
+        [QBN_OP_CUGEW] = {QBN_OP_FLAGIUGE, QBN_TYPE_I32},
+        [QBN_OP_CUGTW] = {QBN_OP_FLAGIUGT, QBN_TYPE_I32},
+        [QBN_OP_CULEW] = {QBN_OP_FLAGIULE, QBN_TYPE_I32},
+        [QBN_OP_CULTW] = {QBN_OP_FLAGIULT, QBN_TYPE_I32},
+        [QBN_OP_CEQL]  = {QBN_OP_FLAGIEQ, QBN_TYPE_I64},
+        [QBN_OP_CNEL]  = {QBN_OP_FLAGINE, QBN_TYPE_I64},
+        [QBN_OP_CSGEL] = {QBN_OP_FLAGISGE, QBN_TYPE_I64},
+        [QBN_OP_CSGTL] = {QBN_OP_FLAGISGT, QBN_TYPE_I64},
+        [QBN_OP_CSLEL] = {QBN_OP_FLAGISLE, QBN_TYPE_I64},
+        [QBN_OP_CSLTL] = {QBN_OP_FLAGISLT, QBN_TYPE_I64},
+        [QBN_OP_CUGEL] = {QBN_OP_FLAGIUGE, QBN_TYPE_I64},
+        [QBN_OP_CUGTL] = {QBN_OP_FLAGIUGT, QBN_TYPE_I64},
+        [QBN_OP_CULEL] = {QBN_OP_FLAGIULE, QBN_TYPE_I64},
+        [QBN_OP_CULTL] = {QBN_OP_FLAGIULT, QBN_TYPE_I64},
+        [QBN_OP_CEQS]  = {QBN_OP_FLAGFEQ, QBN_TYPE_F32},
+        [QBN_OP_CGES]  = {QBN_OP_FLAGFGE, QBN_TYPE_F32},
+        [QBN_OP_CGTS]  = {QBN_OP_FLAGFGT, QBN_TYPE_F32},
+        [QBN_OP_CLES]  = {QBN_OP_FLAGFLE, QBN_TYPE_F32},
+        [QBN_OP_CLTS]  = {QBN_OP_FLAGFLT, QBN_TYPE_F32},
+        [QBN_OP_CNES]  = {QBN_OP_FLAGFNE, QBN_TYPE_F32},
+        [QBN_OP_COS]   = {QBN_OP_FLAGFO, QBN_TYPE_F32},
+        [QBN_OP_CUOS]  = {QBN_OP_FLAGFUO, QBN_TYPE_F32},
+        [QBN_OP_CEQD]  = {QBN_OP_FLAGFEQ, QBN_TYPE_F64},
+        [QBN_OP_CGED]  = {QBN_OP_FLAGFGE, QBN_TYPE_F64},
+        [QBN_OP_CGTD]  = {QBN_OP_FLAGFGT, QBN_TYPE_F64},
+        [QBN_OP_CLED]  = {QBN_OP_FLAGFLE, QBN_TYPE_F64},
+        [QBN_OP_CLTD]  = {QBN_OP_FLAGFLT, QBN_TYPE_F64},
+        [QBN_OP_CNED]  = {QBN_OP_FLAGFNE, QBN_TYPE_F64},
+        [QBN_OP_COD]   = {QBN_OP_FLAGFO, QBN_TYPE_F64},
+        [QBN_OP_CUOD]  = {QBN_OP_FLAGFUO, QBN_TYPE_F64},
+};
+
+// flag to test when the compared operands are swapped
+const QbnOp QBN_AMD64_FLAG_SWAPPED[] = {
+        [QBN_OP_FLAGIEQ]  = QBN_OP_FLAGIEQ,
+        [QBN_OP_FLAGINE]  = QBN_OP_FLAGINE,
+        [QBN_OP_FLAGISGE] = QBN_OP_FLAGISLE,
+        [QBN_OP_FLAGISGT] = QBN_OP_FLAGISLT,
+        [QBN_OP_FLAGISLE] = QBN_OP_FLAGISGE,
+        [QBN_OP_FLAGISLT] = QBN_OP_FLAGISGT,
+        [QBN_OP_FLAGIUGE] = QBN_OP_FLAGIULE,
+        [QBN_OP_FLAGIUGT] = QBN_OP_FLAGIULT,
+        [QBN_OP_FLAGIULE] = QBN_OP_FLAGIUGE,
+        [QBN_OP_FLAGIULT] = QBN_OP_FLAGIUGT,
+        [QBN_OP_FLAGFEQ]  = QBN_OP_FLAGFEQ,
+        [QBN_OP_FLAGFGE]  = QBN_OP_FLAGFLE,
+        [QBN_OP_FLAGFGT]  = QBN_OP_FLAGFLT,
+        [QBN_OP_FLAGFLE]  = QBN_OP_FLAGFGE,
+        [QBN_OP_FLAGFLT]  = QBN_OP_FLAGFGT,
+        [QBN_OP_FLAGFNE]  = QBN_OP_FLAGFNE,
+        [QBN_OP_FLAGFO]   = QBN_OP_FLAGFO,
+        [QBN_OP_FLAGFUO]  = QBN_OP_FLAGFUO,
+};
+
+bool qbn_amd64_same_location(QbnFn* fn, QbnRef a, QbnRef b) {
+    // compares refs after register allocation
+    if (QBN_REF_TYPE(a) == QBN_REF_TEMP) {
+        a = fn->temps[QBN_REF_INDEX(a)].slot;
+    }
+    if (QBN_REF_TYPE(b) == QBN_REF_TEMP) {
+        b = fn->temps[QBN_REF_INDEX(b)].slot;
+    }
+    return a == b;
+}
+
+void qbn_amd64_sysv_arith(QbnFn* fn, QbnInstr* instr) {
+    // to = op arg0, arg1  ->  to = copy arg0; to = op arg1, to
+    bool commutative = instr->op == QBN_OP_ADD || instr->op == QBN_OP_MUL || instr->op == QBN_OP_AND
+                       || instr->op == QBN_OP_OR || instr->op == QBN_OP_XOR;
+    QbnRef arg0 = instr->arg0;
+    QbnRef arg1 = instr->arg1;
+    if (instr->op == QBN_OP_DIV && QBN_TYPE_INFO[instr->type].is_int) {
+        // TODO: idiv needs rax and rdx
+        QBN_NOT_IMPLEMENTED
+    }
+    if (instr->op == QBN_OP_REM || instr->op == QBN_OP_UDIV || instr->op == QBN_OP_UREM) {
+        QBN_NOT_IMPLEMENTED
+    }
+    if ((instr->op == QBN_OP_SAR || instr->op == QBN_OP_SHR || instr->op == QBN_OP_SHL)
+        && QBN_REF_TYPE(arg1) != QBN_REF_CONST) {
+        // TODO: shift count has to be in %cl
+        QBN_NOT_IMPLEMENTED
+    }
+    if (QBN_REF_TYPE(arg1) == QBN_REF_MEM && QBN_TYPE_INFO[instr->type].is_int && qbn_amd64_is_slot(fn, instr->to)) {
+        // memory to memory: the folded load goes to the destination first
+        qbn_amd64_add_instr(fn, QBN_OP_COPY, arg1, QBN_REF0, instr->to, instr->type);
+        arg1 = instr->to;
+    }
+    if (qbn_amd64_same_location(fn, instr->to, arg1) && !qbn_amd64_same_location(fn, instr->to, arg0)) {
+        if (commutative) {
+            arg1 = arg0;
+        } else if (instr->op == QBN_OP_SUB && QBN_TYPE_INFO[instr->type].is_int) {
+            // to = arg0 - to  ->  to = -to; to = to + arg0
+            qbn_amd64_add_instr(fn, QBN_OP_NEG, QBN_REF0, QBN_REF0, instr->to, instr->type);
+            qbn_amd64_add_instr(fn, QBN_OP_ADD, arg0, QBN_REF0, instr->to, instr->type);
+            return;
+        } else {
+            // TODO: needs a scratch register
+            QBN_NOT_IMPLEMENTED
+        }
+    } else if (!qbn_amd64_same_location(fn, instr->to, arg0)) {
+        qbn_amd64_add_instr(fn, QBN_OP_COPY, arg0, QBN_REF0, instr->to, instr->type);
+    }
+    qbn_amd64_add_instr(fn, instr->op, arg1, QBN_REF0, instr->to, instr->type);
+}
+
+QbnAmd64Comparison qbn_amd64_compare_operands(QbnInstr* instr, QbnRef* arg0, QbnRef* arg1) {
+    // operands for xcmp arg0, arg1 and the flag to test afterwards
+    QbnAmd64Comparison cmp = QBN_AMD64_CMP2FLAG[instr->op];
+    *arg0 = instr->arg0;
+    *arg1 = instr->arg1;
+    bool swap;
+    if (QBN_TYPE_INFO[cmp.type].is_int) {
+        // an immediate can only be the second operand
+        swap = QBN_REF_TYPE(instr->arg0) == QBN_REF_CONST && QBN_REF_TYPE(instr->arg1) != QBN_REF_CONST;
+    } else {
+        // only above/above-equal are false for unordered operands
+        swap = cmp.flag == QBN_OP_FLAGFLT || cmp.flag == QBN_OP_FLAGFLE;
+    }
+    if (swap) {
+        *arg0 = instr->arg1;
+        *arg1 = instr->arg0;
+        cmp.flag = QBN_AMD64_FLAG_SWAPPED[cmp.flag];
+    }
+    return cmp;
+}
+
+void qbn_amd64_sysv_compare(QbnFn* fn, QbnInstr* instr) {
+    // to = cmp arg0, arg1  ->  xcmp arg0, arg1; to = flag; to = extub to
+    // a compare without result only sets the flags for the block's jump, see qbn_amd64_fuse_branches
+    QbnRef arg0;
+    QbnRef arg1;
+    QbnAmd64Comparison cmp = qbn_amd64_compare_operands(instr, &arg0, &arg1);
+    if (QBN_TYPE_INFO[cmp.type].is_int) {
+        if (QBN_REF_TYPE(arg0) == QBN_REF_CONST) {
+            // both are constants
+            assert(instr->to != QBN_REF0);
+            qbn_amd64_add_instr(fn, QBN_OP_COPY, arg0, QBN_REF0, instr->to, cmp.type);
+            arg0 = instr->to;
+        }
+    } else if (cmp.flag == QBN_OP_FLAGFEQ || cmp.flag == QBN_OP_FLAGFNE) {
+        // TODO: needs a second setcc for the parity flag
+        QBN_NOT_IMPLEMENTED
+    }
+    qbn_amd64_add_instr(fn, QBN_OP_XCMP, arg0, arg1, QBN_REF0, cmp.type);
+    if (instr->to != QBN_REF0) {
+        qbn_amd64_add_instr(fn, cmp.flag, QBN_REF0, QBN_REF0, instr->to, instr->type);
+        qbn_amd64_add_instr(fn, QBN_OP_EXTUB, instr->to, QBN_REF0, instr->to, instr->type);
+    }
+}
+
+// jump taken when the flag is set
+const QbnJumpType QBN_AMD64_FLAG2JUMP[] = {
+        [QBN_OP_FLAGIEQ]  = QBN_JUMP_FI_EQ,
+        [QBN_OP_FLAGINE]  = QBN_JUMP_FI_NE,
+        [QBN_OP_FLAGISGE] = QBN_JUMP_IS_GE,
+        [QBN_OP_FLAGISGT] = QBN_JUMP_IS_GT,
+        [QBN_OP_FLAGISLE] = QBN_JUMP_IS_LE,
+        [QBN_OP_FLAGISLT] = QBN_JUMP_IS_LT,
+        [QBN_OP_FLAGIUGE] = QBN_JUMP_IU_GE,
+        [QBN_OP_FLAGIUGT] = QBN_JUMP_IU_GT,
+        [QBN_OP_FLAGIULE] = QBN_JUMP_IU_LE,
+        [QBN_OP_FLAGIULT] = QBN_JUMP_IU_LT,
+        [QBN_OP_FLAGFEQ]  = QBN_JUMP_FF_EQ,
+        [QBN_OP_FLAGFGE]  = QBN_JUMP_FF_GE,
+        [QBN_OP_FLAGFGT]  = QBN_JUMP_FF_GT,
+        [QBN_OP_FLAGFLE]  = QBN_JUMP_FF_LE,
+        [QBN_OP_FLAGFLT]  = QBN_JUMP_FF_LT,
+        [QBN_OP_FLAGFNE]  = QBN_JUMP_FF_NE,
+        [QBN_OP_FLAGFO]   = QBN_JUMP_FF_O,
+        [QBN_OP_FLAGFUO]  = QBN_JUMP_FF_UO,
+};
+
+void qbn_amd64_count_uses(QbnFn* fn, unsigned int* n_uses) {
+    for (int i=0; i<fn->vec_blocks->length; i++) {
+        QbnBlock* block = fn->blocks[i];
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op == QBN_OP0) {
+                continue;
+            }
+            QbnRef uses[QBN_INSTR_MAX_USES];
+            int count = qbn_instr_uses(fn, instr, uses);
+            for (int u=0; u<count; u++) {
+                if (QBN_REF_TYPE(uses[u]) == QBN_REF_TEMP) {
+                    n_uses[QBN_REF_INDEX(uses[u])]++;
+                }
+            }
+        }
+        for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+            for (int a=0; a<phi->n_args; a++) {
+                if (QBN_REF_TYPE(phi->args[a]) == QBN_REF_TEMP) {
+                    n_uses[QBN_REF_INDEX(phi->args[a])]++;
+                }
+            }
+        }
+        QbnRef ref = QBN_REF0;
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            ref = block->jmp.ret.value;
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            ref = block->jmp.dest.cond;
+        }
+        if (QBN_REF_TYPE(ref) == QBN_REF_TEMP) {
+            n_uses[QBN_REF_INDEX(ref)]++;
+        }
+    }
+}
+
+void qbn_amd64_fuse_branches(QbnFn* fn) {
+    // jnz on the result of a compare at the end of its block jumps on the flags of the compare,
+    // the result itself is only kept if something else reads it. jnz on a constant always goes one way.
+    unsigned int* n_uses = calloc(fn->vec_temps->length + 1, sizeof(unsigned int));
+    if (!n_uses) {
+        util_vector_no_memory();
+    }
+    qbn_amd64_count_uses(fn, n_uses);
+    for (int i=0; i<fn->vec_blocks->length; i++) {
+        QbnBlock* block = fn->blocks[i];
+        if (block->jmp_type != QBN_JUMP_NZ) {
+            continue;
+        }
+        QbnRef cond = block->jmp.dest.cond;
+        if (QBN_REF_TYPE(cond) == QBN_REF_CONST) {
+            QbnConst* con = QBN_CONST(fn->context, QBN_REF_INDEX(cond));
+            if (con->type == QBN_CONST_NUMBER && con->value.number == 0) {
+                block->jmp.dest.True = block->jmp.dest.False;
+            }
+            qbn_fn_invalidate_cfg(fn);
+            block->jmp_type = QBN_JUMP_UNCONDITIONAL;
+            continue;
+        }
+
+        // copies may follow the compare, they don't touch the flags
+        QbnInstr* compare = NULL;
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op == QBN_OP0) {
+                continue;
+            }
+            if (instr->op != QBN_OP_COPY || instr->to == cond) {
+                compare = instr;
+            }
+        }
+        if (compare == NULL || compare->to != cond || compare->op < QBN_OP_CEQW || compare->op > QBN_OP_CUOD) {
+            continue;
+        }
+        QbnRef arg0;
+        QbnRef arg1;
+        QbnAmd64Comparison cmp = qbn_amd64_compare_operands(compare, &arg0, &arg1);
+        if (QBN_REF_TYPE(arg0) == QBN_REF_CONST || cmp.flag == QBN_OP_FLAGFEQ || cmp.flag == QBN_OP_FLAGFNE) {
+            // TODO: float equality needs a second jump for the parity flag
+            continue;
+        }
+        block->jmp_type = QBN_AMD64_FLAG2JUMP[cmp.flag];
+        if (n_uses[QBN_REF_INDEX(cond)] == 1) {
+            compare->to = QBN_REF0;
+        }
+    }
+    free(n_uses);
+}
+
+// Addressing modes. x86 reads memory at base + index*scale + disp, so adds, shifts and multiplications by
+// 2, 4 or 8 that compute an address in the same block become the memory operand of the loads and stores
+// using it, and long adds become lea. A load with a single use later in its block is read by that use
+// directly if it is arithmetic and nothing that may write memory comes in between. On ssa form a temp has
+// the same value everywhere, so the parts of an address can be read at the instruction using it. What is
+// left unused is removed by qbn_eliminate_dead_code.
+
+#define QBN_AMD64_ADDRESS_DEPTH 4
+
+typedef struct {
+    QbnFn* fn;
+    unsigned int block;       // current block + 1
+    unsigned int* def_block;  // block + 1 of a temp's definition, 0 if not seen yet
+    QbnInstr** def_instr;
+    int* def_pos;             // position of the definition in its block
+    unsigned int* n_uses;
+} QbnAmd64AddressFold;
+
+QbnInstr* qbn_amd64_local_def(QbnAmd64AddressFold* fold, QbnRef ref) {
+    if (QBN_REF_TYPE(ref) != QBN_REF_TEMP || fold->def_block[QBN_REF_INDEX(ref)] != fold->block) {
+        return NULL;
+    }
+    return fold->def_instr[QBN_REF_INDEX(ref)];
+}
+
+bool qbn_amd64_address_term(QbnAmd64AddressFold* fold, QbnRef ref, int scale, int depth, QbnMem* mem) {
+    // adds ref*scale to mem, returns false if it doesn't fit
+    QbnFn* fn = fold->fn;
+    if (QBN_REF_TYPE(ref) == QBN_REF_CONST) {
+        QbnConst* con = QBN_CONST(fn->context, QBN_REF_INDEX(ref));
+        if (con->type == QBN_CONST_NUMBER) {
+            long disp = mem->disp + con->value.number * scale;
+            if (con->value.number != (int) con->value.number || disp != (int) disp) {
+                return false;
+            }
+            mem->disp = (int) disp;
+            return true;
+        }
+        // rip relative, without index
+        if (con->type == QBN_CONST_GLOBAL_ADDR && scale == 1 && mem->base == QBN_REF0 && mem->index == QBN_REF0) {
+            mem->base = ref;
+            return true;
+        }
+        return false;
+    }
+    if (QBN_REF_TYPE(ref) != QBN_REF_TEMP || fn->temps[QBN_REF_INDEX(ref)].type != QBN_ETYPE_I64) {
+        return false;
+    }
+
+    QbnInstr* def = qbn_amd64_local_def(fold, ref);
+    if (def != NULL && def->type == QBN_BTYPE_I64 && depth > 0) {
+        QbnMem folded = *mem;
+        long factor = 0;
+        QbnRef factored = def->arg0;
+        bool ok = false;
+        switch (def->op) {
+            case QBN_OP_ADD:
+                ok = qbn_amd64_address_term(fold, def->arg0, scale, depth - 1, &folded) &&
+                     qbn_amd64_address_term(fold, def->arg1, scale, depth - 1, &folded);
+                break;
+            case QBN_OP_SHL:
+                if (qbn_fold_number(fn, def->arg1, &factor) && factor >= 1 && factor <= 3) {
+                    factor = 1L << factor;
+                } else {
+                    factor = 0;
+                }
+                break;
+            case QBN_OP_MUL:
+                if (!qbn_fold_number(fn, def->arg1, &factor)) {
+                    qbn_fold_number(fn, def->arg0, &factor);
+                    factored = def->arg1;
+                }
+                break;
+            case QBN_OP_ADDR:
+                if (QBN_REF_TYPE(def->arg0) == QBN_REF_MEM) {
+                    QbnMem inner = fn->mems[QBN_REF_INDEX(def->arg0)];
+                    long disp = folded.disp + (long) inner.disp * scale;
+                    folded.disp = (int) disp;
+                    ok = disp == (int) disp && qbn_amd64_address_term(fold, inner.base, scale, depth - 1, &folded) &&
+                         (inner.index == QBN_REF0 ||
+                          qbn_amd64_address_term(fold, inner.index, scale * inner.scale, depth - 1, &folded));
+                }
+                break;
+            default:;
+        }
+        if ((factor == 2 || factor == 4 || factor == 8) && scale * factor <= 8) {
+            ok = qbn_amd64_address_term(fold, factored, (int) (scale * factor), depth - 1, &folded);
+        }
+        if (ok) {
+            *mem = folded;
+            return true;
+        }
+    }
+
+    // the temp itself
+    if (scale == 1 && mem->base == QBN_REF0) {
+        mem->base = ref;
+        return true;
+    }
+    if (mem->index == QBN_REF0 && !qbn_amd64_is_global_addr(fn->context, mem->base)) {
+        mem->index = ref;
+        mem->scale = scale;
+        return true;
+    }
+    return false;
+}
+
+bool qbn_amd64_match_address(QbnAmd64AddressFold* fold, QbnRef arg0, QbnRef arg1, QbnMem* mem) {
+    // mem = arg0 + arg1, arg1 may be QBN_REF0
+    *mem = (QbnMem) {.base = QBN_REF0, .index = QBN_REF0, .scale = 1, .disp = 0};
+    if (!qbn_amd64_address_term(fold, arg0, 1, QBN_AMD64_ADDRESS_DEPTH, mem) ||
+        (arg1 != QBN_REF0 && !qbn_amd64_address_term(fold, arg1, 1, QBN_AMD64_ADDRESS_DEPTH, mem))) {
+        return false;
+    }
+    if (mem->base == QBN_REF0 && mem->scale == 1) {
+        mem->base = mem->index;
+        mem->index = QBN_REF0;
+    }
+    return mem->base != QBN_REF0;
+}
+
+bool qbn_amd64_load_fits(QbnInstr* load, QbnBaseType type) {
+    // whether the loaded value is the operand as it is in memory
+    switch (load->op) {
+        case QBN_OP_LOAD:
+            return load->type == type;
+        case QBN_OP_LOADSW:
+        case QBN_OP_LOADUW:
+            return load->type == QBN_BTYPE_I32 && type == QBN_BTYPE_I32;
+        default:
+            return false;
+    }
+}
+
+void qbn_amd64_fold_load(QbnAmd64AddressFold* fold, QbnInstr* instr, int last_effect) {
+    // the memory operand of an arithmetic instruction is its second one, the first one is copied
+    // into the destination, see qbn_amd64_sysv_arith
+    bool is_int = QBN_TYPE_INFO[instr->type].is_int;
+    bool commutative;
+    switch (instr->op) {
+        case QBN_OP_ADD:
+        case QBN_OP_MUL:
+            commutative = true;
+            break;
+        case QBN_OP_AND:
+        case QBN_OP_OR:
+        case QBN_OP_XOR:
+            if (!is_int) {
+                return;
+            }
+            commutative = true;
+            break;
+        case QBN_OP_SUB:
+            commutative = false;
+            break;
+        case QBN_OP_DIV:
+            // TODO: integer division is not lowered
+            if (is_int) {
+                return;
+            }
+            commutative = false;
+            break;
+        default:
+            return;
+    }
+    for (int a=1; a>=(commutative ? 0 : 1); a--) {
+        QbnRef ref = a ? instr->arg1 : instr->arg0;
+        QbnInstr* load = qbn_amd64_local_def(fold, ref);
+        if (load == NULL || load->op < QBN_OP_LOADSB || load->op > QBN_OP_LOAD ||
+            QBN_REF_TYPE(load->arg0) != QBN_REF_MEM || !qbn_amd64_load_fits(load, instr->type) ||
+            fold->n_uses[QBN_REF_INDEX(ref)] != 1 || fold->def_pos[QBN_REF_INDEX(ref)] < last_effect) {
+            continue;
+        }
+        if (!a) {
+            instr->arg0 = instr->arg1;
+        }
+        instr->arg1 = load->arg0;
+        load->op = QBN_OP0;
+        return;
+    }
+}
+
+void qbn_amd64_fold_addresses(QbnFn* fn) {
+    // expects every temp to be defined once, see qbn_ssa_construct
+    size_t n_temps = fn->vec_temps->length;
+    QbnAmd64AddressFold fold = {.fn = fn};
+    fold.def_block = calloc(n_temps + 1, sizeof(unsigned int));
+    fold.def_instr = malloc(sizeof(QbnInstr*) * (n_temps + 1));
+    fold.def_pos = malloc(sizeof(int) * (n_temps + 1));
+    fold.n_uses = calloc(n_temps + 1, sizeof(unsigned int));
+    if (!fold.def_block || !fold.def_instr || !fold.def_pos || !fold.n_uses) {
+        util_vector_no_memory();
+    }
+    qbn_amd64_count_uses(fn, fold.n_uses);
+
+    QbnMem mem;
+    for (int i=0; i<fn->vec_blocks->length; i++) {
+        fold.block = i + 1;
+        int pos = 0;
+        int last_effect = -1;  // position of the last instruction that may write memory
+        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op == QBN_OP0) {
+                continue;
+            }
+            if (instr->op >= QBN_OP_LOADSB && instr->op <= QBN_OP_LOAD) {
+                if (qbn_amd64_match_address(&fold, instr->arg0, QBN_REF0, &mem)) {
+                    instr->arg0 = qbn_fn_new_mem(fn, mem);
+                }
+            } else if (instr->op >= QBN_OP_STOREB && instr->op <= QBN_OP_STORED) {
+                if (qbn_amd64_match_address(&fold, instr->arg1, QBN_REF0, &mem)) {
+                    instr->arg1 = qbn_fn_new_mem(fn, mem);
+                }
+            } else if (instr->op == QBN_OP_ADD && instr->type == QBN_BTYPE_I64 &&
+                       qbn_amd64_match_address(&fold, instr->arg0, instr->arg1, &mem)) {
+                instr->op = QBN_OP_ADDR;
+                instr->arg0 = qbn_fn_new_mem(fn, mem);
+                instr->arg1 = QBN_REF0;
+            } else {
+                qbn_amd64_fold_load(&fold, instr, last_effect);
+            }
+            if (!qbn_op_is_pure(instr->op)) {
+                last_effect = pos;
+            }
+            if (QBN_REF_TYPE(instr->to) == QBN_REF_TEMP) {
+                unsigned int temp = QBN_REF_INDEX(instr->to);
+                fold.def_block[temp] = fold.block;
+                fold.def_instr[temp] = instr;
+                fold.def_pos[temp] = pos;
+            }
+            pos++;
+        }
+    }
+    free(fold.n_uses);
+    free(fold.def_pos);
+    free(fold.def_instr);
+    free(fold.def_block);
+}
+
+QbnRef qbn_amd64_address(QbnFn* fn, QbnRef address) {
+    // memory operand of a load or store that qbn_amd64_fold_addresses did not get to
+    if (QBN_REF_TYPE(address) == QBN_REF_MEM) {
+        return address;
+    }
+    return qbn_fn_new_mem(fn, (QbnMem) {.base = address, .index = QBN_REF0, .scale = 1, .disp = 0});
+}
+
+void qbn_amd64_sysv_load(QbnFn* fn, QbnInstr* instr) {
+    // to = copy mem, narrower values are extended
+    QbnOp op;
+    QbnBaseType type = instr->type;
+    switch (instr->op) {
+        case QBN_OP_LOADSB: op = QBN_OP_EXTSB; break;
+        case QBN_OP_LOADUB: op = QBN_OP_EXTUB; break;
+        case QBN_OP_LOADSH: op = QBN_OP_EXTSH; break;
+        case QBN_OP_LOADUH: op = QBN_OP_EXTUH; break;
+        case QBN_OP_LOADSW: op = type == QBN_BTYPE_I64 ? QBN_OP_EXTSW : QBN_OP_COPY; break;
+        case QBN_OP_LOADUW: op = type == QBN_BTYPE_I64 ? QBN_OP_EXTUW : QBN_OP_COPY; break;
+        default: op = QBN_OP_COPY;
+    }
+    qbn_amd64_add_instr(fn, op, qbn_amd64_address(fn, instr->arg0), QBN_REF0, instr->to, type);
+}
+
+// memory type of a store
+const QbnType QBN_AMD64_STORE2TYPE[] = {
+        [QBN_OP_STOREB - QBN_OP_STOREB] = QBN_TYPE_I8,
+        [QBN_OP_STOREH - QBN_OP_STOREB] = QBN_TYPE_I16,
+        [QBN_OP_STOREW - QBN_OP_STOREB] = QBN_TYPE_I32,
+        [QBN_OP_STOREL - QBN_OP_STOREB] = QBN_TYPE_I64,
+        [QBN_OP_STORES - QBN_OP_STOREB] = QBN_TYPE_F32,
+        [QBN_OP_STORED - QBN_OP_STOREB] = QBN_TYPE_F64,
+};
+
+void qbn_amd64_sysv_store(QbnFn* fn, QbnInstr* instr) {
+    // mem = copy value, with the type of the stored value
+    QbnType type = QBN_AMD64_STORE2TYPE[instr->op - QBN_OP_STOREB];
+    QbnRef mem = qbn_amd64_address(fn, instr->arg1);
+    QbnRef value = instr->arg0;
+    long number;
+    if (QBN_REF_TYPE(value) == QBN_REF_CONST && !qbn_amd64_is_global_addr(fn->context, value)) {
+        // constants are stored by their bits, floats included
+        QbnConst* con = QBN_CONST(fn->context, QBN_REF_INDEX(value));
+        if (con->type == QBN_CONST_F32) {
+            value = qbn_context_new_const_number(fn->context, (int) con->value.number);
+        } else if (con->type == QBN_CONST_F64) {
+            value = qbn_context_new_const_number(fn->context, con->value.number);
+        }
+        type = QBN_TYPE_INFO[type].bytes == 8 ? QBN_TYPE_I64 : (type == QBN_TYPE_F32 ? QBN_TYPE_I32 : type);
+        if (qbn_fold_number(fn, value, &number) && QBN_TYPE_INFO[type].bytes < 4) {
+            value = qbn_context_new_const_number(fn->context, type == QBN_TYPE_I8 ? (signed char) number : (short) number);
+        }
+    }
+    bool is_global = qbn_amd64_is_global_addr(fn->context, value);
+    bool needs_reg = is_global || qbn_amd64_is_wide_const(fn, value) ||
+                     (QBN_TYPE_INFO[type].is_int && qbn_amd64_is_slot(fn, value));
+    if (!needs_reg || (!is_global && !qbn_amd64_mem_needs_scratch(fn, mem))) {
+        qbn_amd64_add_instr(fn, QBN_OP_COPY, value, QBN_REF0, mem, (QbnBaseType) type);
+        return;
+    }
+    // the value can't take the scratch register if the address needs it
+    bool borrow = qbn_amd64_mem_needs_scratch(fn, mem);
+    QbnInstr copy = {.op = QBN_OP_COPY, .arg0 = value, .to = mem};
+    QbnRef reg = borrow ? qbn_amd64_borrow_reg(fn, &copy) : QBN_REG_REF(QBN_REG_SCRATCH_INT);
+    if (borrow) {
+        qbn_add_push(fn, reg, fn->context->size_type);
+    }
+    qbn_amd64_add_instr(fn, qbn_amd64_sysv_copy_op(fn->context, value), value, QBN_REF0, reg, QBN_BTYPE_I64);
+    qbn_amd64_add_instr(fn, QBN_OP_COPY, reg, QBN_REF0, mem, (QbnBaseType) type);
+    if (borrow) {
+        qbn_add_pop(fn, reg, fn->context->size_type);
+    }
+}
+
+void qbn_amd64_sysv_alloc(QbnFn* fn, QbnInstr* instr) {
+    // ALLOC of a size known only at runtime: rsp moves down by the size rounded up to 16 bytes, which keeps
+    // the stack alignment, and by 16 more while rsp is misaligned so the address can be rounded up
+    QbnRef scratch = QBN_REG_REF(QBN_REG_SCRATCH_INT);
+    QbnRef rsp = QBN_REG_REF(QBN_RSP);
+    QbnBaseType type = fn->context->size_type;
+    int padding = fn->stack_alignment ? 16 : 0;
+    qbn_amd64_add_instr(fn, QBN_OP_COPY, instr->arg0, QBN_REF0, scratch, type);
+    qbn_amd64_add_instr(fn, QBN_OP_ADD, qbn_context_new_const_number(fn->context, 15 + padding), QBN_REF0, scratch,
+                        type);
+    qbn_amd64_add_instr(fn, QBN_OP_AND, qbn_context_new_const_number(fn->context, -16), QBN_REF0, scratch, type);
+    qbn_amd64_add_instr(fn, QBN_OP_SUB, scratch, QBN_REF0, rsp, type);
+    if (padding) {
+        QbnMem mem = {.base = rsp, .scale = 1, .disp = 16 - fn->stack_alignment};
+        qbn_amd64_add_instr(fn, QBN_OP_ADDR, qbn_fn_new_mem(fn, mem), QBN_REF0, instr->to, type);
+    } else {
+        qbn_amd64_add_instr(fn, QBN_OP_COPY, rsp, QBN_REF0, instr->to, type);
+    }
+}
+
+void qbn_amd64_sysv_block(QbnFn* fn, QbnBlock* block, int* n_calls) {
+    QbnInstr* instr_old = block->instr;
+    while (instr_old->op != QBN_OP_BLOCK_END) {
+        switch (instr_old->op) {
+            case QBN_OP0:
+                // removed by an earlier pass
+                break;
+            case QBN_OP_ARG:
+            case QBN_OP_CALL:
+                qbn_amd64_sysv_call_move(fn, instr_old, fn->rega_call_saved[(*n_calls)++]);
+                while (instr_old->op == QBN_OP_ARG) {
+                    instr_old = qbn_instr_next(instr_old);
+                }
+                break;
+            case QBN_OP_COPY:
+                qbn_amd64_add_instr(fn, qbn_amd64_sysv_copy_op(fn->context, instr_old->arg0), instr_old->arg0,
+                                    QBN_REF0, instr_old->to, instr_old->type);
+                break;
+            case QBN_OP_ADD:
+            case QBN_OP_SUB:
+            case QBN_OP_DIV:
+            case QBN_OP_REM:
+            case QBN_OP_UDIV:
+            case QBN_OP_UREM:
+            case QBN_OP_MUL:
+            case QBN_OP_AND:
+            case QBN_OP_OR:
+            case QBN_OP_XOR:
+            case QBN_OP_SAR:
+            case QBN_OP_SHR:
+            case QBN_OP_SHL:
+                qbn_amd64_sysv_arith(fn, instr_old);
+                break;
+            case QBN_OP_LOADSB:
+            case QBN_OP_LOADUB:
+            case QBN_OP_LOADSH:
+            case QBN_OP_LOADUH:
+            case QBN_OP_LOADSW:
+            case QBN_OP_LOADUW:
+            case QBN_OP_LOAD:
+                qbn_amd64_sysv_load(fn, instr_old);
+                break;
+            case QBN_OP_STOREB:
+            case QBN_OP_STOREH:
+            case QBN_OP_STOREW:
+            case QBN_OP_STOREL:
+            case QBN_OP_STORES:
+            case QBN_OP_STORED:
+                qbn_amd64_sysv_store(fn, instr_old);
+                break;
+            case QBN_OP_ALLOC4:
+            case QBN_OP_ALLOC8:
+            case QBN_OP_ALLOC16:
+                // constant sizes are in the frame already, see qbn_amd64_alloc_slots
+                qbn_amd64_sysv_alloc(fn, instr_old);
+                break;
+            default:
+                if (instr_old->op >= QBN_OP_CEQW && instr_old->op <= QBN_OP_CUOD) {
+                    qbn_amd64_sysv_compare(fn, instr_old);
+                } else {
+                    qbn_amd64_copy_instr(fn, *instr_old);
+                }
+        }
+        instr_old = qbn_instr_next(instr_old);
+    }
+    assert(block->jmp_type != QBN_JUMP_NONE);
+    if (QBN_IS_RETURN(block->jmp_type)) {
+        qbn_amd64_sysv_return_move(fn, block);
+    } else if (block->jmp_type == QBN_JUMP_NZ) {
+        // not fused with a compare: jump if the condition is not zero
+        QbnRef cond = block->jmp.dest.cond;
+        assert(QBN_REF_TYPE(cond) == QBN_REF_TEMP);
+        qbn_amd64_add_instr(fn, QBN_OP_XTEST, cond, cond, QBN_REF0, (QbnBaseType) fn->temps[QBN_REF_INDEX(cond)].type);
+        block->jmp_type = QBN_JUMP_FI_NE;
+    }
+    qbn_amd64_block_end(fn);
+}
+
+unsigned long qbn_frame_size(QbnFn* fn) {
+    // spill slots and allocations, rsp stays 16 byte aligned
+    return (8 * (unsigned long) fn->rega_n_spill_slots + fn->rega_alloc_bytes + 15) / 16 * 16;
+}
+
+void qbn_amd64_sysv_abi(QbnFn* fn) {
+    assert(fn->vec_blocks->length);
+    // callee saved registers are pushed at the start of the first block, it must not be a jump target
+    qbn_fn_split_entry(fn);
+    fn->frame_size = qbn_frame_size(fn);
+    fn->stack_alignment = 0;
+    if (fn->lowered.first == NULL) {
+        qbn_instr_arena_init(&fn->lowered, QBN_LIMIT_FN_INSTR_CHUNK);
+    }
+
+    QbnInstr* instr_new = fn->lowered.current;
+    qbn_amd64_sysv_save_callee_regs_move(fn);
+    // TODO: select parameters
+
+    // every block starts with the stack as it is after the pushes, whatever came before in the layout
+    unsigned char entry_alignment = fn->stack_alignment;
+    int n_calls = 0;
+    int i = 0;
+    while (true) {
+        QbnBlock* block = fn->blocks[i];
+        fn->stack_alignment = entry_alignment;
+        qbn_amd64_sysv_block(fn, block, &n_calls);
+        block->instr = instr_new;
+        i++;
+        if (i >= fn->vec_blocks->length) {
+            break;
+        }
+        instr_new = fn->lowered.current;
+    }
+
+    // without calls rsp needs no alignment, and without slots nothing is addressed relative to rbp,
+    // pushed callee saved registers are popped before every return anyway, rbp restores rsp after a dynamic ALLOC
+    fn->frame_pointer = n_calls || fn->frame_size || fn->rega_dynamic_alloc;
+}
+
+// Peephole optimization of the lowered instructions. Each pattern looks at the current instruction and the
+// ones before it in the block and rewrites them in place, removed instructions become QBN_OP0. Patterns that
+// add or remove a flag write only apply where no setcc or conditional jump reads the flags afterwards.
+
+typedef enum {
+    QBN_AMD64_PEEP_SELF_MOVE,     // mov %rax, %rax
+    QBN_AMD64_PEEP_PUSH_POP,      // push %rax; pop %rcx  ->  mov %rax, %rcx
+    QBN_AMD64_PEEP_STACK_ADJUST,  // sub $k, %rsp; add $k, %rsp
+    QBN_AMD64_PEEP_ZERO,          // mov $0, %rax  ->  xor %eax, %eax
+    QBN_AMD64_PEEP_COUNT
+} QbnAmd64PeepholeKind;
+
+typedef struct {
+    const char* name;
+    int length;  // instructions in the window, window[0] is the current one, window[1] the one before
+    bool (*apply)(QbnFn* fn, QbnInstr** window, bool flags_live);
+} QbnAmd64Peephole;
+
+bool qbn_amd64_is_const_number(QbnFn* fn, QbnRef ref, long number) {
+    if (QBN_REF_TYPE(ref) != QBN_REF_CONST) {
+        return false;
+    }
+    QbnConst* con = QBN_CONST(fn->context, QBN_REF_INDEX(ref));
+    return con->type == QBN_CONST_NUMBER && con->value.number == number;
+}
+
+bool qbn_amd64_writes_flags(QbnOp op) {
+    switch (op) {
+        case QBN_OP_ADD:
+        case QBN_OP_SUB:
+        case QBN_OP_MUL:
+        case QBN_OP_AND:
+        case QBN_OP_OR:
+        case QBN_OP_XOR:
+        case QBN_OP_SAR:
+        case QBN_OP_SHR:
+        case QBN_OP_SHL:
+        case QBN_OP_NEG:
+        case QBN_OP_XCMP:
+        case QBN_OP_XTEST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool qbn_amd64_peep_self_move(QbnFn* fn, QbnInstr** window, bool flags_live) {
+    // the upper half of a w temp is undefined, so a 32 bit move to itself is dropped as well
+    QbnInstr* instr = window[0];
+    if (instr->op != QBN_OP_COPY || !qbn_amd64_same_location(fn, instr->arg0, instr->to)) {
+        return false;
+    }
+    instr->op = QBN_OP0;
+    return true;
+}
+
+bool qbn_amd64_peep_push_pop(QbnFn* fn, QbnInstr** window, bool flags_live) {
+    QbnInstr* push = window[1];
+    QbnInstr* pop = window[0];
+    if (push->op != QBN_OP_PUSH || pop->op != QBN_OP_POP) {
+        return false;
+    }
+    if (qbn_amd64_same_location(fn, push->arg0, pop->to)) {
+        pop->op = QBN_OP0;
     } else {
-        qbn_context_copy_instr(fn->context, *instr);
+        *pop = (QbnInstr) {.op = QBN_OP_COPY, .type = QBN_BTYPE_I64, .arg0 = push->arg0, .to = pop->to};
     }
+    push->op = QBN_OP0;
+    return true;
+}
+
+bool qbn_amd64_peep_stack_adjust(QbnFn* fn, QbnInstr** window, bool flags_live) {
+    // both orders, the add after one call meets the sub before the next
+    QbnInstr* first = window[1];
+    QbnInstr* second = window[0];
+    QbnRef rsp = QBN_REG_REF(QBN_RSP);
+    if (flags_live || first->to != rsp || second->to != rsp || first->arg0 != second->arg0 ||
+        !((first->op == QBN_OP_SUB && second->op == QBN_OP_ADD) ||
+          (first->op == QBN_OP_ADD && second->op == QBN_OP_SUB))) {
+        return false;
+    }
+    first->op = QBN_OP0;
+    second->op = QBN_OP0;
+    return true;
+}
+
+bool qbn_amd64_peep_zero(QbnFn* fn, QbnInstr** window, bool flags_live) {
+    // xor of the 32 bit register clears all 64 bits
+    QbnInstr* instr = window[0];
+    if (flags_live || instr->op != QBN_OP_COPY || !QBN_TYPE_INFO[instr->type].is_int ||
+        qbn_amd64_is_memory(fn, instr->to) || !qbn_amd64_is_const_number(fn, instr->arg0, 0)) {
+        return false;
+    }
+    *instr = (QbnInstr) {.op = QBN_OP_XOR, .type = QBN_BTYPE_I32, .arg0 = instr->to, .to = instr->to};
+    return true;
+}
+
+const QbnAmd64Peephole QBN_AMD64_PEEPHOLES[] = {
+        [QBN_AMD64_PEEP_SELF_MOVE]    = {"self move", 1, qbn_amd64_peep_self_move},
+        [QBN_AMD64_PEEP_PUSH_POP]     = {"push pop", 2, qbn_amd64_peep_push_pop},
+        [QBN_AMD64_PEEP_STACK_ADJUST] = {"stack adjust", 2, qbn_amd64_peep_stack_adjust},
+        [QBN_AMD64_PEEP_ZERO]         = {"zero with xor", 1, qbn_amd64_peep_zero},
+};
+
+#define QBN_AMD64_PEEP_WINDOW 2
+
+void qbn_amd64_peephole(QbnFn* fn) {
+    // runs on the output of qbn_amd64_sysv_abi, counts every rewrite in fn->peephole_hits
+    if (fn->peephole_hits == NULL) {
+        fn->peephole_hits = calloc(QBN_AMD64_PEEP_COUNT, sizeof(unsigned int));
+        if (!fn->peephole_hits) {
+            util_vector_no_memory();
+        }
+    }
+    QbnInstr** instrs = NULL;
+    bool* flags_live = NULL;  // whether the flags are read after the instruction
+    size_t capacity = 0;
+    for (int i=0; i<fn->vec_blocks->length; i++) {
+        QbnBlock* block = fn->blocks[i];
+        size_t n_instrs = 0;
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op == QBN_OP0) {
+                continue;
+            }
+            if (n_instrs == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                instrs = realloc(instrs, sizeof(QbnInstr*) * capacity);
+                flags_live = realloc(flags_live, sizeof(bool) * capacity);
+                if (!instrs || !flags_live) {
+                    util_vector_no_memory();
+                }
+            }
+            instrs[n_instrs++] = instr;
+        }
+
+        bool live = block->jmp_type > QBN_JUMP_NZ && block->jmp.dest.True != block->jmp.dest.False;
+        for (size_t j=n_instrs; j-- > 0;) {
+            flags_live[j] = live;
+            QbnOp op = instrs[j]->op;
+            if (op >= QBN_OP_FLAGIEQ && op <= QBN_OP_FLAGFUO) {
+                live = true;
+            } else if (qbn_amd64_writes_flags(op)) {
+                live = false;
+            }
+        }
+
+        // the window holds the instructions that are left, most recent first
+        QbnInstr* window[QBN_AMD64_PEEP_WINDOW];
+        int n_window = 0;
+        for (size_t j=0; j<n_instrs; j++) {
+            memmove(&window[1], &window[0], sizeof(QbnInstr*) * (QBN_AMD64_PEEP_WINDOW - 1));
+            window[0] = instrs[j];
+            n_window = MIN(n_window + 1, QBN_AMD64_PEEP_WINDOW);
+            for (int p=0; p<QBN_AMD64_PEEP_COUNT; p++) {
+                const QbnAmd64Peephole* pattern = &QBN_AMD64_PEEPHOLES[p];
+                if (pattern->length > n_window || !pattern->apply(fn, window, flags_live[j])) {
+                    continue;
+                }
+                fn->peephole_hits[p]++;
+                // drop what was removed, a rewritten instruction stays for the next patterns
+                int kept = 0;
+                for (int w=0; w<n_window; w++) {
+                    if (window[w]->op != QBN_OP0) {
+                        window[kept++] = window[w];
+                    }
+                }
+                n_window = kept;
+                if (n_window == 0 || window[0] != instrs[j]) {
+                    break;
+                }
+            }
+        }
+    }
+    free(flags_live);
+    free(instrs);
+}
+
+unsigned long qbn_amd64_peephole_hits(QbnContext* context, QbnAmd64PeepholeKind kind) {
+    // summed over the processed functions
+    unsigned long hits = 0;
+    for (int i=0; i<context->vec_functions->length; i++) {
+        if (context->functions[i]->peephole_hits != NULL) {
+            hits += context->functions[i]->peephole_hits[kind];
+        }
+    }
+    return hits;
+}
+
+void qbn_amd64_print_peephole_hits(QbnContext* context, FILE* file) {
+    for (int p=0; p<QBN_AMD64_PEEP_COUNT; p++) {
+        fprintf(file, "%-16s %lu\n", QBN_AMD64_PEEPHOLES[p].name, qbn_amd64_peephole_hits(context, p));
+    }
+}
+
+long qbn_amd64_slot_offset(QbnFn* fn, QbnRef slot) {
+    // spill slots are right below the saved rbp
+    return -8 * ((long) QBN_REF_INDEX(slot) + 1);
+}
+
+QbnRef qbn_amd64_resolve_temp(QbnFn* fn, QbnRef temp_ref) {
+    assert(QBN_REF_TYPE(temp_ref) == QBN_REF_TEMP);
+    QbnTemp* temp = &fn->temps[QBN_REF_INDEX(temp_ref)];
+    assert(temp->slot != QBN_REF0);
+    return temp->slot;
+}
+
+typedef struct {
+    int start;   // position of the first definition or use, -1 if the temp is never referenced
+    int end;     // position of the last use
+    bool fixed;  // parameters stay in the register they arrive in
+} QbnAmd64Interval;
 
-    qbn_amd64_sysv_restore_caller_regs_move(fn);
+void qbn_amd64_interval_extend(QbnAmd64Interval* interval, int pos) {
+    interval->start = interval->start < 0 ? pos : MIN(interval->start, pos);
+    interval->end = MAX(interval->end, pos);
 }
 
-void qbn_amd64_sysv_return_move(QbnFn* fn, QbnBlock* block) {
-    QbnInstr* instr;
-    qbn_amd64_sysv_restore_callee_regs_move(fn);
-    switch (block->jmp_type) {
-        case QBN_JUMP_RET_BASE:
-            instr = fn->context->current_instr;
-            qbn_context_add_instr(fn->context, QBN_OP_COPY, QBN_REF0, QBN_REF0, QBN_REG_REF(QBN_RAX), block->jmp.ret.type);
-            qbn_amd64_sysv_copy(fn->context, block, instr);
-            switch (QBN_REF_TYPE(block->jmp.ret.value)) {
-                case QBN_REF_CONST:
-                    instr->arg0 = QBN_CONST_REF(block->jmp.ret.value);
-                    break;
-                case QBN_REF_TEMP:
-                    instr->arg0 = QBN_TEMP_REF(block->jmp.ret.value);
-                    break;
-                case QBN_REF_NONE:
-                    instr->arg0 = QBN_REF0;
-                    break;
-                default:
-                    QBN_NOT_IMPLEMENTED
-            }
-            break;
-        case QBN_JUMP_RET_NONE:
-            break;
-        default:
-            QBN_NOT_IMPLEMENTED
+void qbn_amd64_interval_touch(QbnAmd64Interval* intervals, QbnRef ref, int pos) {
+    if (QBN_REF_TYPE(ref) == QBN_REF_TEMP) {
+        qbn_amd64_interval_extend(&intervals[QBN_REF_INDEX(ref)], pos);
     }
 }
 
-void qbn_amd64_sysv_block(QbnFn* fn, QbnBlock* block) {
-    QbnInstr* instr_old = block->instr;
-    while (instr_old->op != QBN_OP_BLOCK_END) {
-        QbnInstr* instr_new;
-        switch (instr_old->op) {
-            case QBN_OP_ARG:
-            case QBN_OP_CALL:
-                qbn_amd64_sysv_call_move(fn, block, instr_old);
-                while (instr_old->op == QBN_OP_ARG) {
-                    instr_old++;
+int qbn_amd64_live_intervals(QbnFn* fn, QbnAmd64Interval* intervals, UtilVector* calls) {
+    // one position per instruction and one for every block end, returns the number of positions,
+    // the positions of the calls are appended to calls in order
+    size_t n_blocks = fn->vec_blocks->length;
+    int* block_start = malloc(sizeof(int) * n_blocks);
+    int* block_end = malloc(sizeof(int) * n_blocks);
+    int pos = 1;
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        block_start[i] = pos;
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP0) {
+                QbnRef uses[QBN_INSTR_MAX_USES];
+                int n_uses = qbn_instr_uses(fn, instr, uses);
+                for (int u=0; u<n_uses; u++) {
+                    qbn_amd64_interval_touch(intervals, uses[u], pos);
                 }
-                break;
-            case QBN_OP_COPY:
-                instr_new = fn->context->current_instr;
-                qbn_context_copy_instr(fn->context, *instr_old);
-                qbn_amd64_sysv_copy(fn->context, block, instr_new);
-                break;
-            default:
-                qbn_context_copy_instr(fn->context, *instr_old);
+                qbn_amd64_interval_touch(intervals, instr->to, pos);
+                if (instr->op == QBN_OP_CALL) {
+                    util_vector_grow(calls, 1);
+                    ((int*) *calls->data)[calls->length-1] = pos;
+                }
+                pos++;
+            }
+        }
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            qbn_amd64_interval_touch(intervals, block->jmp.ret.value, pos);
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            qbn_amd64_interval_touch(intervals, block->jmp.dest.cond, pos);
         }
-        instr_old++;
+        block_end[i] = pos;
+        pos++;
     }
-    assert(block->jmp_type != QBN_JUMP_NONE);
-    if (QBN_IS_RETURN(block->jmp_type)) {
-        if (block->jmp_type != QBN_JUMP_RET_NONE) {
-            qbn_amd64_sysv_return_move(fn, block);
+
+    // a temp that is live across a block border covers the whole block on that side
+    QbnLiveness live;
+    qbn_liveness_compute(fn, &live);
+    for (int i=0; i<n_blocks; i++) {
+        UtilBitsetWord* in = QBN_LIVE_SET(&live, in, i);
+        UtilBitsetWord* out = QBN_LIVE_SET(&live, out, i);
+        for (size_t w=0; w<live.n_words; w++) {
+            for (UtilBitsetWord bits = in[w] | out[w]; bits; bits &= bits - 1) {
+                size_t index = w * UTIL_BITSET_WORD_BITS + __builtin_ctzl(bits);
+                if (util_bitset_test(in, index)) {
+                    qbn_amd64_interval_extend(&intervals[index], block_start[i]);
+                }
+                if (util_bitset_test(out, index)) {
+                    qbn_amd64_interval_extend(&intervals[index], block_end[i]);
+                }
+            }
         }
     }
-    qbn_context_block_end(fn->context);
+    qbn_liveness_free(&live);
+    free(block_start);
+    free(block_end);
+    return pos;
 }
 
-void qbn_amd64_sysv_abi(QbnFn* fn) {
-    assert(fn->vec_blocks->length);
-    fn->stack_alignment = 0;
+int qbn_amd64_next_call(int* call_pos, int n_calls, int pos) {
+    // index of the first call after pos, n_calls if there is none
+    int low = 0;
+    int high = n_calls;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (call_pos[mid] <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
 
-    QbnInstr* instr_new = fn->context->current_instr;
-    qbn_amd64_sysv_save_callee_regs_move(fn);
-    // TODO: select parameters
+bool qbn_amd64_is_caller_saved(QbnAmd64Register reg) {
+    return reg <= QBN_R11 || reg >= QBN_XMM0;
+}
 
+// Stack slots. The frame below rbp holds the spill slots, then the memory of ALLOC instructions. A spill slot
+// is only needed while its temp is live, so spilled temps whose intervals don't overlap share one: they are
+// visited by start and take the slot of a temp that died before, like registers in the linear scan. An
+// allocation can be stored or passed on, so it keeps its memory for the whole function. Allocations are placed
+// by decreasing alignment, that way only the first one may need padding. An allocation of a size known only at
+// runtime moves rsp down instead, see qbn_amd64_sysv_alloc.
+
+typedef struct {
+    int end;
+    int slot;
+} QbnAmd64SlotUse;
+
+void qbn_amd64_slot_heap_push(QbnAmd64SlotUse* heap, int* n, QbnAmd64SlotUse use) {
+    // min heap on end
+    int i = (*n)++;
+    while (i > 0 && heap[(i - 1) / 2].end > use.end) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = use;
+}
+
+QbnAmd64SlotUse qbn_amd64_slot_heap_pop(QbnAmd64SlotUse* heap, int* n) {
+    QbnAmd64SlotUse top = heap[0];
+    QbnAmd64SlotUse last = heap[--(*n)];
     int i = 0;
-    while (true) {
-        QbnBlock* block = fn->blocks[i];
-        qbn_amd64_sysv_block(fn, block);
-        block->instr = instr_new;
-        i++;
-        if (i >= fn->vec_blocks->length) {
+    while (2 * i + 1 < *n) {
+        int child = 2 * i + 1;
+        if (child + 1 < *n && heap[child + 1].end < heap[child].end) {
+            child++;
+        }
+        if (heap[child].end >= last.end) {
             break;
         }
-        instr_new = fn->context->current_instr;
+        heap[i] = heap[child];
+        i = child;
     }
+    heap[i] = last;
+    return top;
 }
 
-QbnRef qbn_amd64_resolve_temp(QbnFn* fn, QbnRef temp_ref) {
-    assert(QBN_REF_TYPE(temp_ref) == QBN_REF_TEMP);
-    QbnTemp* temp = &fn->temps[QBN_REF_INDEX(temp_ref)];
-    assert(temp->slot != QBN_REF0);
-    return temp->slot;
+void qbn_amd64_spill_slots(QbnFn* fn, QbnAmd64Interval* intervals, unsigned int* order, int n_intervals) {
+    // order: the temps sorted by the start of their interval, spilled ones hold a placeholder slot
+    QbnAmd64SlotUse* active = malloc(sizeof(QbnAmd64SlotUse) * (n_intervals + 1));
+    int* free_slots = malloc(sizeof(int) * (n_intervals + 1));
+    if (!active || !free_slots) {
+        util_vector_no_memory();
+    }
+    int n_active = 0;
+    int n_free = 0;
+    for (int i=0; i<n_intervals; i++) {
+        QbnTemp* temp = &fn->temps[order[i]];
+        if (QBN_REF_TYPE(temp->slot) != QBN_REF_SLOT) {
+            continue;
+        }
+        QbnAmd64Interval* interval = &intervals[order[i]];
+        // a slot is not reused at the position its temp dies
+        while (n_active && active[0].end < interval->start) {
+            free_slots[n_free++] = qbn_amd64_slot_heap_pop(active, &n_active).slot;
+        }
+        int slot = n_free ? free_slots[--n_free] : fn->rega_n_spill_slots++;
+        temp->slot = QBN_SLOT_REF(slot);
+        qbn_amd64_slot_heap_push(active, &n_active, (QbnAmd64SlotUse) {interval->end, slot});
+    }
+    free(free_slots);
+    free(active);
+}
+
+void qbn_amd64_alloc_slots(QbnFn* fn) {
+    // turns every ALLOC into the address of its memory in the frame
+    unsigned long depth = 8 * (unsigned long) fn->rega_n_spill_slots;
+    for (int align=16; align>=4; align/=2) {
+        QbnOp op = align == 16 ? QBN_OP_ALLOC16 : (align == 8 ? QBN_OP_ALLOC8 : QBN_OP_ALLOC4);
+        for (int i=0; i<fn->vec_blocks->length; i++) {
+            for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+                if (instr->op != op) {
+                    continue;
+                }
+                long size;
+                if (!qbn_fold_number(fn, instr->arg0, &size)) {
+                    fn->rega_dynamic_alloc = true;
+                    continue;
+                }
+                if ((unsigned long) size > QBN_LIMIT_FRAME_SIZE - depth) {
+                    qbn_error("Stack frame too large");
+                }
+                // a zero sized allocation still gets an address of its own
+                depth = (depth + MAX(size, 1) + align - 1) / align * align;
+                QbnMem mem = {.base = QBN_REG_REF(QBN_RBP), .scale = 1, .disp = -(int) depth};
+                *instr = (QbnInstr) {.op = QBN_OP_ADDR, .type = QBN_BTYPE_I64, .arg0 = qbn_fn_new_mem(fn, mem),
+                                     .to = instr->to};
+            }
+        }
+    }
+    fn->rega_alloc_bytes = depth - 8 * (unsigned long) fn->rega_n_spill_slots;
 }
 
-void qbn_amd64_basic_reg_allocation(QbnFn* fn) {
+void qbn_amd64_linear_scan(QbnFn* fn) {
+    // linear scan over live intervals (Poletto & Sarkar), registers are reused once a temp is dead,
+    // if none is free the interval ending last goes to a stack slot
+    size_t n_temps = fn->vec_temps->length;
+    QbnAmd64Interval* intervals = malloc(sizeof(QbnAmd64Interval) * (n_temps + 1));
+    for (int i=0; i<n_temps; i++) {
+        intervals[i] = (QbnAmd64Interval) {-1, -1, false};
+        fn->temps[i].slot = QBN_REF0;
+    }
     fn->rega_n_int_args = 0;
     fn->rega_n_float_args = 0;
-    fn->rega_n_int_regs_used = 0;
-    fn->rega_n_float_regs_used = 0;
-    // process parameters
+    fn->rega_used = 0;
+    fn->rega_n_spill_slots = 0;
+    fn->rega_alloc_bytes = 0;
+    fn->rega_dynamic_alloc = false;
+
+    // parameters arrive in registers at position 0
     for (int i=0; i<fn->vec_params->length; i++) {
-        QbnTemp* temp = fn->params[i];
-        assert(temp->slot == QBN_REF0);
+        unsigned int index = QBN_REF_INDEX(fn->params[i]);
+        QbnTemp* temp = &fn->temps[index];
         if (temp->type == QBN_ETYPE_F32 || temp->type == QBN_ETYPE_F64) {
-            // float
             // TODO: stack arguments
-            assert(fn->rega_n_int_args < QBN_REG_ARG_FLOAT_COUNT);
+            assert(fn->rega_n_float_args < QBN_REG_ARG_FLOAT_COUNT);
             temp->slot = QBN_REG_REF(QBN_REG_FLOAT[fn->rega_n_float_args]);
             fn->rega_n_float_args++;
-            fn->rega_n_float_regs_used++;
         } else {
-            // int
             assert(fn->rega_n_int_args < QBN_REG_ARG_INT_END - QBN_REG_ARG_INT_START);
-            temp->slot = QBN_REG_REF(QBN_REG_INT[fn->rega_n_int_args]);
+            temp->slot = QBN_REG_REF(QBN_REG_INT[QBN_REG_ARG_INT_START + fn->rega_n_int_args]);
             fn->rega_n_int_args++;
-            fn->rega_n_int_regs_used++;
         }
+        intervals[index] = (QbnAmd64Interval) {0, 0, true};
     }
-    // allocate remaining registers
-    for (int i=0; i<fn->vec_blocks->length; i++) {
-        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr++) {
-            if (instr->op != QBN_OP0) {
-                if (instr->to != QBN_REF0) {
-                    assert(QBN_REF_TYPE(instr->to) == QBN_REF_TEMP);
-                    QbnTemp* temp = &fn->temps[QBN_REF_INDEX(instr->to)];
-                    if (temp->slot == QBN_REF0) {
-                        // allocate a register
-                        // TODO: stack temporaries
-                        if (temp->type == QBN_ETYPE_F32 || temp->type == QBN_ETYPE_F64) {
-                            // float
-                            assert(fn->rega_n_float_regs_used < QBN_REG_FLOAT_COUNT);
-                            temp->slot = QBN_REG_REF(QBN_REG_FLOAT[fn->rega_n_float_regs_used]);
-                            fn->rega_n_float_regs_used++;
-                        } else {
-                            // int
-                            assert(fn->rega_n_int_regs_used < QBN_REG_INT_COUNT);
-                            temp->slot = QBN_REG_REF(QBN_REG_INT[fn->rega_n_int_regs_used]);
-                            fn->rega_n_int_regs_used++;
-                        }
-                    }
+    int* call_pos;
+    UtilVector* vec_calls = util_vector_new(sizeof(int), 0, (void**) &call_pos);
+    int n_positions = qbn_amd64_live_intervals(fn, intervals, vec_calls);
+    int n_calls = (int) vec_calls->length;
+
+    // sort by start, positions are bounded by the code size
+    int* first = calloc(n_positions + 1, sizeof(int));
+    unsigned int* order = malloc(sizeof(unsigned int) * (n_temps + 1));
+    for (int i=0; i<n_temps; i++) {
+        if (intervals[i].start >= 0) {
+            first[intervals[i].start + 1]++;
+        }
+    }
+    for (int i=1; i<=n_positions; i++) {
+        first[i] += first[i-1];
+    }
+    int n_intervals = first[n_positions];
+    for (int i=0; i<n_temps; i++) {
+        if (intervals[i].start >= 0) {
+            order[first[intervals[i].start]++] = i;
+        }
+    }
+
+    // active intervals per register class, sorted by end
+    unsigned int active[2][QBN_REG_FLOAT_COUNT];
+    int n_active[2] = {0, 0};
+    bool busy[QBN_REG_COUNT] = {false};
+    const QbnAmd64Register* class_regs[2] = {QBN_REG_ALLOC_INT, QBN_REG_ALLOC_FLOAT};
+    const int class_n_regs[2] = {QBN_REG_ALLOC_INT_COUNT, QBN_REG_ALLOC_FLOAT_COUNT};
+
+    for (int i=0; i<n_intervals; i++) {
+        unsigned int index = order[i];
+        QbnAmd64Interval* interval = &intervals[index];
+        QbnTemp* temp = &fn->temps[index];
+        int class = temp->type == QBN_ETYPE_F32 || temp->type == QBN_ETYPE_F64;
+        unsigned int* class_active = active[class];
+
+        // expire, a register is not reused at the position its temp dies
+        int kept = 0;
+        for (int j=0; j<n_active[class]; j++) {
+            if (intervals[class_active[j]].end < interval->start) {
+                busy[QBN_REF_INDEX(fn->temps[class_active[j]].slot)] = false;
+            } else {
+                class_active[kept++] = class_active[j];
+            }
+        }
+        n_active[class] = kept;
+
+        // a value live across a call would have to be saved around it in a caller saved register, across
+        // more than one call the pushes and pops cost more than a stack slot
+        int next_call = qbn_amd64_next_call(call_pos, n_calls, interval->start);
+        int n_spanned = qbn_amd64_next_call(call_pos, n_calls, interval->end - 1) - next_call;
+        if (!interval->fixed) {
+            int first = class == 0 && n_spanned > 0 ? QBN_REG_ALLOC_INT_CALLEE_SAVED : 0;
+            for (int k=0; k<class_n_regs[class]; k++) {
+                int j = (first + k) % class_n_regs[class];
+                if (n_spanned > 1 && qbn_amd64_is_caller_saved(class_regs[class][j])) {
+                    break;
+                }
+                if (!busy[class_regs[class][j]]) {
+                    temp->slot = QBN_REG_REF(class_regs[class][j]);
+                    break;
+                }
+            }
+        }
+        if (temp->slot == QBN_REF0) {
+            // spill whatever lives longest
+            int victim = -1;
+            for (int j=n_active[class]-1; j>=0; j--) {
+                QbnRef slot = fn->temps[class_active[j]].slot;
+                if (!intervals[class_active[j]].fixed &&
+                    !(n_spanned > 1 && qbn_amd64_is_caller_saved(QBN_REF_INDEX(slot)))) {
+                    victim = j;
+                    break;
                 }
             }
+            if (victim >= 0 && intervals[class_active[victim]].end > interval->end) {
+                QbnTemp* spilled = &fn->temps[class_active[victim]];
+                temp->slot = spilled->slot;
+                spilled->slot = QBN_SLOT_REF(0);
+                memmove(&class_active[victim], &class_active[victim+1],
+                        sizeof(unsigned int) * (n_active[class] - victim - 1));
+                n_active[class]--;
+            } else {
+                temp->slot = QBN_SLOT_REF(0);
+                continue;
+            }
+        }
+
+        QbnAmd64Register reg = QBN_REF_INDEX(temp->slot);
+        busy[reg] = true;
+        fn->rega_used |= QBN_REG_BIT(reg);
+        int j = n_active[class];
+        while (j > 0 && intervals[class_active[j-1]].end > interval->end) {
+            class_active[j] = class_active[j-1];
+            j--;
         }
+        class_active[j] = index;
+        n_active[class]++;
+    }
+
+    // sysv has no callee saved sse registers, so every call saves what lives in caller saved ones
+    free(fn->rega_call_saved);
+    fn->rega_call_saved = calloc(n_calls + 1, sizeof(unsigned long));
+    if (!fn->rega_call_saved) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_temps; i++) {
+        QbnRef slot = fn->temps[i].slot;
+        if (intervals[i].start < 0 || QBN_REF_TYPE(slot) != QBN_REF_REG ||
+            !qbn_amd64_is_caller_saved(QBN_REF_INDEX(slot))) {
+            continue;
+        }
+        for (int k = qbn_amd64_next_call(call_pos, n_calls, intervals[i].start);
+             k < n_calls && call_pos[k] < intervals[i].end; k++) {
+            fn->rega_call_saved[k] |= QBN_REG_BIT(QBN_REF_INDEX(slot));
+        }
+    }
+    util_vector_free(vec_calls);
+    qbn_amd64_spill_slots(fn, intervals, order, n_intervals);
+    qbn_amd64_alloc_slots(fn);
+    free(order);
+    free(first);
+    free(intervals);
+}
+
+typedef enum {
+    QBN_AMD64_MNEM_NONE,
+    QBN_AMD64_MOV,
+    QBN_AMD64_LEA,
+    QBN_AMD64_ADD,
+    QBN_AMD64_SUB,
+    QBN_AMD64_AND,
+    QBN_AMD64_OR,
+    QBN_AMD64_XOR,
+    QBN_AMD64_CMP,
+    QBN_AMD64_TEST,
+    QBN_AMD64_IMUL,
+    QBN_AMD64_SHL,
+    QBN_AMD64_SHR,
+    QBN_AMD64_SAR,
+    QBN_AMD64_NEG,
+    QBN_AMD64_PUSH,
+    QBN_AMD64_POP,
+    QBN_AMD64_CALL,
+    QBN_AMD64_JMP,
+    QBN_AMD64_JCC,
+    QBN_AMD64_SETCC,
+    QBN_AMD64_MOVZXB,
+    QBN_AMD64_MOVZXW,
+    QBN_AMD64_MOVSXB,
+    QBN_AMD64_MOVSXW,
+    QBN_AMD64_MOVSXD,
+    QBN_AMD64_LEAVE,
+    QBN_AMD64_RET,
+
+    QBN_AMD64_MOVSS, /* sse */
+    QBN_AMD64_MOVSD,
+    QBN_AMD64_ADDSS,
+    QBN_AMD64_ADDSD,
+    QBN_AMD64_SUBSS,
+    QBN_AMD64_SUBSD,
+    QBN_AMD64_MULSS,
+    QBN_AMD64_MULSD,
+    QBN_AMD64_DIVSS,
+    QBN_AMD64_DIVSD,
+    QBN_AMD64_UCOMISS,
+    QBN_AMD64_UCOMISD,
+    QBN_AMD64_CVTSI2SS,
+    QBN_AMD64_CVTSI2SD,
+    QBN_AMD64_CVTTSS2SI,
+    QBN_AMD64_CVTTSD2SI,
+    QBN_AMD64_CVTSS2SD,
+    QBN_AMD64_CVTSD2SS,
+    QBN_AMD64_MOVD_TO_XMM,
+    QBN_AMD64_MOVD_FROM_XMM,
+
+    QBN_AMD64_MNEM_COUNT
+} QbnAmd64Mnemonic;
+
+typedef enum {
+    QBN_AMD64_CC_O, QBN_AMD64_CC_NO, QBN_AMD64_CC_B, QBN_AMD64_CC_AE,
+    QBN_AMD64_CC_E, QBN_AMD64_CC_NE, QBN_AMD64_CC_BE, QBN_AMD64_CC_A,
+    QBN_AMD64_CC_S, QBN_AMD64_CC_NS, QBN_AMD64_CC_P, QBN_AMD64_CC_NP,
+    QBN_AMD64_CC_L, QBN_AMD64_CC_GE, QBN_AMD64_CC_LE, QBN_AMD64_CC_G
+} QbnAmd64Cond;
+
+typedef struct {
+    enum {
+        QBN_AMD64_OPD_NONE,
+        QBN_AMD64_OPD_REG,
+        QBN_AMD64_OPD_IMM,
+        QBN_AMD64_OPD_MEM,  // disp(base, index, scale)
+        QBN_AMD64_OPD_SYM,  // sym+disp(%rip) or the target of call/jmp
+        QBN_AMD64_OPD_LABEL,  // block imm of function sym, rel8 or rel32 by size, see qbn_amd64_jumps
+    } kind;
+    unsigned char size;
+    QbnAmd64Register reg;    // register or base, 0 if none
+    QbnAmd64Register index;  // 0 if none
+    unsigned char scale;
+    long imm;                // immediate or displacement
+    QbnSymbol sym;
+} QbnAmd64Operand;
+
+typedef struct {
+    QbnAmd64Mnemonic mnem;
+    unsigned char size;  // operation size in bytes
+    QbnAmd64Cond cond;   // jcc, setcc
+    QbnAmd64Operand dst; // single operand instructions only use dst
+    QbnAmd64Operand src;
+} QbnAmd64Insn;
+
+typedef struct {
+    QbnAmd64Mnemonic int_mnem;
+    QbnAmd64Mnemonic f32_mnem;
+    QbnAmd64Mnemonic f64_mnem;
+} QbnAmd64OpSelection;
+
+// lowered op -> machine instruction, chosen by the instruction's type
+const QbnAmd64OpSelection QBN_AMD64_OP2MNEM[] = {
+        [QBN_OP_COPY]   = {QBN_AMD64_MOV, QBN_AMD64_MOVSS, QBN_AMD64_MOVSD},
+        [QBN_OP_ADD]    = {QBN_AMD64_ADD, QBN_AMD64_ADDSS, QBN_AMD64_ADDSD},
+        [QBN_OP_SUB]    = {QBN_AMD64_SUB, QBN_AMD64_SUBSS, QBN_AMD64_SUBSD},
+        [QBN_OP_MUL]    = {QBN_AMD64_IMUL, QBN_AMD64_MULSS, QBN_AMD64_MULSD},
+        [QBN_OP_DIV]    = {QBN_AMD64_MNEM_NONE, QBN_AMD64_DIVSS, QBN_AMD64_DIVSD},
+        [QBN_OP_AND]    = {QBN_AMD64_AND},
+        [QBN_OP_OR]     = {QBN_AMD64_OR},
+        [QBN_OP_XOR]    = {QBN_AMD64_XOR},
+        [QBN_OP_SAR]    = {QBN_AMD64_SAR},
+        [QBN_OP_SHR]    = {QBN_AMD64_SHR},
+        [QBN_OP_SHL]    = {QBN_AMD64_SHL},
+        [QBN_OP_NEG]    = {QBN_AMD64_NEG},
+        [QBN_OP_ADDR]   = {QBN_AMD64_LEA},
+        [QBN_OP_XCMP]   = {QBN_AMD64_CMP, QBN_AMD64_UCOMISS, QBN_AMD64_UCOMISD},
+        [QBN_OP_XTEST]  = {QBN_AMD64_TEST},
+        [QBN_OP_PUSH]   = {QBN_AMD64_PUSH},
+        [QBN_OP_POP]    = {QBN_AMD64_POP},
+        [QBN_OP_CALL]   = {QBN_AMD64_CALL, QBN_AMD64_CALL, QBN_AMD64_CALL},
+        [QBN_OP_EXTSB]  = {QBN_AMD64_MOVSXB},
+        [QBN_OP_EXTUB]  = {QBN_AMD64_MOVZXB},
+        [QBN_OP_EXTSH]  = {QBN_AMD64_MOVSXW},
+        [QBN_OP_EXTUH]  = {QBN_AMD64_MOVZXW},
+        [QBN_OP_EXTSW]  = {QBN_AMD64_MOVSXD},
+        [QBN_OP_EXTUW]  = {QBN_AMD64_MOV},
+        [QBN_OP_EXTS]   = {QBN_AMD64_MNEM_NONE, QBN_AMD64_MNEM_NONE, QBN_AMD64_CVTSS2SD},
+        [QBN_OP_TRUNCD] = {QBN_AMD64_MNEM_NONE, QBN_AMD64_CVTSD2SS, QBN_AMD64_MNEM_NONE},
+        [QBN_OP_STOSI]  = {QBN_AMD64_CVTTSS2SI},
+        [QBN_OP_DTOSI]  = {QBN_AMD64_CVTTSD2SI},
+        [QBN_OP_SWTOF]  = {QBN_AMD64_MNEM_NONE, QBN_AMD64_CVTSI2SS, QBN_AMD64_CVTSI2SD},
+        [QBN_OP_SLTOF]  = {QBN_AMD64_MNEM_NONE, QBN_AMD64_CVTSI2SS, QBN_AMD64_CVTSI2SD},
+        [QBN_OP_CAST]   = {QBN_AMD64_MOVD_FROM_XMM, QBN_AMD64_MOVD_TO_XMM, QBN_AMD64_MOVD_TO_XMM},
+};
+
+const QbnAmd64Cond QBN_AMD64_FLAG2COND[] = {
+        [QBN_OP_FLAGIEQ]  = QBN_AMD64_CC_E,
+        [QBN_OP_FLAGINE]  = QBN_AMD64_CC_NE,
+        [QBN_OP_FLAGISGE] = QBN_AMD64_CC_GE,
+        [QBN_OP_FLAGISGT] = QBN_AMD64_CC_G,
+        [QBN_OP_FLAGISLE] = QBN_AMD64_CC_LE,
+        [QBN_OP_FLAGISLT] = QBN_AMD64_CC_L,
+        [QBN_OP_FLAGIUGE] = QBN_AMD64_CC_AE,
+        [QBN_OP_FLAGIUGT] = QBN_AMD64_CC_A,
+        [QBN_OP_FLAGIULE] = QBN_AMD64_CC_BE,
+        [QBN_OP_FLAGIULT] = QBN_AMD64_CC_B,
+        [QBN_OP_FLAGFEQ]  = QBN_AMD64_CC_E,
+        [QBN_OP_FLAGFGE]  = QBN_AMD64_CC_AE,
+        [QBN_OP_FLAGFGT]  = QBN_AMD64_CC_A,
+        [QBN_OP_FLAGFLE]  = QBN_AMD64_CC_BE,
+        [QBN_OP_FLAGFLT]  = QBN_AMD64_CC_B,
+        [QBN_OP_FLAGFNE]  = QBN_AMD64_CC_NE,
+        [QBN_OP_FLAGFO]   = QBN_AMD64_CC_NP,
+        [QBN_OP_FLAGFUO]  = QBN_AMD64_CC_P,
+};
+
+const QbnAmd64Cond QBN_AMD64_JUMP2COND[] = {
+        [QBN_JUMP_FI_EQ] = QBN_AMD64_CC_E,
+        [QBN_JUMP_FI_NE] = QBN_AMD64_CC_NE,
+        [QBN_JUMP_IS_GE] = QBN_AMD64_CC_GE,
+        [QBN_JUMP_IS_GT] = QBN_AMD64_CC_G,
+        [QBN_JUMP_IS_LE] = QBN_AMD64_CC_LE,
+        [QBN_JUMP_IS_LT] = QBN_AMD64_CC_L,
+        [QBN_JUMP_IU_GE] = QBN_AMD64_CC_AE,
+        [QBN_JUMP_IU_GT] = QBN_AMD64_CC_A,
+        [QBN_JUMP_IU_LE] = QBN_AMD64_CC_BE,
+        [QBN_JUMP_IU_LT] = QBN_AMD64_CC_B,
+        [QBN_JUMP_FF_EQ] = QBN_AMD64_CC_E,
+        [QBN_JUMP_FF_GE] = QBN_AMD64_CC_AE,
+        [QBN_JUMP_FF_GT] = QBN_AMD64_CC_A,
+        [QBN_JUMP_FF_LE] = QBN_AMD64_CC_BE,
+        [QBN_JUMP_FF_LT] = QBN_AMD64_CC_B,
+        [QBN_JUMP_FF_NE] = QBN_AMD64_CC_NE,
+        [QBN_JUMP_FF_O]  = QBN_AMD64_CC_NP,
+        [QBN_JUMP_FF_UO] = QBN_AMD64_CC_P,
+};
+
+void qbn_amd64_operand(QbnFn* fn, QbnRef ref, unsigned char size, QbnAmd64Operand* operand) {
+    QbnConst* con;
+    QbnMem* mem;
+    QbnRef base;
+    *operand = (QbnAmd64Operand) {.kind = QBN_AMD64_OPD_NONE, .size = size};
+    switch (QBN_REF_TYPE(ref)) {
+        case QBN_REF_NONE:
+        case QBN_REF_SLOT:
+            break;
+        case QBN_REF_TEMP:
+            ref = qbn_amd64_resolve_temp(fn, ref);
+            if (QBN_REF_TYPE(ref) == QBN_REF_SLOT) {
+                operand->kind = QBN_AMD64_OPD_MEM;
+                operand->reg = QBN_RBP;
+                operand->imm = qbn_amd64_slot_offset(fn, ref);
+                break;
+            }
+            // fallthrough
+        case QBN_REF_REG:
+            operand->kind = QBN_AMD64_OPD_REG;
+            operand->reg = QBN_REF_INDEX(ref);
+            break;
+        case QBN_REF_MEM:
+            // spilled parts are in the scratch register by now, see qbn_amd64_legal_mem
+            mem = &fn->mems[QBN_REF_INDEX(ref)];
+            operand->imm = mem->disp;
+            if (QBN_REF_TYPE(mem->base) == QBN_REF_CONST) {
+                operand->kind = QBN_AMD64_OPD_SYM;
+                operand->sym = QBN_CONST(fn->context, QBN_REF_INDEX(mem->base))->value.label;
+                break;
+            }
+            operand->kind = QBN_AMD64_OPD_MEM;
+            base = QBN_REF_TYPE(mem->base) == QBN_REF_TEMP ? qbn_amd64_resolve_temp(fn, mem->base) : mem->base;
+            assert(QBN_REF_TYPE(base) == QBN_REF_REG);
+            operand->reg = QBN_REF_INDEX(base);
+            if (mem->index != QBN_REF0) {
+                QbnRef index = QBN_REF_TYPE(mem->index) == QBN_REF_TEMP ? qbn_amd64_resolve_temp(fn, mem->index)
+                                                                         : mem->index;
+                assert(QBN_REF_TYPE(index) == QBN_REF_REG);
+                operand->index = QBN_REF_INDEX(index);
+                operand->scale = mem->scale;
+            }
+            break;
+        case QBN_REF_CONST:
+            con = QBN_CONST(fn->context, QBN_REF_INDEX(ref));
+            switch (con->type) {
+                case QBN_CONST_NUMBER:
+                case QBN_CONST_F64:
+                    operand->kind = QBN_AMD64_OPD_IMM;
+                    operand->imm = con->value.number;
+                    break;
+                case QBN_CONST_F32:
+                    operand->kind = QBN_AMD64_OPD_IMM;
+                    operand->imm = (int) con->value.number;
+                    break;
+                case QBN_CONST_GLOBAL_ADDR:
+                case QBN_CONST_NAME:
+                    operand->kind = QBN_AMD64_OPD_SYM;
+                    operand->sym = con->value.label;
+                    break;
+            }
+            break;
+    }
+}
+
+bool qbn_amd64_select(QbnFn* fn, QbnInstr* instr, QbnAmd64Insn* insn) {
+    // maps a lowered (two address) instruction to exactly one machine instruction
+    // returns false if nothing has to be emitted
+    unsigned char size = QBN_TYPE_INFO[instr->type].bytes;
+    unsigned char src_size = size;
+    QbnRef dst = instr->to;
+    QbnRef src = instr->arg0;
+    insn->cond = QBN_AMD64_CC_O;
+    switch (instr->op) {
+        case QBN_OP0:
+        case QBN_OP_NOP:
+            return false;
+        case QBN_OP_PUSH:
+        case QBN_OP_CALL:
+            size = 8;
+            dst = instr->arg0;
+            src = QBN_REF0;
+            break;
+        case QBN_OP_POP:
+            size = 8;
+            src = QBN_REF0;
+            break;
+        case QBN_OP_NEG:
+            src = QBN_REF0;
+            break;
+        case QBN_OP_XCMP:
+        case QBN_OP_XTEST:
+            dst = instr->arg0;
+            src = instr->arg1;
+            break;
+        case QBN_OP_EXTSB:
+        case QBN_OP_EXTUB:
+            src_size = 1;
+            break;
+        case QBN_OP_EXTSH:
+        case QBN_OP_EXTUH:
+            src_size = 2;
+            break;
+        case QBN_OP_EXTSW:
+        case QBN_OP_EXTS:
+        case QBN_OP_STOSI:
+            src_size = 4;
+            break;
+        case QBN_OP_EXTUW:
+        case QBN_OP_SWTOF:
+            // 32 bit mov zero extends, cvtsi2s* is sized by its integer operand
+            size = 4;
+            src_size = 4;
+            break;
+        case QBN_OP_SLTOF:
+            size = 8;
+            src_size = 8;
+            break;
+        case QBN_OP_TRUNCD:
+        case QBN_OP_DTOSI:
+            src_size = 8;
+            break;
+        default:;
+    }
+    if (instr->op >= QBN_OP_FLAGIEQ && instr->op <= QBN_OP_FLAGFUO) {
+        insn->mnem = QBN_AMD64_SETCC;
+        insn->cond = QBN_AMD64_FLAG2COND[instr->op];
+        size = 1;
+        src = QBN_REF0;
+    } else if (instr->type == QBN_BTYPE_F32) {
+        insn->mnem = QBN_AMD64_OP2MNEM[instr->op].f32_mnem;
+    } else if (instr->type == QBN_BTYPE_F64) {
+        insn->mnem = QBN_AMD64_OP2MNEM[instr->op].f64_mnem;
+    } else {
+        insn->mnem = QBN_AMD64_OP2MNEM[instr->op].int_mnem;
+    }
+    if (insn->mnem == QBN_AMD64_MNEM_NONE) {
+        QBN_NOT_IMPLEMENTED
     }
+    insn->size = size;
+    qbn_amd64_operand(fn, dst, size, &insn->dst);
+    qbn_amd64_operand(fn, src, src_size, &insn->src);
+    if (insn->mnem >= QBN_AMD64_MOVSS && insn->src.kind == QBN_AMD64_OPD_IMM) {
+        // TODO: floating point constants have to live in memory
+        QBN_NOT_IMPLEMENTED
+    }
+    return true;
+}
+
+void qbn_process_fn(QbnFn* fn) {
+    // the whole pipeline for a single function, functions do not depend on each other
+    qbn_ssa_construct(fn);
+    qbn_fold_constants(fn);
+    qbn_propagate_copies(fn);
+    qbn_amd64_fold_addresses(fn);
+    qbn_eliminate_dead_code(fn);
+    qbn_ssa_destruct(fn);
+    qbn_ssa_coalesce(fn);
+    qbn_amd64_fuse_branches(fn);
+    qbn_fn_layout_blocks(fn);
+    qbn_amd64_linear_scan(fn);
+    qbn_amd64_sysv_abi(fn);
+    qbn_amd64_peephole(fn);
 }
 
 void qbn_process(QbnContext* context) {
+    // lowering is done in place, a processed context is left as it is
+    if (context->is_processed) {
+        return;
+    }
     for (int i=0; i<context->vec_functions->length; i++) {
-        QbnFn* fn = context->functions[i];
-        qbn_amd64_basic_reg_allocation(fn);
-        qbn_print_all(stderr, fn->context, "after reg allocation");
-        qbn_amd64_sysv_abi(fn);
+        qbn_process_fn(context->functions[i]);
     }
+    context->is_processed = true;
 }
 
 const char* QBN_GAS_INDENT = "    ";
@@ -337,15 +2190,6 @@ const char* QBN_TYPE2GAS[] = {
         [QBN_TYPE_I16] = "short",
 };
 
-const char QBN_TYPE2GASSUFFIX[] = {
-        [QBN_TYPE_I32] = 'l',  // long
-        [QBN_TYPE_I64] = 'q',  // quadword
-        [QBN_TYPE_F32] = 'l',  // long
-        [QBN_TYPE_F64] = 'q',  // quadword
-        [QBN_TYPE_I8] = 'b',   // byte
-        [QBN_TYPE_I16] = 'w',  // word
-};
-
 const char* QBN_AMD64_REG2GAS_TABLE[][4] = {
         [QBN_RAX  ] = {"al", "ax", "eax", "rax"},
         [QBN_RBX  ] = {"bl", "bx", "ebx", "rbx"},
@@ -384,274 +2228,413 @@ const char* QBN_AMD64_REG2GAS_TABLE[][4] = {
 #define QBN_AMD64_REG2GAS(reg, size) QBN_AMD64_REG2GAS_TABLE[reg][(size) <= 2 ? (size) - 1 : ((size) == 4 ? 2 : 3)]
 
 typedef enum {
-    QBN_GASOP_2A_TYPED,  // with type suffix, 1 src arg, 1 dest arg
-    QBN_GASOP_1A_TYPED,  // with type suffix, 1 src arg
-    QBN_GASOP_1D_TYPED,  // with type suffix, 1 dest arg
-} QbnGasOpType;
+    QBN_GAS_SUFFIX_NONE,
+    QBN_GAS_SUFFIX_SIZE,  // b, w, l, q by operation size
+    QBN_GAS_SUFFIX_COND,  // condition code
+    QBN_GAS_SUFFIX_MOVD,  // movd or movq
+} QbnGasSuffix;
 
 typedef const struct {
     const char* str;
-    QbnGasOpType type;
-} QbnAmd64OpStuff;
-
-QbnAmd64OpStuff QBN_AMD64_OP2GASSTR[] = {
-        [QBN_OP_ADD]     = {"add", QBN_GASOP_2A_TYPED},
-        [QBN_OP_SUB]     = {"sub", QBN_GASOP_2A_TYPED},
-        [QBN_OP_ADDR]    = {"lea", QBN_GASOP_2A_TYPED},
-        [QBN_OP_PUSH]    = {"push", QBN_GASOP_1A_TYPED},
-        [QBN_OP_POP]     = {"pop", QBN_GASOP_1D_TYPED},
+    QbnGasSuffix suffix;
+} QbnAmd64GasMnemonic;
+
+QbnAmd64GasMnemonic QBN_AMD64_MNEM2GAS[] = {
+        [QBN_AMD64_MOV]           = {"mov", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_LEA]           = {"lea", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_ADD]           = {"add", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_SUB]           = {"sub", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_AND]           = {"and", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_OR]            = {"or", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_XOR]           = {"xor", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_CMP]           = {"cmp", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_TEST]          = {"test", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_IMUL]          = {"imul", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_SHL]           = {"shl", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_SHR]           = {"shr", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_SAR]           = {"sar", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_NEG]           = {"neg", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_PUSH]          = {"push", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_POP]           = {"pop", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_CALL]          = {"call", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_JMP]           = {"jmp", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_JCC]           = {"j", QBN_GAS_SUFFIX_COND},
+        [QBN_AMD64_SETCC]         = {"set", QBN_GAS_SUFFIX_COND},
+        [QBN_AMD64_MOVZXB]        = {"movzb", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_MOVZXW]        = {"movzw", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_MOVSXB]        = {"movsb", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_MOVSXW]        = {"movsw", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_MOVSXD]        = {"movslq", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_LEAVE]         = {"leave", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_RET]           = {"ret", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_MOVSS]         = {"movss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_MOVSD]         = {"movsd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_ADDSS]         = {"addss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_ADDSD]         = {"addsd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_SUBSS]         = {"subss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_SUBSD]         = {"subsd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_MULSS]         = {"mulss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_MULSD]         = {"mulsd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_DIVSS]         = {"divss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_DIVSD]         = {"divsd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_UCOMISS]       = {"ucomiss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_UCOMISD]       = {"ucomisd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_CVTSI2SS]      = {"cvtsi2ss", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_CVTSI2SD]      = {"cvtsi2sd", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_CVTTSS2SI]     = {"cvttss2si", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_CVTTSD2SI]     = {"cvttsd2si", QBN_GAS_SUFFIX_SIZE},
+        [QBN_AMD64_CVTSS2SD]      = {"cvtss2sd", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_CVTSD2SS]      = {"cvtsd2ss", QBN_GAS_SUFFIX_NONE},
+        [QBN_AMD64_MOVD_TO_XMM]   = {"mov", QBN_GAS_SUFFIX_MOVD},
+        [QBN_AMD64_MOVD_FROM_XMM] = {"mov", QBN_GAS_SUFFIX_MOVD},
+};
+
+const char* QBN_AMD64_COND2GAS[] = {
+        [QBN_AMD64_CC_O] = "o", [QBN_AMD64_CC_NO] = "no", [QBN_AMD64_CC_B] = "b", [QBN_AMD64_CC_AE] = "ae",
+        [QBN_AMD64_CC_E] = "e", [QBN_AMD64_CC_NE] = "ne", [QBN_AMD64_CC_BE] = "be", [QBN_AMD64_CC_A] = "a",
+        [QBN_AMD64_CC_S] = "s", [QBN_AMD64_CC_NS] = "ns", [QBN_AMD64_CC_P] = "p", [QBN_AMD64_CC_NP] = "np",
+        [QBN_AMD64_CC_L] = "l", [QBN_AMD64_CC_GE] = "ge", [QBN_AMD64_CC_LE] = "le", [QBN_AMD64_CC_G] = "g",
 };
 
-void qbn_fprintf_indent(FILE* file, const char* formatter, ...) {
-    // print an indentation before the actual string
-    fprintf(file, QBN_GAS_INDENT);
-    va_list argp;
-    va_start(argp, formatter);
-    vfprintf(file, formatter, argp);
-    va_end(argp);
+#define QBN_GAS_SIZE2SUFFIX(size) ("bw?l???q"[(size) - 1])
+
+void qbn_emit_indent(QbnOutBuf* out) {
+    qbn_outbuf_write(out, QBN_GAS_INDENT, 4);
 }
 
-void qbn_emit_amd64_reg(QbnRef ref, unsigned char size, FILE* file) {
-    fprintf(file, "%%%s", QBN_AMD64_REG2GAS(QBN_REF_INDEX(ref), size));
+void qbn_emit_amd64_reg(QbnOutBuf* out, QbnAmd64Register reg, int size) {
+    qbn_outbuf_char(out, '%');
+    qbn_outbuf_str(out, QBN_AMD64_REG2GAS(reg, size));
+}
+
+void qbn_emit_amd64_operand(QbnContext* context, QbnAmd64Insn* insn, QbnAmd64Operand* operand, QbnOutBuf* out) {
+    switch (operand->kind) {
+        case QBN_AMD64_OPD_NONE:
+            QBN_UNREACHABLE
+        case QBN_AMD64_OPD_REG:
+            qbn_emit_amd64_reg(out, operand->reg, operand->size);
+            break;
+        case QBN_AMD64_OPD_IMM:
+            qbn_outbuf_char(out, '$');
+            qbn_outbuf_long(out, operand->imm);
+            break;
+        case QBN_AMD64_OPD_MEM:
+            if (operand->imm) {
+                qbn_outbuf_long(out, operand->imm);
+            }
+            qbn_outbuf_char(out, '(');
+            qbn_emit_amd64_reg(out, operand->reg, 8);
+            if (operand->index) {
+                qbn_outbuf_char(out, ',');
+                qbn_emit_amd64_reg(out, operand->index, 8);
+                qbn_outbuf_char(out, ',');
+                qbn_outbuf_char(out, (char) ('0' + operand->scale));
+            }
+            qbn_outbuf_char(out, ')');
+            break;
+        case QBN_AMD64_OPD_SYM:
+            qbn_outbuf_str(out, qbn_symbol_name(context, operand->sym));
+            if (operand->imm) {
+                qbn_outbuf_signed(out, operand->imm);
+            }
+            if (insn->mnem != QBN_AMD64_CALL && insn->mnem != QBN_AMD64_JMP && insn->mnem != QBN_AMD64_JCC) {
+                qbn_outbuf_write(out, "(%rip)", 6);
+            }
+            break;
+        case QBN_AMD64_OPD_LABEL:
+            qbn_outbuf_write(out, ".L", 2);
+            qbn_outbuf_str(out, qbn_symbol_name(context, operand->sym));
+            qbn_outbuf_char(out, '.');
+            qbn_outbuf_long(out, operand->imm);
+            break;
+    }
 }
 
-void qbn_emit_amd64_const(QbnContext* context, QbnRef ref, FILE* file) {
-    QbnConst* con = &context->consts[QBN_REF_INDEX(ref)];
-    switch (con->type) {
-        case QBN_CONST_NUMBER:
-        case QBN_CONST_F64:
-            fprintf(file, "$%ld", con->value.number);
+void qbn_emit_amd64_insn(QbnContext* context, QbnAmd64Insn* insn, QbnOutBuf* out) {
+    QbnAmd64GasMnemonic* mnem = &QBN_AMD64_MNEM2GAS[insn->mnem];
+    assert(mnem->str != NULL);
+    qbn_emit_indent(out);
+    qbn_outbuf_str(out, mnem->str);
+    switch (mnem->suffix) {
+        case QBN_GAS_SUFFIX_NONE:
             break;
-        case QBN_CONST_F32:
-            fprintf(file, "$%d", (int) con->value.number);
+        case QBN_GAS_SUFFIX_SIZE:
+            qbn_outbuf_char(out, QBN_GAS_SIZE2SUFFIX(insn->size));
             break;
-        case QBN_CONST_GLOBAL_ADDR:
-            fprintf(file, "%s(%%rip)", con->value.label);
+        case QBN_GAS_SUFFIX_COND:
+            qbn_outbuf_str(out, QBN_AMD64_COND2GAS[insn->cond]);
             break;
-        case QBN_CONST_NAME:
-            fprintf(file, "%s", con->value.label);
+        case QBN_GAS_SUFFIX_MOVD:
+            qbn_outbuf_char(out, insn->size == 8 ? 'q' : 'd');
             break;
     }
+    // AT&T order: source first
+    if (insn->src.kind != QBN_AMD64_OPD_NONE) {
+        qbn_outbuf_char(out, ' ');
+        qbn_emit_amd64_operand(context, insn, &insn->src, out);
+        qbn_outbuf_char(out, ',');
+    }
+    if (insn->dst.kind != QBN_AMD64_OPD_NONE) {
+        bool is_branch = insn->mnem == QBN_AMD64_CALL || insn->mnem == QBN_AMD64_JMP;
+        bool is_direct = insn->dst.kind == QBN_AMD64_OPD_SYM || insn->dst.kind == QBN_AMD64_OPD_LABEL;
+        if (is_branch && !is_direct) {
+            qbn_outbuf_write(out, " *", 2);
+        } else {
+            qbn_outbuf_char(out, ' ');
+        }
+        qbn_emit_amd64_operand(context, insn, &insn->dst, out);
+    }
+    qbn_outbuf_char(out, '\n');
+}
+
+void qbn_emit_label(QbnOutBuf* out, const char* name, bool export) {
+    if (export) {
+        qbn_outbuf_write(out, ".globl ", 7);
+        qbn_outbuf_str(out, name);
+        qbn_outbuf_char(out, '\n');
+    }
+    qbn_outbuf_str(out, name);
+    qbn_outbuf_write(out, ":\n", 2);
+}
+
+void qbn_emit_directive(QbnOutBuf* out, const char* type) {
+    // indented, the arguments follow
+    qbn_emit_indent(out);
+    qbn_outbuf_char(out, '.');
+    qbn_outbuf_str(out, type);
+    qbn_outbuf_char(out, ' ');
 }
 
-void qbn_emit_data(QbnContext* context, FILE* file) {
-    assert(context->data_iterator != NULL || context->data_iterator->type == QBN_DATA_START);
-    QbnDataItem* data = context->data_iterator;
+const char* QBN_SECTION2GAS[] = {
+        [QBN_SEC_DATA] = ".data\n",
+        [QBN_SEC_TEXT] = ".text\n",
+        [QBN_SEC_RODATA] = ".section .rodata\n",
+        [QBN_SEC_BSS] = ".bss\n",
+};
 
-    if (context->current_section == QBN_SEC_NONE) {
-        context->current_section = QBN_SEC_DATA;
+void qbn_emit_data(QbnContext* context, QbnDataDef* def, QbnOutBuf* out) {
+    if (context->current_section != def->section) {
+        context->current_section = def->section;
         context->data_is_aligned = false;
-        fprintf(file, ".data\n");
+        qbn_outbuf_str(out, QBN_SECTION2GAS[def->section]);
     }
     if (!context->data_is_aligned) {
-        fprintf(file, ".balign 8\n");
+        qbn_outbuf_str(out, ".balign 8\n");
         // TODO: check if next line correct
         context->data_is_aligned = true;
     }
-    if (data->value.start.export) {
-        fprintf(file, ".globl %s\n", data->value.start.name);
-    }
-    fprintf(file, "%s:\n", data->value.start.name);
-    data++;
+    qbn_emit_label(out, qbn_symbol_name(context, def->name), def->export);
 
-    while (true) {
+    for (unsigned int i=0; i<def->n_items; i++) {
+        QbnDataItem* data = &context->data_items[def->first + i];
         switch (data->type) {
             case QBN_DATA_ALIGN:
-                fprintf(file, ".balign %ld\n", data->value.align_length);
+                qbn_outbuf_str(out, ".balign ");
+                qbn_outbuf_long(out, data->value.align_length);
+                qbn_outbuf_char(out, '\n');
                 context->data_is_aligned = true;
                 break;
             case QBN_DATA_ZERO:
-                qbn_fprintf_indent(file, ".fill %ld,1,0\n", data->value.zero_length);
+                qbn_emit_directive(out, "fill");
+                qbn_outbuf_long(out, data->value.zero_length);
+                qbn_outbuf_str(out, ",1,0\n");
                 break;
             case QBN_DATA_REF_DATA:
-                qbn_fprintf_indent(file, ".%s %s%+ld\n", QBN_TYPE2GAS[data->value.global_ref.ext_type],
-                                   data->value.global_ref.name,
-                                   data->value.global_ref.offset);
+                qbn_emit_directive(out, QBN_TYPE2GAS[data->value.global_ref.ext_type]);
+                qbn_outbuf_str(out, qbn_symbol_name(context, data->value.global_ref.name));
+                qbn_outbuf_signed(out, data->value.global_ref.offset);
+                qbn_outbuf_char(out, '\n');
                 break;
             case QBN_DATA_REF_FUNC:
                 // TODO: change according to target pointer size
-                qbn_fprintf_indent(file, ".%s %s\n", QBN_TYPE2GAS[QBN_TYPE_I64],
-                                   data->value.global_ref.name);
+                qbn_emit_directive(out, QBN_TYPE2GAS[QBN_TYPE_I64]);
+                qbn_outbuf_str(out, qbn_symbol_name(context, data->value.global_ref.name));
+                qbn_outbuf_char(out, '\n');
                 break;
             case QBN_DATA_STRING:
-                qbn_fprintf_indent(file, ".ascii \"%s\"\n", data->value.string);
+                qbn_emit_directive(out, "ascii");
+                qbn_outbuf_char(out, '"');
+                qbn_outbuf_str(out, data->value.string);
+                qbn_outbuf_str(out, "\"\n");
                 break;
             case QBN_DATA_CONSTANT:
                 if (data->value.number.ext_type == QBN_TYPE_F64) {
-                    qbn_fprintf_indent(file, ".quad %ld\n", data->value.number.value.i);
+                    qbn_emit_directive(out, "quad");
+                    qbn_outbuf_long(out, data->value.number.value.i);
                 } else if (data->value.number.ext_type == QBN_TYPE_F32) {
-                    qbn_fprintf_indent(file, ".int %d\n", (int) data->value.number.value.i);
+                    qbn_emit_directive(out, "int");
+                    qbn_outbuf_long(out, (int) data->value.number.value.i);
                 } else {
-                    qbn_fprintf_indent(file, ".%s %ld\n", QBN_TYPE2GAS[data->value.number.ext_type],
-                                       data->value.number.value.i);
+                    qbn_emit_directive(out, QBN_TYPE2GAS[data->value.number.ext_type]);
+                    qbn_outbuf_long(out, data->value.number.value.i);
                 }
+                qbn_outbuf_char(out, '\n');
                 break;
-            case QBN_DATA_START:
-            case QBN_DATA_END:
-                fprintf(file, "\n");
-                context->data_iterator = data;
-                return;
             default:
                 QBN_UNREACHABLE
         }
-        data++;
-        while (data->type == QBN_DATA_NEXT_VEC_BLOCK) {
-            data = data->value.next;
-        }
     }
+    qbn_outbuf_char(out, '\n');
 }
 
-unsigned long qbn_frame_size(QbnFn* fn) {
-    // TODO
-    return 128;
-}
-
-void qbn_emit_instr(QbnContext* context, QbnInstr* instr, FILE* file) {
-    QbnAmd64OpStuff* op = &QBN_AMD64_OP2GASSTR[instr->op];
-    assert(op->str != NULL);
-    qbn_fprintf_indent(file, op->str);
-    switch (op->type) {
-        case QBN_GASOP_1A_TYPED:
-            assert(instr->arg0 != QBN_REF0);
-            fprintf(file, "%c ", QBN_TYPE2GASSUFFIX[instr->type]);
-            switch (QBN_REF_TYPE(instr->arg0)) {
-                case QBN_REF_REG:
-                    qbn_emit_amd64_reg(instr->arg0, QBN_TYPE_INFO[instr->type].bytes, file);
-                    break;
-                case QBN_REF_CONST:
-                    QBN_UNREACHABLE  // TODO: do we need this?
-                    qbn_emit_amd64_const(context, instr->arg0, file);
-                    break;
-                default:
-                    QBN_UNREACHABLE
-            }
-            fprintf(file, "\n");
-            break;
-        case QBN_GASOP_1D_TYPED:
-            assert(instr->to != QBN_REF0);
-            fprintf(file, "%c ", QBN_TYPE2GASSUFFIX[instr->type]);
-            qbn_emit_amd64_reg(instr->to, QBN_TYPE_INFO[instr->type].bytes, file);
-            fprintf(file, "\n");
-            break;
-        case QBN_GASOP_2A_TYPED:
-            assert(instr->arg0 != QBN_REF0);
-            fprintf(file, "%c ", QBN_TYPE2GASSUFFIX[instr->type]);
-            switch (QBN_REF_TYPE(instr->arg0)) {
-                case QBN_REF_REG:
-                    qbn_emit_amd64_reg(instr->arg0, QBN_TYPE_INFO[instr->type].bytes, file);
-                    break;
-                case QBN_REF_CONST:
-                    qbn_emit_amd64_const(context, instr->arg0, file);
-                    break;
-                default:
-                    QBN_UNREACHABLE
+void qbn_emit_data_sections(QbnContext* context, QbnOutBuf* out) {
+    for (int s=0; s<QBN_N_DATA_SECTIONS; s++) {
+        for (int i=0; i<context->vec_data_defs->length; i++) {
+            if (context->data_defs[i].section == QBN_DATA_SECTIONS[s]) {
+                qbn_emit_data(context, &context->data_defs[i], out);
             }
-            fprintf(file, ", ");
-            qbn_emit_amd64_reg(instr->to, QBN_TYPE_INFO[instr->type].bytes, file);
-            fprintf(file, "\n");
-            break;
+        }
     }
 }
 
-void qbn_emit_return(FILE* file, QbnBlock* block) {
-    if (block->jmp_type != QBN_JUMP_RET_NONE) {
-        // TODO ?
+#define QBN_AMD64_MAX_PROLOGUE 3
+#define QBN_AMD64_MAX_EPILOGUE 2
+#define QBN_AMD64_MAX_JUMPS 2
+#define QBN_AMD64_REG_OPERAND(r, s) ((QbnAmd64Operand) {.kind = QBN_AMD64_OPD_REG, .size = (s), .reg = (r)})
+#define QBN_AMD64_IMM_OPERAND(i, s) ((QbnAmd64Operand) {.kind = QBN_AMD64_OPD_IMM, .size = (s), .imm = (i)})
+
+int qbn_amd64_prologue(QbnFn* fn, QbnAmd64Insn* insns) {
+    // fills at most QBN_AMD64_MAX_PROLOGUE instructions, returns their count
+    // frame_size and frame_pointer are set by qbn_amd64_sysv_abi
+    int count = 0;
+    if (!fn->frame_pointer) {
+        return count;
+    }
+    insns[count++] = (QbnAmd64Insn) {QBN_AMD64_PUSH, 8, .dst = QBN_AMD64_REG_OPERAND(QBN_RBP, 8)};
+    insns[count++] = (QbnAmd64Insn) {QBN_AMD64_MOV, 8, .dst = QBN_AMD64_REG_OPERAND(QBN_RBP, 8),
+                                     .src = QBN_AMD64_REG_OPERAND(QBN_RSP, 8)};
+    if (fn->frame_size) {
+        insns[count++] = (QbnAmd64Insn) {QBN_AMD64_SUB, 8, .dst = QBN_AMD64_REG_OPERAND(QBN_RSP, 8),
+                                         .src = QBN_AMD64_IMM_OPERAND((long) fn->frame_size, 8)};
     }
-    qbn_fprintf_indent(file, "leave\n");
-    qbn_fprintf_indent(file, "ret\n");
+    return count;
 }
 
-void qbn_emit_block(QbnFn* fn, QbnBlock* block, FILE* file) {
-    QbnInstr* instr = block->instr;
-    QbnTemp* temp;
-    while (instr->op != QBN_OP_BLOCK_END) {
-        switch (instr->op) {
-            case QBN_OP0:
-                break;
-            case QBN_OP_COPY:
-                qbn_fprintf_indent(file, "mov");
-                fprintf(file, "%c ", QBN_TYPE2GASSUFFIX[instr->type]);
-                switch (QBN_REF_TYPE(instr->arg0)) {
-                    case QBN_REF_REG:
-                        qbn_emit_amd64_reg(instr->arg0, QBN_TYPE_INFO[instr->type].bytes, file);
-                        break;
-                    case QBN_REF_CONST:
-                        qbn_emit_amd64_const(fn->context, instr->arg0, file);
-                        break;
-                    case QBN_REF_TEMP:
-                        temp = &fn->temps[QBN_REF_INDEX(instr->arg0)];
-                        assert(temp->slot != QBN_REF0);
-                        assert(QBN_REF_TYPE(temp->slot) == QBN_REF_REG);
-                        qbn_emit_amd64_reg(temp->slot, QBN_TYPE_INFO[instr->type].bytes, file);
-                        break;
-                    default:
-                        QBN_UNREACHABLE
-                }
-                fprintf(file, ", ");
-                if (QBN_REF_TYPE(instr->to) == QBN_REF_TEMP) {
-                    temp = &fn->temps[QBN_REF_INDEX(instr->to)];
-                    assert(temp->slot != QBN_REF0);
-                    instr->to = temp->slot;
-                }
-                assert(QBN_REF_TYPE(instr->to));
-                qbn_emit_amd64_reg(instr->to, QBN_TYPE_INFO[instr->type].bytes, file);
-                fprintf(file, "\n");
-                break;
-            case QBN_OP_CALL:
-                qbn_fprintf_indent(file, "call ");
-                qbn_emit_amd64_const(fn->context, instr->arg0, file);
-                fprintf(file, "\n");
-                break;
-            // TODO: support all (external) instructions
-            // TODO refactor rest into table
-            default:
-                qbn_emit_instr(fn->context, instr, file);
+int qbn_amd64_epilogue(QbnFn* fn, QbnBlock* block, QbnAmd64Insn* insns) {
+    // fills at most QBN_AMD64_MAX_EPILOGUE instructions, returns their count
+    int count = 0;
+    if (fn->frame_pointer) {
+        insns[count++] = (QbnAmd64Insn) {QBN_AMD64_LEAVE, 8};
+    }
+    insns[count++] = (QbnAmd64Insn) {QBN_AMD64_RET, 8};
+    return count;
+}
+
+QbnAmd64Operand qbn_amd64_label(QbnFn* fn, QbnBlock* block) {
+    return (QbnAmd64Operand) {.kind = QBN_AMD64_OPD_LABEL, .size = 4, .imm = block->id, .sym = fn->name};
+}
+
+int qbn_amd64_jumps(QbnFn* fn, QbnBlock* block, QbnBlock* next, QbnAmd64Insn* insns) {
+    // fills at most QBN_AMD64_MAX_JUMPS instructions, returns their count
+    // next is the block laid out after this one, there is no jump to it
+    QbnBlock* True = block->jmp.dest.True;
+    QbnBlock* False = block->jmp.dest.False;
+    if (block->jmp_type == QBN_JUMP_UNCONDITIONAL || True == False) {
+        if (True == next) {
+            return 0;
         }
-        instr++;
+        insns[0] = (QbnAmd64Insn) {QBN_AMD64_JMP, 8, .dst = qbn_amd64_label(fn, True)};
+        return 1;
+    }
+    assert(block->jmp_type > QBN_JUMP_NZ);  // lowered to a flag jump
+    QbnAmd64Cond cond = QBN_AMD64_JUMP2COND[block->jmp_type];
+    if (True == next) {
+        // the condition codes come in pairs, the odd one is the negation
+        True = False;
+        False = next;
+        cond ^= 1;
     }
+    int count = 0;
+    insns[count++] = (QbnAmd64Insn) {QBN_AMD64_JCC, 8, cond, .dst = qbn_amd64_label(fn, True)};
+    if (False != next) {
+        insns[count++] = (QbnAmd64Insn) {QBN_AMD64_JMP, 8, .dst = qbn_amd64_label(fn, False)};
+    }
+    return count;
 }
 
-void qbn_emit_fn(QbnFn* fn, FILE* file) {
-    if (fn->context->current_section != QBN_SEC_TEXT) {
-        fn->context->current_section = QBN_SEC_TEXT;
-        fprintf(file, ".text\n");
+void qbn_emit_jumps(QbnFn* fn, QbnBlock* block, QbnBlock* next, QbnOutBuf* out) {
+    QbnAmd64Insn insns[MAX(QBN_AMD64_MAX_EPILOGUE, QBN_AMD64_MAX_JUMPS)];
+    int count;
+    if (QBN_IS_RETURN(block->jmp_type)) {
+        count = qbn_amd64_epilogue(fn, block, insns);
+    } else {
+        count = qbn_amd64_jumps(fn, block, next, insns);
     }
-    if (fn->export) {
-        fprintf(file, ".globl %s\n", fn->name);
+    for (int i=0; i<count; i++) {
+        qbn_emit_amd64_insn(fn->context, &insns[i], out);
     }
-    fprintf(file, "%s:\n", fn->name);
-    qbn_fprintf_indent(file, "pushq %%rbp\n");
-    qbn_fprintf_indent(file, "movq %%rsp, %%rbp\n", fn->name);
-    fn->frame_size = qbn_frame_size(fn);
-    if (fn->frame_size) {
-        qbn_fprintf_indent(file, "subq $%lu, %%rsp\n", fn->frame_size);
+}
+
+void qbn_emit_block(QbnFn* fn, QbnBlock* block, QbnOutBuf* out) {
+    QbnAmd64Insn insn;
+    for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+        if (qbn_amd64_select(fn, instr, &insn)) {
+            qbn_emit_amd64_insn(fn->context, &insn, out);
+        }
+    }
+}
+
+void qbn_emit_fn_body(QbnFn* fn, QbnOutBuf* out) {
+    const char* name = qbn_symbol_name(fn->context, fn->name);
+    qbn_emit_label(out, name, fn->export);
+    QbnAmd64Insn prologue[QBN_AMD64_MAX_PROLOGUE];
+    int count = qbn_amd64_prologue(fn, prologue);
+    for (int i=0; i<count; i++) {
+        qbn_emit_amd64_insn(fn->context, &prologue[i], out);
     }
     // TODO: varargs
     // push registers? callee saved registers probably
 
-    for (int i=0; i<fn->vec_blocks->length; i++) {
-        qbn_emit_block(fn, fn->blocks[i], file);
-        assert(fn->blocks[i]->jmp_type != QBN_JUMP_NONE);
-        if (QBN_IS_RETURN(fn->blocks[i]->jmp_type)) {
-            qbn_emit_return(file, fn->blocks[i]);
-        } else {
-            // TODO: jumps
-            QBN_NOT_IMPLEMENTED
+    QbnCfg* cfg = qbn_fn_cfg(fn);
+    size_t n_blocks = fn->vec_blocks->length;
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        if (cfg->rpo_index[i] == QBN_CFG_NONE) {
+            // unreachable, laid out last
+            continue;
+        }
+        if (cfg->first_pred[i] != cfg->first_pred[i+1]) {
+            qbn_outbuf_write(out, ".L", 2);
+            qbn_outbuf_str(out, name);
+            qbn_outbuf_char(out, '.');
+            qbn_outbuf_long(out, i);
+            qbn_outbuf_write(out, ":\n", 2);
         }
+        qbn_emit_block(fn, block, out);
+        assert(block->jmp_type != QBN_JUMP_NONE);
+        qbn_emit_jumps(fn, block, i + 1 < n_blocks ? fn->blocks[i+1] : NULL, out);
     }
-    fprintf(file, "\n");
+    qbn_outbuf_char(out, '\n');
 }
 
-void qbn_emit(QbnContext* context, FILE* file) {
-    context->current_section = QBN_SEC_NONE;
-    context->data_iterator = context->data;
-    for (int i=0; i<context->data_count; i++) {
-        qbn_emit_data(context, file);
+void qbn_emit_fn(QbnFn* fn, QbnOutBuf* out) {
+    if (fn->context->current_section != QBN_SEC_TEXT) {
+        fn->context->current_section = QBN_SEC_TEXT;
+        qbn_outbuf_str(out, QBN_SECTION2GAS[QBN_SEC_TEXT]);
     }
+    if (fn->gas != NULL) {
+        // rendered by qbn_process_parallel
+        qbn_outbuf_write(out, fn->gas, fn->gas_length);
+    } else {
+        qbn_emit_fn_body(fn, out);
+    }
+}
+
+void qbn_emit_buffer(QbnContext* context, QbnOutBuf* out) {
+    // appends the assembly to out, a zeroed QbnOutBuf collects all of it in memory
+    context->current_section = QBN_SEC_NONE;
+    qbn_emit_data_sections(context, out);
     for (int i=0; i<context->vec_functions->length; i++) {
-        qbn_emit_fn(context->functions[i], file);
+        qbn_emit_fn(context->functions[i], out);
     }
-    fprintf(file, ".section .note.GNU-stack,\"\",@progbits\n");
+    qbn_outbuf_str(out, ".section .note.GNU-stack,\"\",@progbits\n");
+}
+
+void qbn_emit(QbnContext* context, FILE* file) {
+    QbnOutBuf out;
+    qbn_outbuf_init(&out, file);
+    qbn_emit_buffer(context, &out);
+    qbn_outbuf_free(&out);
 }
 
 #endif //QBN_PROCESSING_H
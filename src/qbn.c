@@ -1,22 +1,39 @@
 #include "qbn.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "util/process.h"
 #include "processing.h"
 #include "print.h"
+#include "encode.h"
+#include "object.h"
+#include "jit.h"
+#include "parallel.h"
+#include "stream.h"
 
 
-static void write_to_file(QbnContext* context, const char* file_name) {
+static FILE* open_file(const char* file_name) {
     FILE* file = fopen(file_name, "w");
     if (!file) {
         int err = errno;
         fprintf(stderr, "Could not open %s with qbn_error %d\n", file_name, err);
         exit(1);
     }
+    return file;
+}
+
+static void write_to_file(QbnContext* context, const char* file_name) {
+    FILE* file = open_file(file_name);
     qbn_emit(context, file);
     fclose(file);
 }
 
+static void write_object_to_file(QbnContext* context, const char* file_name) {
+    FILE* file = open_file(file_name);
+    qbn_emit_object(context, file);
+    fclose(file);
+}
+
 static QbnContext* set_up_hello() {
     QbnContext* context = qbn_context_new();
     QbnRef s = qbn_data_new_cstring(context, "s", "Hello, world!\\n", false);
@@ -66,6 +83,397 @@ static QbnContext* set_up_test2() {
     return context;
 }
 
+static QbnContext* set_up_loop() {
+    // loop(n) sums i * i for i < n, s and i are assigned in two blocks and get phis
+    QbnContext* context = qbn_context_new();
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "loop", true);
+    QbnRef n = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnRef s = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef i = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef square = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef more = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block_start = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_COPY, qbn_context_new_const_number(context, 0), QBN_REF0, s, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_COPY, qbn_context_new_const_number(context, 0), QBN_REF0, i, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_loop = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, i, i, square, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, s, square, s, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, i, qbn_context_new_const_number(context, 1), i, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CSLTL, i, n, more, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_end = qbn_fn_new_block(fn);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_jump(fn, block_start, QBN_JUMP_UNCONDITIONAL, block_loop, NULL);
+    qbn_fn_block_jnz(fn, block_loop, more, block_loop, block_end);
+    qbn_fn_block_return(fn, block_end, QBN_BTYPE_I64, s);
+    return context;
+}
+
+static long reference_loop(long n) {
+    long s = 0;
+    for (long i=0; i<n; i++) {
+        s += i * i;
+    }
+    return s;
+}
+
+static QbnContext* set_up_swap() {
+    // swap(n) calls rotate(n, n + 1, n + 2), which passes its parameters on as digits(b, c, a)
+    QbnContext* context = qbn_context_new();
+    QbnFn* fn_digits = qbn_context_new_fn(context, QBN_BTYPE_I64, "digits", false);
+    QbnRef x = qbn_fn_add_parameter(fn_digits, QBN_BTYPE_I64);
+    QbnRef y = qbn_fn_add_parameter(fn_digits, QBN_BTYPE_I64);
+    QbnRef z = qbn_fn_add_parameter(fn_digits, QBN_BTYPE_I64);
+    QbnBlock* block_digits = qbn_fn_new_block(fn_digits);
+    qbn_fn_add_instr(fn_digits, QBN_OP_MUL, x, qbn_context_new_const_number(context, 100), x, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_digits, QBN_OP_MUL, y, qbn_context_new_const_number(context, 10), y, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_digits, QBN_OP_ADD, x, y, x, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_digits, QBN_OP_ADD, x, z, x, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn_digits);
+    qbn_fn_block_return(fn_digits, block_digits, QBN_BTYPE_I64, x);
+
+    QbnFn* fn_rotate = qbn_context_new_fn(context, QBN_BTYPE_I64, "rotate", false);
+    QbnRef a = qbn_fn_add_parameter(fn_rotate, QBN_BTYPE_I64);
+    QbnRef b = qbn_fn_add_parameter(fn_rotate, QBN_BTYPE_I64);
+    QbnRef c = qbn_fn_add_parameter(fn_rotate, QBN_BTYPE_I64);
+    QbnRef rotated = qbn_fn_new_temp(fn_rotate, QBN_BTYPE_I64);
+    QbnBlock* block_rotate = qbn_fn_new_block(fn_rotate);
+    qbn_fn_add_instr(fn_rotate, QBN_OP_ARG, b, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_rotate, QBN_OP_ARG, c, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_rotate, QBN_OP_ARG, a, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_rotate, QBN_OP_CALL, qbn_context_new_name_ref(context, "digits"), QBN_REF0, rotated, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn_rotate);
+    qbn_fn_block_return(fn_rotate, block_rotate, QBN_BTYPE_I64, rotated);
+
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "swap", true);
+    QbnRef n = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnRef n1 = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef n2 = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef result = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, n, qbn_context_new_const_number(context, 1), n1, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, n, qbn_context_new_const_number(context, 2), n2, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, n, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, n1, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, n2, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, "rotate"), QBN_REF0, result, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_return(fn, block, QBN_BTYPE_I64, result);
+    return context;
+}
+
+static long reference_swap(long n) {
+    return 100 * (n + 1) + 10 * (n + 2) + n;
+}
+
+#define SPILL_VALUES 12
+
+static QbnContext* set_up_spill() {
+    // spill(a) keeps more values alive across two calls of mix than there are callee saved registers
+    QbnContext* context = qbn_context_new();
+    QbnFn* fn_mix = qbn_context_new_fn(context, QBN_BTYPE_I64, "mix", false);
+    QbnRef x = qbn_fn_add_parameter(fn_mix, QBN_BTYPE_I64);
+    QbnRef y = qbn_fn_add_parameter(fn_mix, QBN_BTYPE_I64);
+    QbnBlock* block_mix = qbn_fn_new_block(fn_mix);
+    qbn_fn_add_instr(fn_mix, QBN_OP_MUL, x, qbn_context_new_const_number(context, 31), x, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn_mix, QBN_OP_ADD, x, y, x, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn_mix);
+    qbn_fn_block_return(fn_mix, block_mix, QBN_BTYPE_I64, x);
+
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "spill", true);
+    QbnRef a = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnRef values[SPILL_VALUES];
+    QbnRef mixed = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block = qbn_fn_new_block(fn);
+    for (int i=0; i<SPILL_VALUES; i++) {
+        values[i] = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+        qbn_fn_add_instr(fn, QBN_OP_MUL, a, qbn_context_new_const_number(context, i + 1), values[i], QBN_BTYPE_I64);
+        qbn_fn_add_instr(fn, QBN_OP_ADD, values[i], qbn_context_new_const_number(context, i), values[i], QBN_BTYPE_I64);
+    }
+    qbn_fn_add_instr(fn, QBN_OP_ARG, values[0], QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, values[1], QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, "mix"), QBN_REF0, mixed, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, mixed, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, values[2], QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, "mix"), QBN_REF0, mixed, QBN_BTYPE_I64);
+    for (int i=0; i<SPILL_VALUES; i++) {
+        qbn_fn_add_instr(fn, QBN_OP_ADD, mixed, values[i], mixed, QBN_BTYPE_I64);
+    }
+    qbn_fn_close_block(fn);
+    qbn_fn_block_return(fn, block, QBN_BTYPE_I64, mixed);
+    return context;
+}
+
+static long reference_spill(long a) {
+    long values[SPILL_VALUES];
+    for (int i=0; i<SPILL_VALUES; i++) {
+        values[i] = a * (i + 1) + i;
+    }
+    long mixed = (values[0] * 31 + values[1]) * 31 + values[2];
+    for (int i=0; i<SPILL_VALUES; i++) {
+        mixed += values[i];
+    }
+    return mixed;
+}
+
+static QbnContext* set_up_fold() {
+    // fold(x) = x ? x + 6 * 7 : 0, the product is folded, the dead product and the copy go away and the zero
+    // is set with xor
+    QbnContext* context = qbn_context_new();
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "fold", true);
+    QbnRef x = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnRef k = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef dead = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef y = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef result = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, qbn_context_new_const_number(context, 6), qbn_context_new_const_number(context, 7), k, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, x, k, dead, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, x, k, y, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_COPY, y, QBN_REF0, result, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_sum = qbn_fn_new_block(fn);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_zero = qbn_fn_new_block(fn);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_jnz(fn, block, x, block_sum, block_zero);
+    qbn_fn_block_return(fn, block_sum, QBN_BTYPE_I64, result);
+    qbn_fn_block_return(fn, block_zero, QBN_BTYPE_I64, qbn_context_new_const_number(context, 0));
+    return context;
+}
+
+static long reference_fold(long x) {
+    return x ? x + 42 : 0;
+}
+
+static QbnContext* set_up_alloc() {
+    // alloc(n) fills a stack buffer of n longs allocated at runtime and adds the first, the last and the misalignment
+    QbnContext* context = qbn_context_new();
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "alloc", true);
+    QbnRef n = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnRef size = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef buffer = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef i = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef address = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef value = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef more = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef first = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef last = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef misaligned = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block_start = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, n, qbn_context_new_const_number(context, 8), size, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ALLOC8, size, QBN_REF0, buffer, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_COPY, qbn_context_new_const_number(context, 0), QBN_REF0, i, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_fill = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, i, qbn_context_new_const_number(context, 8), address, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, buffer, address, address, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, i, qbn_context_new_const_number(context, 3), value, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_STOREL, value, address, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, i, qbn_context_new_const_number(context, 1), i, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CSLTL, i, n, more, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_end = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_LOAD, buffer, QBN_REF0, first, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_LOAD, address, QBN_REF0, last, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_AND, buffer, qbn_context_new_const_number(context, 7), misaligned, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, first, last, first, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, first, misaligned, first, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_jump(fn, block_start, QBN_JUMP_UNCONDITIONAL, block_fill, NULL);
+    qbn_fn_block_jnz(fn, block_fill, more, block_fill, block_end);
+    qbn_fn_block_return(fn, block_end, QBN_BTYPE_I64, first);
+    return context;
+}
+
+static long reference_alloc(long n) {
+    return 3 * (n - 1);
+}
+
+#define CHAIN_LENGTH 16
+
+static QbnContext* set_up_chain() {
+    // chain(x) calls step15, which calls step14 and so on, many small functions to process in parallel
+    QbnContext* context = qbn_context_new();
+    char name[16];
+    for (int k=0; k<CHAIN_LENGTH; k++) {
+        snprintf(name, sizeof(name), "step%d", k);
+        QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, name, false);
+        QbnRef x = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+        QbnBlock* block = qbn_fn_new_block(fn);
+        if (k > 0) {
+            snprintf(name, sizeof(name), "step%d", k - 1);
+            qbn_fn_add_instr(fn, QBN_OP_ARG, x, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+            qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, name), QBN_REF0, x, QBN_BTYPE_I64);
+            qbn_fn_add_instr(fn, QBN_OP_MUL, x, qbn_context_new_const_number(context, 3), x, QBN_BTYPE_I64);
+            qbn_fn_add_instr(fn, QBN_OP_ADD, x, qbn_context_new_const_number(context, k), x, QBN_BTYPE_I64);
+        }
+        qbn_fn_close_block(fn);
+        qbn_fn_block_return(fn, block, QBN_BTYPE_I64, x);
+    }
+
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "chain", true);
+    QbnRef x = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnBlock* block = qbn_fn_new_block(fn);
+    snprintf(name, sizeof(name), "step%d", CHAIN_LENGTH - 1);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, x, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, name), QBN_REF0, x, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_return(fn, block, QBN_BTYPE_I64, x);
+    return context;
+}
+
+static long reference_chain(long x) {
+    for (int k=1; k<CHAIN_LENGTH; k++) {
+        x = x * 3 + k;
+    }
+    return x;
+}
+
+#define TABLE_LENGTH 8
+
+static QbnContext* set_up_table() {
+    // table(n) adds up n entries of a read only table into a zeroed total, which land in .rodata and .bss
+    static const long primes[TABLE_LENGTH] = {2, 3, 5, 7, 11, 13, 17, 19};
+    QbnContext* context = qbn_context_new();
+    qbn_data_new_readonly(context, "primes", false);
+    for (int i=0; i<TABLE_LENGTH; i++) {
+        qbn_data_add_item(context, (QbnDataItem){.type = QBN_DATA_CONSTANT, .value.number = {.ext_type = QBN_TYPE_I64, .value.i = primes[i]}});
+    }
+    qbn_data_new(context, "total", false);
+    qbn_data_add_item(context, (QbnDataItem){.type = QBN_DATA_ZERO, .value.zero_length = 8});
+    QbnRef table = qbn_context_new_data_ref(context, "primes");
+    QbnRef total = qbn_context_new_data_ref(context, "total");
+
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "table", true);
+    QbnRef n = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnRef address = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef entry = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnRef sum = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block_loop = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_SUB, n, qbn_context_new_const_number(context, 1), n, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_AND, n, qbn_context_new_const_number(context, TABLE_LENGTH - 1), address, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_MUL, address, qbn_context_new_const_number(context, 8), address, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, table, address, address, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_LOAD, address, QBN_REF0, entry, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_LOAD, total, QBN_REF0, sum, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ADD, sum, entry, sum, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_STOREL, sum, total, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    QbnBlock* block_end = qbn_fn_new_block(fn);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_jnz(fn, block_loop, n, block_loop, block_end);
+    qbn_fn_block_return(fn, block_end, QBN_BTYPE_I64, sum);
+    return context;
+}
+
+static long reference_table(long n) {
+    static const long primes[TABLE_LENGTH] = {2, 3, 5, 7, 11, 13, 17, 19};
+    long total = 0;
+    for (long i=0; i<n; i++) {
+        total += primes[i % TABLE_LENGTH];
+    }
+    return total;
+}
+
+static void add_print_main(QbnContext* context, const char* name, long arg) {
+    // main prints what name returns for arg, so the linked executable can be checked
+    QbnRef format = qbn_data_new_cstring(context, "format", "%ld\\n", false);
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I32, "main", true);
+    QbnRef result = qbn_fn_new_temp(fn, QBN_BTYPE_I64);
+    QbnBlock* block = qbn_fn_new_block(fn);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, qbn_context_new_const_number(context, arg), QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, name), QBN_REF0, result, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, format, QBN_REF0, QBN_REF0, context->size_type);
+    qbn_fn_add_instr(fn, QBN_OP_ARG, result, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+    qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, "printf"), QBN_REF0, QBN_REF0, 0);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_return(fn, block, QBN_BTYPE_I32, qbn_context_new_const_number(context, 0));
+}
+
+static QbnContext* set_up_stream(QbnOutBuf* out, long arg) {
+    // stream(x) = twice(twice(x)) + 1, each function is written to out when it is finished, NULL builds them
+    // for qbn_process instead
+    QbnContext* context = qbn_context_new();
+    if (out != NULL) {
+        qbn_stream_begin(context, out);
+    }
+    QbnFn* fn_twice = qbn_context_new_fn(context, QBN_BTYPE_I64, "twice", false);
+    QbnRef x = qbn_fn_add_parameter(fn_twice, QBN_BTYPE_I64);
+    QbnBlock* block_twice = qbn_fn_new_block(fn_twice);
+    qbn_fn_add_instr(fn_twice, QBN_OP_ADD, x, x, x, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn_twice);
+    qbn_fn_block_return(fn_twice, block_twice, QBN_BTYPE_I64, x);
+    if (out != NULL) {
+        qbn_fn_finish(fn_twice);
+    }
+
+    QbnFn* fn = qbn_context_new_fn(context, QBN_BTYPE_I64, "stream", true);
+    QbnRef y = qbn_fn_add_parameter(fn, QBN_BTYPE_I64);
+    QbnBlock* block = qbn_fn_new_block(fn);
+    for (int i=0; i<2; i++) {
+        qbn_fn_add_instr(fn, QBN_OP_ARG, y, QBN_REF0, QBN_REF0, QBN_BTYPE_I64);
+        qbn_fn_add_instr(fn, QBN_OP_CALL, qbn_context_new_name_ref(context, "twice"), QBN_REF0, y, QBN_BTYPE_I64);
+    }
+    qbn_fn_add_instr(fn, QBN_OP_ADD, y, qbn_context_new_const_number(context, 1), y, QBN_BTYPE_I64);
+    qbn_fn_close_block(fn);
+    qbn_fn_block_return(fn, block, QBN_BTYPE_I64, y);
+    if (out != NULL) {
+        qbn_fn_finish(fn);
+        add_print_main(context, "stream", arg);
+        qbn_fn_finish(context->functions[0]);
+        qbn_stream_end(context);
+    }
+    return context;
+}
+
+static long reference_stream(long x) {
+    return 4 * x + 1;
+}
+
+static long run_executable(const char* input_path) {
+    // links input_path with gcc, runs it and reads back the number main prints
+    char* exe_path = "../out";
+    char cmd[256];
+    snprintf(cmd, 256, "gcc -o %s %s", exe_path, input_path);
+    int status = system(cmd);
+    if (status) {
+        printf("gcc -> %d\n", status);
+        return -1;
+    }
+    long result = -1;
+    FILE* pipe = popen(exe_path, "r");
+    if (!pipe || fscanf(pipe, "%ld", &result) != 1) {
+        printf("%s printed nothing\n", exe_path);
+    }
+    if (pipe) {
+        pclose(pipe);
+    }
+    return result;
+}
+
+static bool check_example(const char* name, QbnContext* (*set_up)(), long (*reference)(long), long arg) {
+    // compiles the example twice: in this process and as an object linked by gcc, processed in parallel
+    QbnContext* jit_context = set_up();
+    qbn_jit_compile(jit_context);
+    long (*jit_fn)(long) = (long (*)(long)) qbn_jit_lookup(jit_context, name);
+    long jit_result = jit_fn(arg);
+    qbn_jit_free(jit_context);
+
+    QbnContext* context = set_up();
+    add_print_main(context, name, arg);
+    qbn_process_parallel(context, 4, QBN_RENDER_OBJECT);
+    char* obj_path = "../out.o";
+    write_object_to_file(context, obj_path);
+    long linked_result = run_executable(obj_path);
+
+    long want = reference(arg);
+    bool ok = jit_result == want && linked_result == want;
+    printf("%-8s jit %ld, gcc %ld, c %ld -> %s\n", name, jit_result, linked_result, want, ok ? "ok" : "wrong");
+    return ok;
+}
+
 void run_example() {
     //QbnContext* context = set_up_test();
     QbnContext* context = set_up_hello();
@@ -78,11 +486,13 @@ void run_example() {
 
     char* asm_path = "../out.s";
     write_to_file(context, asm_path);
+    char* obj_path = "../out.o";
+    write_object_to_file(context, obj_path);
 
-    // run gcc
+    // link with gcc, no assembler needed
     char* exe_path = "../out";
     char cmd[256];
-    snprintf(cmd, 256, "gcc -pipe -x assembler -o %s %s", exe_path, asm_path);
+    snprintf(cmd, 256, "gcc -o %s %s", exe_path, obj_path);
     int status = system(cmd);
 
     // run executable
@@ -93,4 +503,51 @@ void run_example() {
     } else {
         printf("gcc -> %d\n", status);
     }
+
+    // same program again, compiled and run in this process
+    struct timespec start, end;
+    QbnContext* jit_context = set_up_hello();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    qbn_jit_compile(jit_context);
+    int (*jit_main)() = (int (*)()) qbn_jit_lookup(jit_context, "main");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    status = jit_main();
+    fflush(stdout);
+    printf("jit -> %d (compiled in %ld us)\n", status,
+           (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    // a reset drops the image, a name interned afterwards must not find the old code
+    qbn_context_reset(jit_context);
+    qbn_context_new_name_ref(jit_context, "other");
+    printf("jit after reset -> %s\n", qbn_jit_lookup(jit_context, "other") == NULL ? "ok" : "stale");
+    qbn_jit_free(jit_context);
+
+    // each example against its C reference
+    int n_wrong = 0;
+    n_wrong += !check_example("loop", set_up_loop, reference_loop, 10);
+    n_wrong += !check_example("swap", set_up_swap, reference_swap, 3);
+    n_wrong += !check_example("spill", set_up_spill, reference_spill, 7);
+    n_wrong += !check_example("fold", set_up_fold, reference_fold, 5);
+    n_wrong += !check_example("alloc", set_up_alloc, reference_alloc, 10);
+    n_wrong += !check_example("chain", set_up_chain, reference_chain, 2);
+    n_wrong += !check_example("table", set_up_table, reference_table, 11);
+
+    // streamed assembly goes through the assembler, the same functions built whole go through the jit
+    QbnContext* stream_jit_context = set_up_stream(NULL, 0);
+    qbn_jit_compile(stream_jit_context);
+    long (*stream_fn)(long) = (long (*)(long)) qbn_jit_lookup(stream_jit_context, "stream");
+    long stream_jit_result = stream_fn(6);
+    qbn_jit_free(stream_jit_context);
+    FILE* stream_file = open_file(asm_path);
+    QbnOutBuf stream_out;
+    qbn_outbuf_init(&stream_out, stream_file);
+    set_up_stream(&stream_out, 6);
+    qbn_outbuf_free(&stream_out);
+    fclose(stream_file);
+    long stream_linked_result = run_executable(asm_path);
+    bool stream_ok = stream_jit_result == reference_stream(6) && stream_linked_result == reference_stream(6);
+    printf("%-8s jit %ld, gcc %ld, c %ld -> %s\n", "stream", stream_jit_result, stream_linked_result, reference_stream(6),
+           stream_ok ? "ok" : "wrong");
+    n_wrong += !stream_ok;
+    printf("examples wrong: %d\n", n_wrong);
 }
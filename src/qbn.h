@@ -5,12 +5,14 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "op.h"
 #include "limits.h"
 #include "util/vector.h"
+#include "outbuf.h"
 
-void qbn_error(char* msg) {
+_Noreturn void qbn_error(char* msg) {
     fprintf(stderr, "%s\n", msg);
     exit(1);
 }
@@ -19,14 +21,22 @@ void qbn_error(char* msg) {
 #define QBN_NOT_IMPLEMENTED qbn_error("Work in progress!\n");
 
 typedef unsigned long QbnRef;
+typedef unsigned int QbnSymbol;  // interned name, see qbn_context_intern
 typedef struct QbnDataItem QbnDataItem;
+typedef struct QbnDataDef QbnDataDef;
 typedef struct QbnTemp QbnTemp;
+typedef struct QbnMem QbnMem;
 typedef struct QbnConst QbnConst;
 typedef struct QbnPhi QbnPhi;
 typedef struct QbnInstr QbnInstr;
+typedef struct QbnInstrChunk QbnInstrChunk;
+typedef struct QbnNameChunk QbnNameChunk;
 typedef struct QbnBlock QbnBlock;
 typedef struct QbnFn QbnFn;
 typedef struct QbnContext QbnContext;
+typedef struct QbnJit QbnJit;
+typedef struct QbnObject QbnObject;
+typedef struct QbnCfg QbnCfg;
 
 typedef enum {
     QBN_JUMP_NONE = 0,
@@ -59,7 +69,7 @@ typedef enum {
 #define QBN_IS_RETURN(jmp_type) ((jmp_type) != QBN_JUMP_NONE && (jmp_type) < QBN_JUMP_RET_END)
 
 typedef enum {
-    QBN_SEC_NONE, QBN_SEC_DATA, QBN_SEC_TEXT
+    QBN_SEC_NONE, QBN_SEC_DATA, QBN_SEC_TEXT, QBN_SEC_RODATA, QBN_SEC_BSS, QBN_SEC_COUNT
 } QbnSection;
 
 typedef enum {
@@ -67,6 +77,8 @@ typedef enum {
     QBN_REF_REG,
     QBN_REF_TEMP,
     QBN_REF_CONST,
+    QBN_REF_SLOT,  // stack slot of a spilled temp, assigned by the register allocator
+    QBN_REF_MEM,   // memory operand in the function's mems, see qbn_amd64_fold_addresses
 } QbnRefType;
 
 // QbnRef
@@ -79,17 +91,14 @@ typedef enum {
 #define QBN_TEMP_REF(index) QBN_REF_INDEX_SET(QBN_REF_TYPE_SET(0, QBN_REF_TEMP), (index))
 #define QBN_CONST_REF(index) QBN_REF_INDEX_SET(QBN_REF_TYPE_SET(0, QBN_REF_CONST), (index))
 #define QBN_REG_REF(reg) QBN_REF_INDEX_SET(QBN_REF_TYPE_SET(0, QBN_REF_REG), (reg))
+#define QBN_SLOT_REF(index) QBN_REF_INDEX_SET(QBN_REF_TYPE_SET(0, QBN_REF_SLOT), (index))
+#define QBN_MEM_REF(index) QBN_REF_INDEX_SET(QBN_REF_TYPE_SET(0, QBN_REF_MEM), (index))
 
 struct QbnDataItem {
     union {
-        struct {
-            const char* name;
-            char export;  // bool in union is bad
-        } start;
-
         struct {
             // TODO: maybe refactor to QbnRef? ref_type checking needed then
-            const char* name;
+            QbnSymbol name;
             long offset;
             QbnType ext_type;
         } global_ref;
@@ -106,39 +115,61 @@ struct QbnDataItem {
         long align_length;
         long zero_length;
         const char* string;
-        QbnDataItem* next;
     } value;
 
     enum {
-        QBN_DATA_START,
         QBN_DATA_ALIGN,        // for opaque types
         QBN_DATA_ZERO,         // zero init
         QBN_DATA_REF_DATA,
         QBN_DATA_REF_FUNC,
         QBN_DATA_STRING,
         QBN_DATA_CONSTANT,
-        QBN_DATA_END,           // absolute end of data list
-        QBN_DATA_NEXT_VEC_BLOCK
     } type;
 };
 
+struct QbnDataDef {
+    QbnSymbol name;
+    bool export;
+    QbnSection section;  // QBN_SEC_RODATA if read only, QBN_SEC_BSS as long as every item is zero, QBN_SEC_DATA otherwise
+    unsigned int first;  // the items are contiguous in the context's data_items
+    unsigned int n_items;
+};
+
+typedef struct {
+    QbnInstrChunk* first;  // chunks linked with OP_NEXT_CHUNK in their last slot
+    QbnInstrChunk* chunk;  // the chunk current points into
+    QbnInstr* current;     // always writable, never the link slot
+} QbnInstrArena;
+
 struct QbnFn {
     QbnContext* context;
     QbnBaseType return_type;
-    char* name;
+    QbnSymbol name;
     UtilVector* vec_params;
-    QbnTemp** params;
+    QbnRef* params;  // temps
     UtilVector* vec_temps;
     QbnTemp* temps;
+    UtilVector* vec_mems;
+    QbnMem* mems;
     UtilVector* vec_blocks;
     QbnBlock** blocks;
+    QbnCfg* cfg;  // cached by qbn_fn_cfg, NULL when out of date
     int rega_n_float_args;
     int rega_n_int_args;
-    int rega_n_float_regs_used;
-    int rega_n_int_regs_used;
+    unsigned long rega_used;  // QBN_REG_BIT of every register a temp was assigned to
+    int rega_n_spill_slots;
+    unsigned long rega_alloc_bytes;  // memory of ALLOC instructions, below the spill slots
+    bool rega_dynamic_alloc;  // an ALLOC of a size known only at runtime moves rsp
+    unsigned long* rega_call_saved;  // per call in block order, QBN_REG_BIT of the caller saved registers live across it
     unsigned long frame_size;
+    bool frame_pointer;  // rbp based frame, leaf functions without stack slots go without
     unsigned char stack_alignment;
     bool export;
+    QbnInstrArena lowered;  // instructions after lowering, blocks point here once processed
+    char* gas;              // assembly and machine code rendered by qbn_process_parallel, if asked for
+    size_t gas_length;
+    QbnObject* code;
+    unsigned int* peephole_hits;  // rewrites per pattern, see qbn_amd64_peephole
 };
 
 struct QbnInstr {
@@ -149,7 +180,79 @@ struct QbnInstr {
     QbnBaseType type;
 };
 
+struct QbnInstrChunk {
+    QbnInstrChunk* next;
+    size_t capacity;
+    QbnInstr instr[];
+};
+
+// the link slot's arg0 holds the first instruction of the next chunk
+#define QBN_INSTR_LINK(instr) ((QbnInstr*) (instr)->arg0)
+
+QbnInstr* qbn_instr_next(QbnInstr* instr) {
+    // instructions of a block are contiguous except where a chunk ends
+    instr++;
+    if (instr->op == QBN_OP_NEXT_CHUNK) {
+        instr = QBN_INSTR_LINK(instr);
+    }
+    return instr;
+}
+
+QbnInstrChunk* qbn_instr_chunk_new(size_t capacity) {
+    QbnInstrChunk* chunk = malloc(sizeof(QbnInstrChunk) + capacity * sizeof(QbnInstr));
+    if (!chunk) {
+        util_vector_no_memory();
+    }
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+void qbn_instr_arena_init(QbnInstrArena* arena, size_t capacity) {
+    arena->first = qbn_instr_chunk_new(capacity);
+    arena->chunk = arena->first;
+    arena->current = arena->first->instr;
+}
+
+QbnInstr* qbn_instr_arena_add(QbnInstrArena* arena, QbnInstr instr) {
+    // instructions never move, chunks grow up to QBN_LIMIT_INSTR_CHUNK
+    QbnInstr* added = arena->current;
+    *added = instr;
+    arena->current++;
+    QbnInstrChunk* chunk = arena->chunk;
+    if (arena->current == &chunk->instr[chunk->capacity-1]) {
+        // chunks kept by qbn_instr_arena_reset are filled again
+        if (chunk->next == NULL) {
+            chunk->next = qbn_instr_chunk_new(MIN(chunk->capacity * 2, QBN_LIMIT_INSTR_CHUNK));
+        }
+        *arena->current = (QbnInstr) {.op = QBN_OP_NEXT_CHUNK, .arg0 = (QbnRef) chunk->next->instr};
+        arena->chunk = chunk->next;
+        arena->current = chunk->next->instr;
+    }
+    return added;
+}
+
+void qbn_instr_arena_reset(QbnInstrArena* arena) {
+    // keeps every chunk, they are filled again in order
+    arena->chunk = arena->first;
+    arena->current = arena->first->instr;
+}
+
+void qbn_instr_arena_free(QbnInstrArena* arena) {
+    QbnInstrChunk* chunk = arena->first->next;
+    while (chunk != NULL) {
+        QbnInstrChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena->first);
+    arena->first = NULL;
+    arena->chunk = NULL;
+    arena->current = NULL;
+}
+
 struct QbnBlock {
+    unsigned int id;  // index in the function's blocks
     QbnPhi* phi;
     QbnInstr* instr;
     QbnJumpType jmp_type;
@@ -157,6 +260,7 @@ struct QbnBlock {
         struct {
             QbnBlock* True;
             QbnBlock* False;
+            QbnRef cond;  // QBN_JUMP_NZ
         } dest;
         struct {
             QbnBaseType type;
@@ -166,7 +270,12 @@ struct QbnBlock {
 };
 
 struct QbnPhi {
-
+    QbnRef to;
+    QbnBaseType type;
+    unsigned int n_args;
+    QbnRef* args;
+    QbnBlock** blocks;  // the predecessor each argument comes from
+    QbnPhi* next;
 };
 
 struct QbnTemp {
@@ -174,6 +283,13 @@ struct QbnTemp {
     QbnRef slot;  // TODO either a register or slot on stack
 };
 
+struct QbnMem {
+    QbnRef base;   // temp or register, or a global address without index
+    QbnRef index;  // temp or register, QBN_REF0 if none
+    unsigned char scale;
+    int disp;
+};
+
 struct QbnConst {
     enum {
         QBN_CONST_NUMBER,
@@ -186,26 +302,48 @@ struct QbnConst {
         long number;
         float f32;
         double f64;
-        const char* label;
+        QbnSymbol label;
     } value;
 };
 
+struct QbnNameChunk {
+    QbnNameChunk* next;
+    size_t length;
+    size_t capacity;
+    char chars[];
+};
+
 struct QbnContext {
     QbnType size_type;
     QbnSection current_section;
     bool data_is_aligned;
-    QbnInstr* instr_cache;
-    QbnInstr* current_instr;
-    QbnDataItem* data;  // blocks of 32 linked with each other with DATA_NEXT_VEC_BLOCK
-    QbnDataItem* data_end;
-    QbnDataItem* data_iterator;  // the current data item to read from
-    int data_count;
+    QbnInstrArena instrs;  // instructions as added through the api
+    bool is_processed;
+    UtilVector* vec_data_defs;  // in definition order, written out grouped by section
+    QbnDataDef* data_defs;
+    UtilVector* vec_data_items;
+    QbnDataItem* data_items;
     UtilVector* vec_functions;
     QbnFn** functions;
-    UtilVector* vec_consts;
-    QbnConst* consts;
+    QbnConst** const_chunks;  // QBN_LIMIT_CONST_CHUNKS chunks of QBN_LIMIT_CONST_CHUNK, constants never move
+    unsigned int const_count;
+    unsigned int* const_table;  // open addressing, index+1 of every constant or 0, equal constants are shared
+    unsigned int const_table_capacity;
+    pthread_mutex_t const_lock;  // constants may be added by functions processed in parallel
+    QbnNameChunk* names;      // interned names, they never move
+    UtilVector* vec_symbols;  // name of every symbol id
+    const char** symbols;
+    unsigned int* symbol_table;  // open addressing, id+1 of every symbol or 0
+    unsigned int symbol_table_capacity;
+    QbnJit* jit;  // in-process compiled image, see jit.h
+    QbnOutBuf* stream;  // assembly output of functions finished with qbn_fn_finish, see stream.h
+    UtilArena arena;  // functions, blocks and their vectors, given up at once by qbn_context_reset
 };
 
+// data definitions are written out in this order of sections
+const QbnSection QBN_DATA_SECTIONS[] = {QBN_SEC_DATA, QBN_SEC_RODATA, QBN_SEC_BSS};
+#define QBN_N_DATA_SECTIONS 3
+
 const char* qbn_type2s[] = {
         [QBN_TYPE_I32] = "i32",
         [QBN_TYPE_I64] = "i64",
@@ -225,26 +363,182 @@ void qbn_print_all(FILE* file, QbnContext* context, char* hint);
 QbnInstr* qbn_block_last_instr(QbnBlock* block) {
     // returns the block's last instruction which should be empty
     QbnInstr* instr = block->instr;
+    QbnInstr* last = NULL;
     while (instr->op != QBN_OP_BLOCK_END) {
-        instr++;
+        last = instr;
+        instr = qbn_instr_next(instr);
     }
-    instr--;
     // TODO: remove
-    assert(instr > block->instr);
-    return instr;
+    assert(last != NULL);
+    return last;
+}
+
+#define QBN_CONST(context, index) \
+    (&(context)->const_chunks[(index) / QBN_LIMIT_CONST_CHUNK][(index) % QBN_LIMIT_CONST_CHUNK])
+
+#define QBN_HASH_SEED 14695981039346656037UL
+
+unsigned long qbn_hash(unsigned long hash, const void* bytes, size_t count) {
+    // fnv-1a
+    for (size_t i=0; i<count; i++) {
+        hash = (hash ^ ((const unsigned char*) bytes)[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+unsigned long qbn_const_hash(QbnConst* con) {
+    // type and the value's bits, labels are symbol ids
+    unsigned long hash = qbn_hash(QBN_HASH_SEED, &con->type, sizeof(con->type));
+    switch (con->type) {
+        case QBN_CONST_GLOBAL_ADDR:
+        case QBN_CONST_NAME:
+            return qbn_hash(hash, &con->value.label, sizeof(QbnSymbol));
+        case QBN_CONST_F32:
+            return qbn_hash(hash, &con->value.f32, sizeof(float));
+        default:
+            return qbn_hash(hash, &con->value, sizeof(long));
+    }
+}
+
+bool qbn_const_equal(QbnConst* a, QbnConst* b) {
+    // floats are compared by their bits, 0.0 and -0.0 stay different constants
+    if (a->type != b->type) {
+        return false;
+    }
+    switch (a->type) {
+        case QBN_CONST_GLOBAL_ADDR:
+        case QBN_CONST_NAME:
+            return a->value.label == b->value.label;
+        case QBN_CONST_F32:
+            return memcmp(&a->value.f32, &b->value.f32, sizeof(float)) == 0;
+        default:
+            return memcmp(&a->value, &b->value, sizeof(long)) == 0;
+    }
+}
+
+unsigned int* qbn_context_const_slot(QbnContext* context, QbnConst* con) {
+    // the slot holding an equal constant or the empty slot to insert it
+    unsigned int mask = context->const_table_capacity - 1;
+    unsigned int slot = (unsigned int) qbn_const_hash(con) & mask;
+    while (context->const_table[slot] != 0 &&
+           !qbn_const_equal(QBN_CONST(context, context->const_table[slot] - 1), con)) {
+        slot = (slot + 1) & mask;
+    }
+    return &context->const_table[slot];
+}
+
+void qbn_context_grow_const_table(QbnContext* context) {
+    free(context->const_table);
+    context->const_table_capacity *= 2;
+    context->const_table = calloc(context->const_table_capacity, sizeof(unsigned int));
+    if (!context->const_table) {
+        util_vector_no_memory();
+    }
+    for (unsigned int i=0; i<context->const_count; i++) {
+        *qbn_context_const_slot(context, QBN_CONST(context, i)) = i + 1;
+    }
 }
 
 unsigned int qbn_context_add_const(QbnContext* context, QbnConst con) {
-    size_t i = context->vec_consts->length;
-    util_vector_grow(context->vec_consts, 1);
-    context->consts[i] = con;
-    return (unsigned int) i;
+    // returns the index of an equal constant if there is one, constants must not be changed afterwards
+    pthread_mutex_lock(&context->const_lock);
+    unsigned int* slot = qbn_context_const_slot(context, &con);
+    if (*slot != 0) {
+        pthread_mutex_unlock(&context->const_lock);
+        return *slot - 1;
+    }
+    unsigned int i = context->const_count;
+    if (i / QBN_LIMIT_CONST_CHUNK >= QBN_LIMIT_CONST_CHUNKS) {
+        qbn_error("Too many constants");
+    }
+    QbnConst** chunk = &context->const_chunks[i / QBN_LIMIT_CONST_CHUNK];
+    if (*chunk == NULL) {
+        *chunk = malloc(sizeof(QbnConst) * QBN_LIMIT_CONST_CHUNK);
+    }
+    (*chunk)[i % QBN_LIMIT_CONST_CHUNK] = con;
+    context->const_count++;
+    *slot = i + 1;
+    if (context->const_count * 2 > context->const_table_capacity) {
+        qbn_context_grow_const_table(context);
+    }
+    pthread_mutex_unlock(&context->const_lock);
+    return i;
+}
+
+char* qbn_context_copy_name(QbnContext* context, const char* name) {
+    size_t size = strlen(name) + 1;
+    QbnNameChunk* chunk = context->names;
+    if (chunk == NULL || chunk->length + size > chunk->capacity) {
+        size_t capacity = MAX(size, QBN_LIMIT_NAME_CHUNK);
+        chunk = malloc(sizeof(QbnNameChunk) + capacity);
+        if (!chunk) {
+            util_vector_no_memory();
+        }
+        chunk->next = context->names;
+        chunk->length = 0;
+        chunk->capacity = capacity;
+        context->names = chunk;
+    }
+    char* copy = chunk->chars + chunk->length;
+    memcpy(copy, name, size);
+    chunk->length += size;
+    return copy;
+}
+
+unsigned int* qbn_context_symbol_slot(QbnContext* context, const char* name) {
+    // the slot holding the name's symbol or the empty slot to insert it
+    unsigned int mask = context->symbol_table_capacity - 1;
+    unsigned int slot = (unsigned int) qbn_hash(QBN_HASH_SEED, name, strlen(name)) & mask;
+    while (context->symbol_table[slot] != 0 && strcmp(context->symbols[context->symbol_table[slot] - 1], name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &context->symbol_table[slot];
+}
+
+QbnSymbol qbn_context_intern(QbnContext* context, const char* name) {
+    // the context keeps its own copy, equal names get the same id
+    // names are interned while the ir is built, not while it is processed
+    unsigned int* slot = qbn_context_symbol_slot(context, name);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    QbnSymbol symbol = context->vec_symbols->length;
+    util_vector_grow(context->vec_symbols, 1);
+    context->symbols[symbol] = qbn_context_copy_name(context, name);
+    *slot = symbol + 1;
+    if (context->vec_symbols->length * 2 > context->symbol_table_capacity) {
+        free(context->symbol_table);
+        context->symbol_table_capacity *= 2;
+        context->symbol_table = calloc(context->symbol_table_capacity, sizeof(unsigned int));
+        if (!context->symbol_table) {
+            util_vector_no_memory();
+        }
+        for (QbnSymbol i=0; i<context->vec_symbols->length; i++) {
+            *qbn_context_symbol_slot(context, context->symbols[i]) = i + 1;
+        }
+    }
+    return symbol;
+}
+
+bool qbn_context_find_symbol(QbnContext* context, const char* name, QbnSymbol* symbol) {
+    unsigned int* slot = qbn_context_symbol_slot(context, name);
+    if (*slot == 0) {
+        return false;
+    }
+    *symbol = *slot - 1;
+    return true;
+}
+
+const char* qbn_symbol_name(QbnContext* context, QbnSymbol symbol) {
+    assert(symbol < context->vec_symbols->length);
+    return context->symbols[symbol];
 }
 
 QbnRef qbn_context_new_label(QbnContext* context, const char* label, int const_type) {
     // constant containing a string label that
     // may or may not refer to another object (data, function, ...)
-    unsigned int index = qbn_context_add_const(context, (QbnConst) {.type = const_type, .value.label = label});
+    QbnSymbol symbol = qbn_context_intern(context, label);
+    unsigned int index = qbn_context_add_const(context, (QbnConst) {.type = const_type, .value.label = symbol});
     return QBN_REF_TYPE_SET(QBN_REF_INDEX_SET(QBN_REF0, index), QBN_REF_CONST);
 }
 
@@ -261,61 +555,63 @@ QbnRef qbn_context_new_const_number(QbnContext* context, long number) {
     return QBN_REF_TYPE_SET(QBN_REF_INDEX_SET(QBN_REF0, index), QBN_REF_CONST);
 }
 
-void qbn_data_next_block(QbnContext* context) {
-    assert(context->data_end == NULL || context->data_end->type == QBN_DATA_NEXT_VEC_BLOCK);
-    QbnDataItem* block = malloc(sizeof(QbnDataItem) * QBN_LIMIT_DATA_BLOCK);
-    for (int i=0; i<QBN_LIMIT_DATA_BLOCK-1; i++) {
-        block[i].type = QBN_DATA_END;
-    }
-    block[QBN_LIMIT_DATA_BLOCK-1].type = QBN_DATA_NEXT_VEC_BLOCK;
-    block[QBN_LIMIT_DATA_BLOCK-1].value.next = NULL;
-    if (context->data_end != NULL) {
-        context->data_end->value.next = block;
-    } else {
-        context->data = block;
+void qbn_data_add_item(QbnContext* context, QbnDataItem item) {
+    // appends to the data definition started last
+    assert(context->vec_data_defs->length > 0);
+    QbnDataDef* def = &context->data_defs[context->vec_data_defs->length - 1];
+    bool is_zero = item.type == QBN_DATA_ALIGN || item.type == QBN_DATA_ZERO;
+    if (def->section == QBN_SEC_BSS && !is_zero) {
+        def->section = QBN_SEC_DATA;
     }
-    context->data_end = block;
+    util_vector_grow(context->vec_data_items, 1);
+    context->data_items[context->vec_data_items->length - 1] = item;
+    def->n_items++;
 }
 
-void qbn_data_add_item(QbnContext* context, QbnDataItem item) {
-    if (context->data_end->type == QBN_DATA_NEXT_VEC_BLOCK) {
-        qbn_data_next_block(context);
-    }
-    *context->data_end = item;
-    context->data_end++;
+void qbn_data_new_in(QbnContext* context, const char* name, char export, bool readonly) {
+    util_vector_grow(context->vec_data_defs, 1);
+    context->data_defs[context->vec_data_defs->length - 1] = (QbnDataDef) {
+            .name = qbn_context_intern(context, name),
+            .export = export,
+            .section = readonly ? QBN_SEC_RODATA : QBN_SEC_BSS,
+            .first = context->vec_data_items->length,
+            .n_items = 0
+    };
 }
 
 void qbn_data_new(QbnContext* context, const char* name, char export) {
-    context->data_count++;
-    qbn_data_add_item(context, (QbnDataItem){.value.start = {name, export}, .type = QBN_DATA_START});
+    qbn_data_new_in(context, name, export, false);
+}
+
+void qbn_data_new_readonly(QbnContext* context, const char* name, char export) {
+    // placed in .rodata, writing to it faults
+    qbn_data_new_in(context, name, export, true);
 }
 
 QbnRef qbn_data_new_cstring(QbnContext* context, const char* name, const char* string, char export) {
-    qbn_data_new(context, name, export);
+    // read only like a string literal
+    qbn_data_new_readonly(context, name, export);
     qbn_data_add_item(context, (QbnDataItem){.type = QBN_DATA_STRING, .value.string = string});
     qbn_data_add_item(context, (QbnDataItem){.type = QBN_DATA_CONSTANT, .value.number = {.ext_type = QBN_TYPE_I8, .value.i = 0}});
     return qbn_context_new_data_ref(context, name);
 }
 
 void qbn_context_add_instr(QbnContext* context, QbnOp op, QbnRef arg0, QbnRef arg1, QbnRef to, QbnBaseType type) {
-    *context->current_instr = (QbnInstr) {
+    qbn_instr_arena_add(&context->instrs, (QbnInstr) {
             .to = to,
             .type = type,
             .op = op,
             .arg0 = arg0,
             .arg1 = arg1
-    };
-    context->current_instr++;
+    });
 }
 
 void qbn_context_copy_instr(QbnContext* context, QbnInstr instr) {
-    *context->current_instr = instr;
-    context->current_instr++;
+    qbn_instr_arena_add(&context->instrs, instr);
 }
 
 void qbn_context_block_end(QbnContext* context) {
-    context->current_instr->op = QBN_OP_BLOCK_END;
-    context->current_instr++;
+    qbn_instr_arena_add(&context->instrs, (QbnInstr) {.op = QBN_OP_BLOCK_END});
 }
 
 void qbn_fn_add_instr(QbnFn* fn, QbnOp op, QbnRef arg0, QbnRef arg1, QbnRef to, QbnBaseType type) {
@@ -332,18 +628,49 @@ QbnRef qbn_fn_new_temp(QbnFn* fn, QbnExtType type) {
     return QBN_TEMP_REF(index);
 }
 
+QbnRef qbn_fn_new_mem(QbnFn* fn, QbnMem mem) {
+    util_vector_grow(fn->vec_mems, 1);
+    fn->mems[fn->vec_mems->length - 1] = mem;
+    return QBN_MEM_REF(fn->vec_mems->length - 1);
+}
+
+#define QBN_INSTR_MAX_USES 6
+
+int qbn_instr_uses(QbnFn* fn, QbnInstr* instr, QbnRef* uses) {
+    // fills the refs the instruction reads and returns their count, memory operands are read through their
+    // base and index
+    QbnRef refs[3] = {instr->arg0, instr->arg1, QBN_REF_TYPE(instr->to) == QBN_REF_MEM ? instr->to : QBN_REF0};
+    int count = 0;
+    for (int i=0; i<3; i++) {
+        if (QBN_REF_TYPE(refs[i]) == QBN_REF_MEM) {
+            QbnMem* mem = &fn->mems[QBN_REF_INDEX(refs[i])];
+            uses[count++] = mem->base;
+            if (mem->index != QBN_REF0) {
+                uses[count++] = mem->index;
+            }
+        } else if (refs[i] != QBN_REF0) {
+            uses[count++] = refs[i];
+        }
+    }
+    return count;
+}
+
 QbnRef qbn_fn_add_parameter(QbnFn* fn, QbnBaseType type) {
     QbnRef temp = qbn_fn_new_temp(fn, type);
     util_vector_grow(fn->vec_params, 1);
-    fn->params[fn->vec_params->length-1] = &fn->temps[QBN_REF_INDEX(temp)];
+    fn->params[fn->vec_params->length-1] = temp;
     return temp;
 }
 
+void qbn_fn_invalidate_cfg(QbnFn* fn);  // cfg.h
+
 QbnBlock* qbn_fn_new_block(QbnFn* fn) {
-    QbnBlock* block = malloc(sizeof(QbnBlock));
-    block->instr = fn->context->current_instr;
+    QbnBlock* block = util_arena_alloc(&fn->context->arena, sizeof(QbnBlock));
+    block->instr = fn->context->instrs.current;
     block->phi = NULL;
     block->jmp_type = QBN_JUMP_NONE;
+    block->id = fn->vec_blocks->length;
+    qbn_fn_invalidate_cfg(fn);
     util_vector_grow(fn->vec_blocks, 1);
     fn->blocks[fn->vec_blocks->length-1] = block;
     return block;
@@ -354,35 +681,61 @@ void qbn_fn_close_block(QbnFn* fn) {
 }
 
 void qbn_fn_block_jump(QbnFn* fn, QbnBlock* block, QbnJumpType jump_type, QbnBlock* True, QbnBlock* False) {
+    qbn_fn_invalidate_cfg(fn);
     block->jmp_type = jump_type;
     assert(!QBN_IS_RETURN(jump_type));
+    assert(jump_type != QBN_JUMP_NZ);  // qbn_fn_block_jnz
     assert(jump_type == QBN_JUMP_UNCONDITIONAL || False);
     block->jmp.dest.True = True;
     block->jmp.dest.False = False;
+    block->jmp.dest.cond = QBN_REF0;
+}
+
+void qbn_fn_block_jnz(QbnFn* fn, QbnBlock* block, QbnRef cond, QbnBlock* True, QbnBlock* False) {
+    // jumps to True if cond is not zero, to False otherwise
+    qbn_fn_invalidate_cfg(fn);
+    assert(True && False);
+    block->jmp_type = QBN_JUMP_NZ;
+    block->jmp.dest.True = True;
+    block->jmp.dest.False = False;
+    block->jmp.dest.cond = cond;
 }
 
 void qbn_fn_block_return(QbnFn* fn, QbnBlock* block, QbnBaseType type, QbnRef value) {
+    qbn_fn_invalidate_cfg(fn);
     block->jmp_type = (value != QBN_REF0) ? QBN_JUMP_RET_BASE : QBN_JUMP_RET_NONE;
     block->jmp.ret.type = type;
     block->jmp.ret.value = value;
 }
 
-QbnFn* qbn_context_new_fn(QbnContext* context, QbnBaseType return_type, char* name, bool export) {
-    QbnFn* fn = malloc(sizeof(QbnFn));
+QbnFn* qbn_context_new_fn(QbnContext* context, QbnBaseType return_type, const char* name, bool export) {
+    QbnFn* fn = util_arena_alloc(&context->arena, sizeof(QbnFn));
     fn->context = context;
     fn->export = export;
     fn->return_type = return_type;
-    fn->name = name;
-    fn->vec_params = util_vector_new(sizeof(QbnTemp*), 8, (void**) &fn->params);
-    fn->vec_temps = util_vector_new(sizeof(QbnTemp), 0, (void**) &fn->temps);
-    fn->vec_blocks = util_vector_new(sizeof(QbnBlock*), 20, (void**) &fn->blocks);
+    fn->name = qbn_context_intern(context, name);
+    fn->vec_params = util_vector_new_in(&context->arena, sizeof(QbnRef), 8, (void**) &fn->params);
+    fn->vec_temps = util_vector_new_in(&context->arena, sizeof(QbnTemp), 0, (void**) &fn->temps);
+    fn->vec_mems = util_vector_new_in(&context->arena, sizeof(QbnMem), 0, (void**) &fn->mems);
+    fn->vec_blocks = util_vector_new_in(&context->arena, sizeof(QbnBlock*), 20, (void**) &fn->blocks);
+    fn->cfg = NULL;
     util_vector_grow(context->vec_functions, 1);
     context->functions[context->vec_functions->length-1] = fn;
     qbn_fn_close_block(fn);
     fn->rega_n_int_args = 0;
     fn->rega_n_float_args = 0;
-    fn->rega_n_int_regs_used = 0;
-    fn->rega_n_float_regs_used = 0;
+    fn->rega_used = 0;
+    fn->rega_n_spill_slots = 0;
+    fn->rega_alloc_bytes = 0;
+    fn->rega_dynamic_alloc = false;
+    fn->rega_call_saved = NULL;
+    fn->frame_size = 0;
+    fn->frame_pointer = true;
+    fn->lowered.first = NULL;
+    fn->gas = NULL;
+    fn->gas_length = 0;
+    fn->code = NULL;
+    fn->peephole_hits = NULL;
     return fn;
 }
 
@@ -391,43 +744,72 @@ QbnContext* qbn_context_new() {
     context->size_type = QBN_TYPE_I64;
     context->current_section = QBN_SEC_NONE;
     context->data_is_aligned = false;
-    context->instr_cache = malloc(sizeof(QbnInstr) * QBN_LIMIT_INSTR_CACHE);
-    context->current_instr = context->instr_cache;
-    context->data = NULL;
-    context->data_end = NULL;
-    context->data_count = 0;
-    qbn_data_next_block(context);
+    qbn_instr_arena_init(&context->instrs, QBN_LIMIT_INSTR_CHUNK);
+    context->is_processed = false;
+    context->vec_data_defs = util_vector_new(sizeof(QbnDataDef), 0, (void**) &context->data_defs);
+    context->vec_data_items = util_vector_new(sizeof(QbnDataItem), 0, (void**) &context->data_items);
     context->vec_functions = util_vector_new(sizeof(QbnFn*), 20, (void**) &context->functions);
-    context->vec_consts = util_vector_new(sizeof(QbnConst), 0, (void**) &context->consts);
+    context->const_chunks = calloc(QBN_LIMIT_CONST_CHUNKS, sizeof(QbnConst*));
+    context->const_count = 0;
+    context->const_table_capacity = QBN_LIMIT_CONST_TABLE;
+    context->const_table = calloc(QBN_LIMIT_CONST_TABLE, sizeof(unsigned int));
+    pthread_mutex_init(&context->const_lock, NULL);
+    context->names = NULL;
+    context->vec_symbols = util_vector_new(sizeof(const char*), 0, (void**) &context->symbols);
+    context->symbol_table_capacity = QBN_LIMIT_SYMBOL_TABLE;
+    context->symbol_table = calloc(QBN_LIMIT_SYMBOL_TABLE, sizeof(unsigned int));
+    context->jit = NULL;
+    context->stream = NULL;
+    util_arena_init(&context->arena);
     return context;
 }
 
+void qbn_object_free(QbnObject* obj);  // object.h
+void qbn_jit_release(QbnJit* jit);  // jit.h
+
+void qbn_fn_release(QbnFn* fn) {
+    // frees what processing attached to the function, the function itself lives in the context's arena
+    if (fn->lowered.first != NULL) {
+        qbn_instr_arena_free(&fn->lowered);
+    }
+    qbn_fn_invalidate_cfg(fn);
+    free(fn->gas);
+    if (fn->code != NULL) {
+        qbn_object_free(fn->code);
+    }
+    free(fn->peephole_hits);
+    free(fn->rega_call_saved);
+}
+
 void qbn_context_reset(QbnContext* context) {
     context->current_section = QBN_SEC_NONE;
     context->data_is_aligned = false;
-    context->current_instr = context->instr_cache;
-
-    QbnDataItem* block = context->data;
-    QbnDataItem* current_data_item = context->data;
-    while (current_data_item != context->data_end) {
-        if (current_data_item->type == QBN_DATA_NEXT_VEC_BLOCK) {
-            current_data_item = current_data_item->value.next;
-            free(block);
-            block = current_data_item;
-        } else {
-            current_data_item++;
-        }
+    context->is_processed = false;
+    context->stream = NULL;
+    qbn_instr_arena_reset(&context->instrs);
+    // the compiled image refers to the functions and names of the module, symbols added by the user stay
+    if (context->jit != NULL) {
+        qbn_jit_release(context->jit);
     }
-    context->data = NULL;
-    context->data_end = NULL;
-    context->data_count = 0;
-    qbn_data_next_block(context);
+
+    util_vector_clear(context->vec_data_defs);
+    util_vector_clear(context->vec_data_items);
 
     for (int i=0; i<context->vec_functions->length; i++) {
-        free(context->functions[i]);
+        qbn_fn_release(context->functions[i]);
     }
     util_vector_clear(context->vec_functions);
-    util_vector_clear(context->vec_consts);
+    util_arena_reset(&context->arena);
+    context->const_count = 0;
+    memset(context->const_table, 0, context->const_table_capacity * sizeof(unsigned int));
+
+    while (context->names != NULL) {
+        QbnNameChunk* next = context->names->next;
+        free(context->names);
+        context->names = next;
+    }
+    util_vector_clear(context->vec_symbols);
+    memset(context->symbol_table, 0, context->symbol_table_capacity * sizeof(unsigned int));
 }
 
 #endif //QBN_QBN_H
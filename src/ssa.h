@@ -0,0 +1,624 @@
+
+#ifndef QBN_SSA_H
+#define QBN_SSA_H
+
+#include <assert.h>
+#include "qbn.h"
+#include "cfg.h"
+#include "liveness.h"
+
+// SSA construction after Braun et al., "Simple and Efficient Construction of Static Single Assignment Form".
+// Temps that are assigned more than once get a fresh temp per definition, a use reads the definition that
+// reaches it and blocks with several predecessors get phis. A block is sealed once all of its predecessors
+// are filled, until then reads put operandless phis into it that are completed when sealing.
+// Phis that merge a single value are removed at the end.
+
+typedef struct {
+    unsigned int block;
+    unsigned int var;
+    QbnRef value;
+} QbnSsaDef;
+
+typedef struct {
+    QbnFn* fn;
+    unsigned int* var_of;       // temp index -> var+1 for temps that get renamed, including their new temps
+    QbnRef* var_temp;           // var -> the original temp, used for reads without a definition
+    size_t n_temps;             // entries in var_of
+    QbnSsaDef* defs;            // current definition of a var at the end of a block, open addressing
+    size_t defs_capacity;
+    size_t defs_count;
+    QbnCfg* cfg;
+    unsigned int* n_filled_preds;
+    bool* sealed;
+} QbnSsaBuilder;
+
+QbnRef qbn_ssa_read(QbnSsaBuilder* ssa, unsigned int var, QbnBlock* block);
+
+unsigned int qbn_ssa_var(QbnSsaBuilder* ssa, QbnRef ref) {
+    // var+1, 0 if the ref is not renamed
+    if (QBN_REF_TYPE(ref) != QBN_REF_TEMP || QBN_REF_INDEX(ref) >= ssa->n_temps) {
+        return 0;
+    }
+    return ssa->var_of[QBN_REF_INDEX(ref)];
+}
+
+QbnSsaDef* qbn_ssa_def_slot(QbnSsaBuilder* ssa, unsigned int block, unsigned int var) {
+    unsigned int hash = qbn_hash(qbn_hash(QBN_HASH_SEED, &block, sizeof(block)), &var, sizeof(var));
+    size_t mask = ssa->defs_capacity - 1;
+    size_t i = hash & mask;
+    while (ssa->defs[i].value != QBN_REF0 && (ssa->defs[i].block != block || ssa->defs[i].var != var)) {
+        i = (i + 1) & mask;
+    }
+    return &ssa->defs[i];
+}
+
+void qbn_ssa_write(QbnSsaBuilder* ssa, unsigned int var, QbnBlock* block, QbnRef value) {
+    if (2 * (ssa->defs_count + 1) > ssa->defs_capacity) {
+        QbnSsaDef* old = ssa->defs;
+        size_t old_capacity = ssa->defs_capacity;
+        ssa->defs_capacity *= 2;
+        ssa->defs = calloc(ssa->defs_capacity, sizeof(QbnSsaDef));
+        if (!ssa->defs) {
+            util_vector_no_memory();
+        }
+        for (size_t i=0; i<old_capacity; i++) {
+            if (old[i].value != QBN_REF0) {
+                *qbn_ssa_def_slot(ssa, old[i].block, old[i].var) = old[i];
+            }
+        }
+        free(old);
+    }
+    QbnSsaDef* def = qbn_ssa_def_slot(ssa, block->id, var);
+    if (def->value == QBN_REF0) {
+        ssa->defs_count++;
+    }
+    *def = (QbnSsaDef) {block->id, var, value};
+}
+
+QbnRef qbn_ssa_new_temp(QbnSsaBuilder* ssa, unsigned int var) {
+    QbnRef temp = qbn_fn_new_temp(ssa->fn, ssa->fn->temps[QBN_REF_INDEX(ssa->var_temp[var])].type);
+    if (ssa->fn->vec_temps->length > ssa->n_temps) {
+        size_t n_temps = ssa->fn->vec_temps->length + ssa->fn->vec_temps->length / 2;
+        ssa->var_of = realloc(ssa->var_of, sizeof(unsigned int) * n_temps);
+        if (!ssa->var_of) {
+            util_vector_no_memory();
+        }
+        memset(ssa->var_of + ssa->n_temps, 0, sizeof(unsigned int) * (n_temps - ssa->n_temps));
+        ssa->n_temps = n_temps;
+    }
+    ssa->var_of[QBN_REF_INDEX(temp)] = var + 1;
+    return temp;
+}
+
+void qbn_ssa_phi_operands(QbnSsaBuilder* ssa, QbnPhi* phi, QbnBlock* block) {
+    unsigned int var = qbn_ssa_var(ssa, phi->to) - 1;
+    unsigned int first = ssa->cfg->first_pred[block->id];
+    phi->n_args = ssa->cfg->first_pred[block->id + 1] - first;
+    phi->args = malloc(sizeof(QbnRef) * phi->n_args);
+    phi->blocks = malloc(sizeof(QbnBlock*) * phi->n_args);
+    if (!phi->args || !phi->blocks) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<phi->n_args; i++) {
+        phi->blocks[i] = ssa->fn->blocks[ssa->cfg->preds[first + i]];
+        phi->args[i] = qbn_ssa_read(ssa, var, phi->blocks[i]);
+    }
+}
+
+QbnPhi* qbn_ssa_new_phi(QbnSsaBuilder* ssa, unsigned int var, QbnBlock* block) {
+    QbnPhi* phi = malloc(sizeof(QbnPhi));
+    if (!phi) {
+        util_vector_no_memory();
+    }
+    phi->to = qbn_ssa_new_temp(ssa, var);
+    phi->type = (QbnBaseType) ssa->fn->temps[QBN_REF_INDEX(phi->to)].type;
+    phi->n_args = 0;
+    phi->args = NULL;
+    phi->blocks = NULL;
+    phi->next = block->phi;
+    block->phi = phi;
+    return phi;
+}
+
+QbnRef qbn_ssa_read(QbnSsaBuilder* ssa, unsigned int var, QbnBlock* block) {
+    QbnSsaDef* def = qbn_ssa_def_slot(ssa, block->id, var);
+    if (def->value != QBN_REF0) {
+        return def->value;
+    }
+    QbnRef value;
+    unsigned int first = ssa->cfg->first_pred[block->id];
+    unsigned int n_preds = ssa->cfg->first_pred[block->id + 1] - first;
+    if (!ssa->sealed[block->id]) {
+        // operands follow when the block is sealed
+        value = qbn_ssa_new_phi(ssa, var, block)->to;
+    } else if (n_preds == 0) {
+        // parameters, or read before any definition
+        value = ssa->var_temp[var];
+    } else if (n_preds == 1) {
+        value = qbn_ssa_read(ssa, var, ssa->fn->blocks[ssa->cfg->preds[first]]);
+    } else {
+        // the phi is the definition while its operands are read, that ends cycles
+        QbnPhi* phi = qbn_ssa_new_phi(ssa, var, block);
+        qbn_ssa_write(ssa, var, block, phi->to);
+        qbn_ssa_phi_operands(ssa, phi, block);
+        value = phi->to;
+    }
+    qbn_ssa_write(ssa, var, block, value);
+    return value;
+}
+
+void qbn_ssa_seal(QbnSsaBuilder* ssa, QbnBlock* block) {
+    ssa->sealed[block->id] = true;
+    for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+        if (phi->args == NULL) {
+            qbn_ssa_phi_operands(ssa, phi, block);
+        }
+    }
+}
+
+void qbn_ssa_use(QbnSsaBuilder* ssa, QbnBlock* block, QbnRef* ref) {
+    unsigned int var = qbn_ssa_var(ssa, *ref);
+    if (var) {
+        *ref = qbn_ssa_read(ssa, var - 1, block);
+    }
+}
+
+void qbn_ssa_fill(QbnSsaBuilder* ssa, QbnBlock* block) {
+    for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+        if (instr->op == QBN_OP0) {
+            continue;
+        }
+        qbn_ssa_use(ssa, block, &instr->arg0);
+        qbn_ssa_use(ssa, block, &instr->arg1);
+        unsigned int var = qbn_ssa_var(ssa, instr->to);
+        if (var) {
+            instr->to = qbn_ssa_new_temp(ssa, var - 1);
+            qbn_ssa_write(ssa, var - 1, block, instr->to);
+        }
+    }
+    if (block->jmp_type == QBN_JUMP_RET_BASE) {
+        qbn_ssa_use(ssa, block, &block->jmp.ret.value);
+    } else if (block->jmp_type == QBN_JUMP_NZ) {
+        qbn_ssa_use(ssa, block, &block->jmp.dest.cond);
+    }
+
+    QbnBlock* successors[2];
+    int n_successors = qbn_block_successors(block, successors);
+    for (int s=0; s<n_successors; s++) {
+        unsigned int id = successors[s]->id;
+        ssa->n_filled_preds[id]++;
+        if (ssa->n_filled_preds[id] == ssa->cfg->first_pred[id + 1] - ssa->cfg->first_pred[id]) {
+            qbn_ssa_seal(ssa, successors[s]);
+        }
+    }
+}
+
+QbnRef qbn_ssa_resolve(QbnRef* replace, QbnRef ref) {
+    while (QBN_REF_TYPE(ref) == QBN_REF_TEMP && replace[QBN_REF_INDEX(ref)] != QBN_REF0) {
+        ref = replace[QBN_REF_INDEX(ref)];
+    }
+    return ref;
+}
+
+void qbn_ssa_remove_trivial_phis(QbnFn* fn) {
+    // a phi whose operands are all the same value or the phi itself is replaced by that value,
+    // which can make other phis trivial
+    QbnRef* replace = calloc(fn->vec_temps->length + 1, sizeof(QbnRef));
+    if (!replace) {
+        util_vector_no_memory();
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i=0; i<fn->vec_blocks->length; i++) {
+            QbnPhi** link = &fn->blocks[i]->phi;
+            while (*link) {
+                QbnPhi* phi = *link;
+                QbnRef same = QBN_REF0;
+                bool trivial = true;
+                for (int a=0; a<phi->n_args; a++) {
+                    phi->args[a] = qbn_ssa_resolve(replace, phi->args[a]);
+                    if (phi->args[a] == same || phi->args[a] == phi->to) {
+                        continue;
+                    }
+                    if (same != QBN_REF0) {
+                        trivial = false;
+                    }
+                    same = phi->args[a];
+                }
+                if (!trivial || same == QBN_REF0) {
+                    // an unreachable loop without a definition keeps its phi
+                    link = &phi->next;
+                    continue;
+                }
+                replace[QBN_REF_INDEX(phi->to)] = same;
+                *link = phi->next;
+                free(phi->args);
+                free(phi->blocks);
+                free(phi);
+                changed = true;
+            }
+        }
+    }
+    for (int i=0; i<fn->vec_blocks->length; i++) {
+        QbnBlock* block = fn->blocks[i];
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            instr->arg0 = qbn_ssa_resolve(replace, instr->arg0);
+            instr->arg1 = qbn_ssa_resolve(replace, instr->arg1);
+        }
+        if (block->jmp_type == QBN_JUMP_RET_BASE) {
+            block->jmp.ret.value = qbn_ssa_resolve(replace, block->jmp.ret.value);
+        } else if (block->jmp_type == QBN_JUMP_NZ) {
+            block->jmp.dest.cond = qbn_ssa_resolve(replace, block->jmp.dest.cond);
+        }
+        for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+            for (int a=0; a<phi->n_args; a++) {
+                phi->args[a] = qbn_ssa_resolve(replace, phi->args[a]);
+            }
+        }
+    }
+    free(replace);
+}
+
+void qbn_ssa_construct(QbnFn* fn) {
+    // rewrites the instructions as added through the api, before lowering
+    size_t n_temps = fn->vec_temps->length;
+    size_t n_blocks = fn->vec_blocks->length;
+    unsigned int* n_defs = calloc(n_temps + 1, sizeof(unsigned int));
+    if (!n_defs) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<fn->vec_params->length; i++) {
+        n_defs[QBN_REF_INDEX(fn->params[i])]++;
+    }
+    for (int i=0; i<n_blocks; i++) {
+        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP0 && QBN_REF_TYPE(instr->to) == QBN_REF_TEMP) {
+                n_defs[QBN_REF_INDEX(instr->to)]++;
+            }
+        }
+    }
+
+    QbnSsaBuilder ssa = {.fn = fn, .n_temps = n_temps + 1};
+    ssa.var_of = calloc(ssa.n_temps, sizeof(unsigned int));
+    ssa.var_temp = malloc(sizeof(QbnRef) * (n_temps + 1));
+    if (!ssa.var_of || !ssa.var_temp) {
+        util_vector_no_memory();
+    }
+    unsigned int n_vars = 0;
+    for (int i=0; i<n_temps; i++) {
+        if (n_defs[i] > 1) {
+            ssa.var_temp[n_vars] = QBN_TEMP_REF(i);
+            n_vars++;
+            ssa.var_of[i] = n_vars;
+        }
+    }
+    free(n_defs);
+    if (n_vars == 0) {
+        // already in ssa form
+        free(ssa.var_of);
+        free(ssa.var_temp);
+        return;
+    }
+
+    // phis in the first block need an operand for the function entry
+    qbn_fn_split_entry(fn);
+    n_blocks = fn->vec_blocks->length;
+    ssa.defs_capacity = 64;
+    ssa.defs = calloc(ssa.defs_capacity, sizeof(QbnSsaDef));
+    ssa.n_filled_preds = calloc(n_blocks + 1, sizeof(unsigned int));
+    ssa.sealed = calloc(n_blocks + 1, sizeof(bool));
+    if (!ssa.defs || !ssa.n_filled_preds || !ssa.sealed) {
+        util_vector_no_memory();
+    }
+    ssa.cfg = qbn_fn_cfg(fn);
+    for (int i=0; i<n_blocks; i++) {
+        if (ssa.cfg->first_pred[i] == ssa.cfg->first_pred[i+1]) {
+            ssa.sealed[i] = true;
+        }
+    }
+
+    // reverse postorder fills most predecessors before their successors, unreachable blocks come last
+    for (int i=0; i<ssa.cfg->n_reachable; i++) {
+        qbn_ssa_fill(&ssa, fn->blocks[ssa.cfg->order[i]]);
+    }
+    for (int i=0; i<n_blocks; i++) {
+        if (ssa.cfg->rpo_index[i] == QBN_CFG_NONE) {
+            qbn_ssa_fill(&ssa, fn->blocks[i]);
+        }
+    }
+    qbn_ssa_remove_trivial_phis(fn);
+
+    free(ssa.sealed);
+    free(ssa.n_filled_preds);
+    free(ssa.defs);
+    free(ssa.var_temp);
+    free(ssa.var_of);
+}
+
+void qbn_ssa_add_copy(QbnFn* fn, QbnRef from, QbnRef to, QbnBaseType type) {
+    qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_COPY, .type = type, .arg0 = from, .to = to});
+}
+
+void qbn_ssa_destruct(QbnFn* fn) {
+    // every phi gets a fresh temp: predecessors copy their operand into it at their end and the phi's block
+    // copies it into the phi's temp at its start. Copies into a fresh temp are harmless on the other edge of
+    // a branch, so critical edges stay as they are, and phis of a block can't overwrite each other's operands.
+    // The rewritten blocks go to the function's lowered instructions, in front of what lowering adds later.
+    size_t n_blocks = fn->vec_blocks->length;
+    bool has_phis = false;
+    for (int i=0; i<n_blocks; i++) {
+        has_phis |= fn->blocks[i]->phi != NULL;
+    }
+    if (!has_phis) {
+        return;
+    }
+    if (fn->lowered.first == NULL) {
+        qbn_instr_arena_init(&fn->lowered, QBN_LIMIT_FN_INSTR_CHUNK);
+    }
+
+    QbnRef** copies = calloc(n_blocks + 1, sizeof(QbnRef*));  // per block, the fresh temp of each phi
+    if (!copies) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_blocks; i++) {
+        int n_phis = 0;
+        for (QbnPhi* phi = fn->blocks[i]->phi; phi; phi = phi->next) {
+            n_phis++;
+        }
+        if (n_phis == 0) {
+            continue;
+        }
+        copies[i] = malloc(sizeof(QbnRef) * n_phis);
+        if (!copies[i]) {
+            util_vector_no_memory();
+        }
+        int p = 0;
+        for (QbnPhi* phi = fn->blocks[i]->phi; phi; phi = phi->next) {
+            copies[i][p++] = qbn_fn_new_temp(fn, fn->temps[QBN_REF_INDEX(phi->to)].type);
+        }
+    }
+
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        QbnBlock* successors[2];
+        int n_successors = qbn_block_successors(block, successors);
+        bool has_copies = block->phi != NULL;
+        for (int s=0; s<n_successors; s++) {
+            has_copies |= successors[s]->phi != NULL;
+        }
+        if (!has_copies) {
+            continue;
+        }
+
+        QbnInstr* instr = block->instr;
+        block->instr = fn->lowered.current;
+        int p = 0;
+        for (QbnPhi* phi = block->phi; phi; phi = phi->next) {
+            qbn_ssa_add_copy(fn, copies[i][p++], phi->to, phi->type);
+        }
+        for (; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP0) {
+                qbn_instr_arena_add(&fn->lowered, *instr);
+            }
+        }
+        for (int s=0; s<n_successors; s++) {
+            p = 0;
+            for (QbnPhi* phi = successors[s]->phi; phi; phi = phi->next) {
+                for (int a=0; a<phi->n_args; a++) {
+                    if (phi->blocks[a] == block) {
+                        qbn_ssa_add_copy(fn, phi->args[a], copies[successors[s]->id][p], phi->type);
+                    }
+                }
+                p++;
+            }
+        }
+        qbn_instr_arena_add(&fn->lowered, (QbnInstr) {.op = QBN_OP_BLOCK_END});
+    }
+
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        while (block->phi) {
+            QbnPhi* phi = block->phi;
+            block->phi = phi->next;
+            free(phi->args);
+            free(phi->blocks);
+            free(phi);
+        }
+        free(copies[i]);
+    }
+    free(copies);
+}
+
+// Coalescing after ssa destruction. A copy between two temps whose lifetimes don't overlap joins them into
+// one temp, the copy then moves the temp into itself and is removed. A temp interferes with another if it
+// is written while the other is live, unless it is written by a copy of the other (Chaitin). Joined temps
+// interfere with more than each of them did, so every temp is joined at most once per round and rounds
+// repeat with fresh liveness until no copy is left to join. Parameters arrive in caller saved registers,
+// they are not joined with temps that live across a call.
+
+typedef struct {
+    unsigned int from;
+    unsigned int to;
+    bool interferes;
+} QbnCoalesceCopy;
+
+bool qbn_ssa_coalesce_round(QbnFn* fn, bool* is_param) {
+    // returns whether a copy was removed
+    size_t n_temps = fn->vec_temps->length;
+    size_t n_blocks = fn->vec_blocks->length;
+    size_t n_copies = 0;
+    size_t max_block_length = 0;
+    for (int i=0; i<n_blocks; i++) {
+        size_t length = 0;
+        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            length++;
+            n_copies += instr->op == QBN_OP_COPY;
+        }
+        max_block_length = MAX(max_block_length, length);
+    }
+    if (n_copies == 0) {
+        return false;
+    }
+
+    // copies between temps of one type, with each temp's copies in first/list like predecessors
+    QbnCoalesceCopy* copies = malloc(sizeof(QbnCoalesceCopy) * n_copies);
+    unsigned int* first = calloc(n_temps + 2, sizeof(unsigned int));
+    unsigned int* list = malloc(sizeof(unsigned int) * (2 * n_copies + 1));
+    bool* merged = calloc(n_temps + 1, sizeof(bool));
+    QbnInstr** instrs = malloc(sizeof(QbnInstr*) * (max_block_length + 1));
+    if (!copies || !first || !list || !merged || !instrs) {
+        util_vector_no_memory();
+    }
+    n_copies = 0;
+    for (int i=0; i<n_blocks; i++) {
+        for (QbnInstr* instr = fn->blocks[i]->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP_COPY || QBN_REF_TYPE(instr->to) != QBN_REF_TEMP ||
+                QBN_REF_TYPE(instr->arg0) != QBN_REF_TEMP || instr->to == instr->arg0) {
+                continue;
+            }
+            unsigned int to = QBN_REF_INDEX(instr->to);
+            unsigned int from = QBN_REF_INDEX(instr->arg0);
+            if (fn->temps[to].type != fn->temps[from].type || (QbnExtType) instr->type != fn->temps[to].type ||
+                (is_param[to] && is_param[from])) {
+                continue;
+            }
+            copies[n_copies++] = (QbnCoalesceCopy) {from, to, false};
+            first[from + 2]++;
+            first[to + 2]++;
+        }
+    }
+    for (int i=2; i<=n_temps; i++) {
+        first[i] += first[i-1];
+    }
+    for (unsigned int c=0; c<n_copies; c++) {
+        list[first[copies[c].from + 1]++] = c;
+        list[first[copies[c].to + 1]++] = c;
+    }
+
+    // backwards through every block from the temps live at its end
+    QbnLiveness live;
+    qbn_liveness_compute(fn, &live);
+    UtilBitsetWord* now = util_bitset_new(live.n_words);
+    for (int i=0; i<n_blocks; i++) {
+        QbnBlock* block = fn->blocks[i];
+        util_bitset_copy(now, QBN_LIVE_SET(&live, out, i), live.n_words);
+        if (block->jmp_type == QBN_JUMP_RET_BASE && QBN_REF_TYPE(block->jmp.ret.value) == QBN_REF_TEMP) {
+            util_bitset_set(now, QBN_REF_INDEX(block->jmp.ret.value));
+        } else if (block->jmp_type == QBN_JUMP_NZ && QBN_REF_TYPE(block->jmp.dest.cond) == QBN_REF_TEMP) {
+            util_bitset_set(now, QBN_REF_INDEX(block->jmp.dest.cond));
+        }
+        int n_instrs = 0;
+        for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+            if (instr->op != QBN_OP0) {
+                instrs[n_instrs++] = instr;
+            }
+        }
+        for (int k=n_instrs-1; k>=0; k--) {
+            QbnInstr* instr = instrs[k];
+            if (QBN_REF_TYPE(instr->to) == QBN_REF_TEMP) {
+                unsigned int def = QBN_REF_INDEX(instr->to);
+                for (unsigned int l=first[def]; l<first[def+1]; l++) {
+                    QbnCoalesceCopy* copy = &copies[list[l]];
+                    unsigned int other = copy->from == def ? copy->to : copy->from;
+                    if (util_bitset_test(now, other) && !(instr->op == QBN_OP_COPY && instr->arg0 == QBN_TEMP_REF(other))) {
+                        copy->interferes = true;
+                    }
+                }
+                util_bitset_unset(now, def);
+            }
+            if (instr->op == QBN_OP_CALL) {
+                for (unsigned int c=0; c<n_copies; c++) {
+                    QbnCoalesceCopy* copy = &copies[c];
+                    if ((is_param[copy->from] && util_bitset_test(now, copy->to)) ||
+                        (is_param[copy->to] && util_bitset_test(now, copy->from))) {
+                        copy->interferes = true;
+                    }
+                }
+            }
+            QbnRef uses[QBN_INSTR_MAX_USES];
+            int n_uses = qbn_instr_uses(fn, instr, uses);
+            for (int u=0; u<n_uses; u++) {
+                if (QBN_REF_TYPE(uses[u]) == QBN_REF_TEMP) {
+                    util_bitset_set(now, QBN_REF_INDEX(uses[u]));
+                }
+            }
+        }
+        if (i == 0) {
+            // parameters are written on entry
+            for (int p=0; p<fn->vec_params->length; p++) {
+                unsigned int param = QBN_REF_INDEX(fn->params[p]);
+                for (unsigned int l=first[param]; l<first[param+1]; l++) {
+                    QbnCoalesceCopy* copy = &copies[list[l]];
+                    copy->interferes |= util_bitset_test(now, copy->from == param ? copy->to : copy->from);
+                }
+            }
+        }
+    }
+    free(now);
+    qbn_liveness_free(&live);
+
+    // a parameter keeps its temp, otherwise the source of the copy does
+    QbnRef* replace = calloc(n_temps + 1, sizeof(QbnRef));
+    if (!replace) {
+        util_vector_no_memory();
+    }
+    bool changed = false;
+    for (unsigned int c=0; c<n_copies; c++) {
+        QbnCoalesceCopy* copy = &copies[c];
+        if (copy->interferes || merged[copy->from] || merged[copy->to]) {
+            continue;
+        }
+        merged[copy->from] = merged[copy->to] = true;
+        if (is_param[copy->to]) {
+            replace[copy->from] = QBN_TEMP_REF(copy->to);
+        } else {
+            replace[copy->to] = QBN_TEMP_REF(copy->from);
+        }
+        changed = true;
+    }
+    if (changed) {
+        for (int i=0; i<n_blocks; i++) {
+            QbnBlock* block = fn->blocks[i];
+            for (QbnInstr* instr = block->instr; instr->op != QBN_OP_BLOCK_END; instr = qbn_instr_next(instr)) {
+                instr->arg0 = qbn_ssa_resolve(replace, instr->arg0);
+                instr->arg1 = qbn_ssa_resolve(replace, instr->arg1);
+                instr->to = qbn_ssa_resolve(replace, instr->to);
+                if (instr->op == QBN_OP_COPY && instr->arg0 == instr->to) {
+                    instr->op = QBN_OP0;
+                }
+            }
+            if (block->jmp_type == QBN_JUMP_RET_BASE) {
+                block->jmp.ret.value = qbn_ssa_resolve(replace, block->jmp.ret.value);
+            } else if (block->jmp_type == QBN_JUMP_NZ) {
+                block->jmp.dest.cond = qbn_ssa_resolve(replace, block->jmp.dest.cond);
+            }
+        }
+        for (int i=0; i<fn->vec_mems->length; i++) {
+            fn->mems[i].base = qbn_ssa_resolve(replace, fn->mems[i].base);
+            fn->mems[i].index = qbn_ssa_resolve(replace, fn->mems[i].index);
+        }
+    }
+    free(replace);
+    free(instrs);
+    free(merged);
+    free(list);
+    free(first);
+    free(copies);
+    return changed;
+}
+
+void qbn_ssa_coalesce(QbnFn* fn) {
+    bool* is_param = calloc(fn->vec_temps->length + 1, sizeof(bool));
+    if (!is_param) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<fn->vec_params->length; i++) {
+        is_param[QBN_REF_INDEX(fn->params[i])] = true;
+    }
+    while (qbn_ssa_coalesce_round(fn, is_param)) {
+    }
+    free(is_param);
+}
+
+#endif //QBN_SSA_H
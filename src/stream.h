@@ -0,0 +1,47 @@
+#ifndef QBN_STREAM_H
+#define QBN_STREAM_H
+
+#include "qbn.h"
+#include "outbuf.h"
+#include "processing.h"
+
+// Streaming compilation: a function is lowered and its assembly written as soon as it is finished with
+// qbn_fn_finish, then its storage in the context's arenas is reused for the next one. Functions are built
+// one at a time, so memory is bounded by the largest function instead of the whole module. Constants,
+// symbols and data definitions are shared by the module and stay until qbn_stream_end writes the data.
+
+void qbn_stream_begin(QbnContext* context, QbnOutBuf* out) {
+    // the context must not hold functions yet, out is written to until qbn_stream_end
+    assert(context->vec_functions->length == 0);
+    context->stream = out;
+    context->current_section = QBN_SEC_NONE;
+}
+
+void qbn_fn_finish(QbnFn* fn) {
+    // fn has to be the function created last and must not be used afterwards
+    QbnContext* context = fn->context;
+    assert(context->stream != NULL);
+    assert(context->functions[context->vec_functions->length-1] == fn);
+    qbn_process_fn(fn);
+    qbn_emit_fn(fn, context->stream);
+    qbn_outbuf_flush(context->stream);
+
+    util_vector_shrink(context->vec_functions, 1);
+    qbn_fn_release(fn);
+    // no other function has instructions or storage in the arenas
+    qbn_instr_arena_reset(&context->instrs);
+    util_arena_reset(&context->arena);
+}
+
+void qbn_stream_end(QbnContext* context) {
+    // writes the data after the functions, the output is complete afterwards
+    assert(context->stream != NULL);
+    assert(context->vec_functions->length == 0);  // every function is finished
+    QbnOutBuf* out = context->stream;
+    qbn_emit_data_sections(context, out);
+    qbn_outbuf_str(out, ".section .note.GNU-stack,\"\",@progbits\n");
+    qbn_outbuf_flush(out);
+    context->stream = NULL;
+}
+
+#endif //QBN_STREAM_H
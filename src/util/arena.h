@@ -0,0 +1,90 @@
+#ifndef QBN_ARENA_H
+#define QBN_ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "std.h"
+
+// Bump allocator over a list of pages. Nothing is freed on its own, util_arena_reset rewinds to the first
+// page in O(1) and keeps every page for the next round, so a reused arena stops calling malloc once it has
+// seen its largest round. Allocations are 16 byte aligned and may come from several threads.
+
+#define UTIL_ARENA_PAGE 65536
+#define UTIL_ARENA_ALIGN 16
+
+void util_vector_no_memory();  // vector.h
+
+typedef struct UtilArenaPage UtilArenaPage;
+
+struct UtilArenaPage {
+    UtilArenaPage* next;
+    size_t capacity;
+    _Alignas(UTIL_ARENA_ALIGN) unsigned char bytes[];
+};
+
+typedef struct {
+    UtilArenaPage* first;
+    UtilArenaPage* page;  // the page allocations come from, pages after it are free
+    size_t used;          // bytes of the current page
+    pthread_mutex_t lock;
+} UtilArena;
+
+void util_arena_init(UtilArena* arena) {
+    arena->first = NULL;
+    arena->page = NULL;
+    arena->used = 0;
+    pthread_mutex_init(&arena->lock, NULL);
+}
+
+UtilArenaPage* util_arena_next_page(UtilArena* arena, size_t size) {
+    // the next kept page if it is large enough, a new one linked in after the current one otherwise
+    UtilArenaPage* next = arena->page != NULL ? arena->page->next : arena->first;
+    if (next != NULL && next->capacity >= size) {
+        return next;
+    }
+    size_t capacity = MAX(size, UTIL_ARENA_PAGE);
+    UtilArenaPage* page = malloc(sizeof(UtilArenaPage) + capacity);
+    if (!page) {
+        util_vector_no_memory();
+    }
+    page->capacity = capacity;
+    page->next = next;
+    if (arena->page != NULL) {
+        arena->page->next = page;
+    } else {
+        arena->first = page;
+    }
+    return page;
+}
+
+void* util_arena_alloc(UtilArena* arena, size_t size) {
+    size = (size + UTIL_ARENA_ALIGN - 1) & ~(size_t) (UTIL_ARENA_ALIGN - 1);
+    pthread_mutex_lock(&arena->lock);
+    if (arena->page == NULL || arena->used + size > arena->page->capacity) {
+        arena->page = util_arena_next_page(arena, size);
+        arena->used = 0;
+    }
+    void* bytes = arena->page->bytes + arena->used;
+    arena->used += size;
+    pthread_mutex_unlock(&arena->lock);
+    return bytes;
+}
+
+void util_arena_reset(UtilArena* arena) {
+    arena->page = NULL;
+    arena->used = 0;
+}
+
+void util_arena_free(UtilArena* arena) {
+    while (arena->first != NULL) {
+        UtilArenaPage* next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
+    }
+    util_arena_reset(arena);
+    pthread_mutex_destroy(&arena->lock);
+}
+
+#endif //QBN_ARENA_H
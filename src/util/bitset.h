@@ -0,0 +1,66 @@
+
+#ifndef QBN_BITSET_H
+#define QBN_BITSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vector.h"
+
+// Dense bitsets as plain arrays of words. The set operations work a whole word at a time over
+// restrict pointers, so the compiler is free to turn the loops into vector instructions.
+
+typedef unsigned long UtilBitsetWord;
+
+#define UTIL_BITSET_WORD_BITS (sizeof(UtilBitsetWord) * 8)
+#define UTIL_BITSET_WORDS(n_bits) (((n_bits) + UTIL_BITSET_WORD_BITS - 1) / UTIL_BITSET_WORD_BITS)
+
+UtilBitsetWord* util_bitset_new(size_t n_words) {
+    UtilBitsetWord* set = calloc(n_words ? n_words : 1, sizeof(UtilBitsetWord));
+    if (!set) {
+        util_vector_no_memory();
+    }
+    return set;
+}
+
+void util_bitset_set(UtilBitsetWord* set, size_t bit) {
+    set[bit / UTIL_BITSET_WORD_BITS] |= 1UL << (bit % UTIL_BITSET_WORD_BITS);
+}
+
+void util_bitset_unset(UtilBitsetWord* set, size_t bit) {
+    set[bit / UTIL_BITSET_WORD_BITS] &= ~(1UL << (bit % UTIL_BITSET_WORD_BITS));
+}
+
+bool util_bitset_test(const UtilBitsetWord* set, size_t bit) {
+    return (set[bit / UTIL_BITSET_WORD_BITS] >> (bit % UTIL_BITSET_WORD_BITS)) & 1;
+}
+
+void util_bitset_clear(UtilBitsetWord* set, size_t n_words) {
+    memset(set, 0, sizeof(UtilBitsetWord) * n_words);
+}
+
+void util_bitset_copy(UtilBitsetWord* restrict dst, const UtilBitsetWord* restrict src, size_t n_words) {
+    memcpy(dst, src, sizeof(UtilBitsetWord) * n_words);
+}
+
+void util_bitset_or(UtilBitsetWord* restrict dst, const UtilBitsetWord* restrict src, size_t n_words) {
+    for (size_t i=0; i<n_words; i++) {
+        dst[i] |= src[i];
+    }
+}
+
+bool util_bitset_or_andnot(UtilBitsetWord* restrict dst, const UtilBitsetWord* restrict a,
+                           const UtilBitsetWord* restrict b, const UtilBitsetWord* restrict c, size_t n_words) {
+    // dst = a | (b & ~c), returns whether dst changed
+    UtilBitsetWord changed = 0;
+    for (size_t i=0; i<n_words; i++) {
+        UtilBitsetWord word = a[i] | (b[i] & ~c[i]);
+        changed |= word ^ dst[i];
+        dst[i] = word;
+    }
+    return changed != 0;
+}
+
+#endif //QBN_BITSET_H
@@ -0,0 +1,105 @@
+
+#ifndef QBN_POOL_H
+#define QBN_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "std.h"
+#include "vector.h"
+
+// Runs tasks 0..n_tasks-1 on a number of threads. Every worker starts with a contiguous range of tasks,
+// takes from its front and, once it is empty, steals single tasks from the back of the others.
+
+typedef void (*UtilPoolTask)(void* arg, int index);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int top;     // next task of the owner
+    int bottom;  // end of the range, thieves take bottom-1
+} UtilPoolQueue;
+
+typedef struct {
+    UtilPoolQueue* queues;
+    int n_workers;
+    UtilPoolTask task;
+    void* arg;
+} UtilPool;
+
+typedef struct {
+    UtilPool* pool;
+    int id;
+} UtilPoolWorker;
+
+bool util_pool_take(UtilPoolQueue* queue, bool steal, int* index) {
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->top < queue->bottom) {
+        *index = steal ? --queue->bottom : queue->top++;
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+void* util_pool_work(void* arg) {
+    UtilPoolWorker* worker = arg;
+    UtilPool* pool = worker->pool;
+    int index;
+    while (true) {
+        bool found = util_pool_take(&pool->queues[worker->id], false, &index);
+        for (int i=1; !found && i<pool->n_workers; i++) {
+            found = util_pool_take(&pool->queues[(worker->id + i) % pool->n_workers], true, &index);
+        }
+        if (!found) {
+            // tasks don't spawn tasks, all queues are empty for good
+            return NULL;
+        }
+        pool->task(pool->arg, index);
+    }
+}
+
+void util_pool_run(int n_tasks, int n_threads, UtilPoolTask task, void* arg) {
+    // returns when all tasks are done, the calling thread works too
+    int n_workers = MIN(n_threads, n_tasks);
+    if (n_workers <= 1) {
+        for (int i=0; i<n_tasks; i++) {
+            task(arg, i);
+        }
+        return;
+    }
+
+    UtilPool pool = {malloc(sizeof(UtilPoolQueue) * n_workers), n_workers, task, arg};
+    UtilPoolWorker* workers = malloc(sizeof(UtilPoolWorker) * n_workers);
+    pthread_t* threads = malloc(sizeof(pthread_t) * n_workers);
+    bool* started = calloc(n_workers, sizeof(bool));
+    if (!pool.queues || !workers || !threads || !started) {
+        util_vector_no_memory();
+    }
+    for (int i=0; i<n_workers; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].top = (int) ((long) n_tasks * i / n_workers);
+        pool.queues[i].bottom = (int) ((long) n_tasks * (i+1) / n_workers);
+        workers[i] = (UtilPoolWorker) {&pool, i};
+    }
+    for (int i=1; i<n_workers; i++) {
+        // if a thread can't be started, its tasks get stolen
+        started[i] = pthread_create(&threads[i], NULL, util_pool_work, &workers[i]) == 0;
+    }
+    util_pool_work(&workers[0]);
+    for (int i=1; i<n_workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    for (int i=0; i<n_workers; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(started);
+    free(threads);
+    free(workers);
+    free(pool.queues);
+}
+
+#endif //QBN_POOL_H
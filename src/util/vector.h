@@ -1,4 +1,3 @@
-
 #ifndef QBN_VECTOR_H
 #define QBN_VECTOR_H
 
@@ -8,6 +7,12 @@
 #include <string.h>
 
 #include "std.h"
+#include "arena.h"
+
+// Growable arrays. The elements are reached through a pointer owned by the user (data_pointer), which is
+// updated whenever the storage moves. The initial capacity is stored inline right after the header, so a
+// vector that stays small costs a single allocation. Once it outgrows that, the storage moves to the heap
+// and grows with realloc, which the C library turns into mremap for large blocks.
 
 #define UTIL_VECTOR_DEFAULT_CAPACITY 20
 
@@ -16,6 +21,8 @@ typedef struct {
     size_t element_size;
     size_t length;
     size_t capacity;
+    UtilArena* arena;  // storage comes from the arena and is given up with it, NULL for malloc
+    _Alignas(16) unsigned char small[];  // the initial capacity
 } UtilVector;
 
 void util_vector_no_memory() {
@@ -23,37 +30,67 @@ void util_vector_no_memory() {
     exit(1);
 }
 
+void util_vector_init(UtilVector* vec, size_t element_size, size_t capacity, void** data_pointer) {
+    vec->data = data_pointer;
+    *vec->data = vec->small;
+    vec->element_size = element_size;
+    vec->length = 0;
+    vec->capacity = capacity;
+    vec->arena = NULL;
+}
+
 UtilVector* util_vector_new(size_t element_size, size_t capacity, void** data_pointer) {
-    UtilVector* vec = (UtilVector*) malloc(sizeof(UtilVector));
+    if (capacity == 0) {
+        capacity = UTIL_VECTOR_DEFAULT_CAPACITY;
+    }
+    UtilVector* vec = (UtilVector*) malloc(sizeof(UtilVector) + element_size * capacity);
     if (!vec) {
         util_vector_no_memory();
     }
+    util_vector_init(vec, element_size, capacity, data_pointer);
+    return vec;
+}
+
+UtilVector* util_vector_new_in(UtilArena* arena, size_t element_size, size_t capacity, void** data_pointer) {
+    // like util_vector_new, util_vector_free leaves the memory to the arena
     if (capacity == 0) {
         capacity = UTIL_VECTOR_DEFAULT_CAPACITY;
     }
-    vec->data = data_pointer;
-    *vec->data = malloc(element_size * capacity);
-    if (!*vec->data) {
-        util_vector_no_memory();
-    }
-    vec->element_size = element_size;
-    vec->length = 0;
-    vec->capacity = capacity;
+    UtilVector* vec = util_arena_alloc(arena, sizeof(UtilVector) + element_size * capacity);
+    util_vector_init(vec, element_size, capacity, data_pointer);
+    vec->arena = arena;
     return vec;
 }
 
-void util_vector_grow(UtilVector* vec, size_t count) {
-    if (vec->length + count > vec->capacity) {
-        size_t new_capacity = vec->capacity + vec->capacity / 2;
-        void* new_data = malloc(vec->element_size * new_capacity);
-        if (!new_data) {
-            util_vector_no_memory();
-        }
+void util_vector_reserve(UtilVector* vec, size_t count) {
+    // makes room for count more elements, the length stays
+    if (vec->length + count <= vec->capacity) {
+        return;
+    }
+    size_t new_capacity = MAX(vec->capacity * 2, vec->length + count);
+    size_t size = vec->element_size * new_capacity;
+    void* new_data;
+    if (vec->arena != NULL) {
+        // the old storage stays in the arena until it is reset
+        new_data = util_arena_alloc(vec->arena, size);
         memcpy(new_data, *vec->data, vec->length * vec->element_size);
-        free(*vec->data);
-        *vec->data = new_data;
-        vec->capacity = new_capacity;
+    } else if (*vec->data == vec->small) {
+        new_data = malloc(size);
+        if (new_data) {
+            memcpy(new_data, vec->small, vec->length * vec->element_size);
+        }
+    } else {
+        new_data = realloc(*vec->data, size);
     }
+    if (!new_data) {
+        util_vector_no_memory();
+    }
+    *vec->data = new_data;
+    vec->capacity = new_capacity;
+}
+
+void util_vector_grow(UtilVector* vec, size_t count) {
+    util_vector_reserve(vec, count);
     vec->length += count;
 }
 
@@ -67,7 +104,13 @@ void util_vector_clear(UtilVector* vec) {
 }
 
 void util_vector_free(UtilVector* vec) {
-    free(*vec->data);
+    if (vec->arena != NULL) {
+        *vec->data = NULL;
+        return;
+    }
+    if (*vec->data != vec->small) {
+        free(*vec->data);
+    }
     *vec->data = NULL;
     free(vec);
 }